@@ -1,276 +1,535 @@
-#include <vector>
+#include <cassert>
+#include <cstring>
+#include <memory>
+#include <unordered_set>
 
 #include "BTree.h"
 #include "page_allocator.h"
 
-BufferPointer new_empty_leaf(BufferAllocator& ba) {
-	auto new_page = allocate_page(ba);
-	auto node = (BTNode*)new_page.data();
-	*node = BTNode {
-		.header = BTNodeHeader {
-			.is_leaf= true,
-			.count = 0,
+#define BTREE_TEMPLATE template <typename Key, typename Value, typename Compare, size_t NodeSize>
+#define BTREE BTree<Key, Value, Compare, NodeSize>
+
+/*
+ * Node layout
+ */
+
+template <typename Entry>
+static Entry* plain_entries(BTNodeHeader* header) {
+	return (Entry*)((uint8_t*)header + sizeof(BTNodeHeader));
+}
+
+/*
+ * Packed node encoding
+ */
+
+// The largest value storable in `width` bytes.
+static uint64_t width_max(uint8_t width) {
+	return width >= sizeof(uint64_t) ? MAX_KEY_ID : (1ull << (8 * width)) - 1;
+}
+
+static uint8_t width_for(uint64_t value) {
+	uint8_t width = 1;
+	while (value > width_max(width)) width *= 2;
+	return width;
+}
+
+static uint64_t read_packed(uint8_t* src, uint8_t width) {
+	uint64_t value = 0;
+	memcpy(&value, src, width);
+	return value;
+}
+
+static void write_packed(uint8_t* dest, uint8_t width, uint64_t value) {
+	memcpy(dest, &value, width);
+}
+
+static PackedNodeHeader* packed_header(BTNodeHeader* header) {
+	return (PackedNodeHeader*)((uint8_t*)header + sizeof(BTNodeHeader));
+}
+
+static uint8_t* packed_keys(BTNodeHeader* header) {
+	return (uint8_t*)packed_header(header) + sizeof(PackedNodeHeader);
+}
+
+static uint8_t* packed_values(BTNodeHeader* header) {
+	return packed_keys(header) + header->count * packed_header(header)->key_width;
+}
+
+static uint64_t packed_key_at(BTNodeHeader* header, size_t i) {
+	auto packing = packed_header(header);
+	auto raw = read_packed(packed_keys(header) + i * packing->key_width, packing->key_width);
+	// All ones is reserved for the MAX_KEY_ID sentinel in interior nodes.
+	if (raw == width_max(packing->key_width)) return MAX_KEY_ID;
+	return packing->key_base + raw;
+}
+
+static uint64_t packed_value_at(BTNodeHeader* header, size_t i) {
+	auto packing = packed_header(header);
+	auto raw = read_packed(packed_values(header) + i * packing->value_width, packing->value_width);
+	return packing->value_base + (raw << packing->value_shift);
+}
+
+// Packs `count` entries into the node at `out`, returning false if they
+// don't fit. Both fields of each entry are 64 bit integers.
+template <typename Entry>
+static bool pack_entries(BTNodeHeader* out, Entry* pairs, size_t count) {
+	KeyId key_base = count > 0 && pairs[0].key != MAX_KEY_ID ? pairs[0].key : 0;
+	KeyId max_key_delta = 0;
+	BlockID value_base = MAX_KEY_ID;
+	for (size_t i = 0; i < count; i++) {
+		if (pairs[i].key != MAX_KEY_ID) {
+			max_key_delta = pairs[i].key - key_base;
 		}
+		value_base = std::min(value_base, (BlockID)pairs[i].value);
+	}
+
+	// Block ids are page aligned, so shift away the shared low zero bits.
+	BlockID value_bits = 0;
+	for (size_t i = 0; i < count; i++) {
+		value_bits |= pairs[i].value - value_base;
+	}
+	uint8_t value_shift = value_bits ? __builtin_ctzll(value_bits) : 0;
+	BlockID max_value_delta = 0;
+	for (size_t i = 0; i < count; i++) {
+		max_value_delta = std::max(max_value_delta, (pairs[i].value - value_base) >> value_shift);
+	}
+
+	// Keys need one spare value for the sentinel.
+	uint8_t key_width = width_for(max_key_delta + 1);
+	uint8_t value_width = width_for(max_value_delta);
+
+	size_t size = sizeof(BTNodeHeader) + sizeof(PackedNodeHeader) + count * (key_width + value_width);
+	if (size > PAGE_SIZE) return false;
+
+	out->format = NodeFormat::Packed;
+	*packed_header(out) = PackedNodeHeader {
+		.key_base = key_base,
+		.value_base = count > 0 ? value_base : 0,
+		.key_width = key_width,
+		.value_width = value_width,
+		.value_shift = value_shift,
 	};
 
-	for (size_t i = 0; i < MAX_KEY_PAIRS; i++) {
-		node->pairs[i].key = MAX_KEY_ID;
+	auto keys = packed_keys(out);
+	auto values = packed_values(out);
+	for (size_t i = 0; i < count; i++) {
+		KeyId key = pairs[i].key;
+		auto raw_key = key == MAX_KEY_ID ? width_max(key_width) : key - key_base;
+		write_packed(keys + i * key_width, key_width, raw_key);
+		write_packed(values + i * value_width, value_width,
+				(pairs[i].value - value_base) >> value_shift);
 	}
+	return true;
+}
 
-	new_page.set_dirty();
-	return new_page;
+static bool pack_nodes(BufferAllocator& ba) {
+	auto super_block_raw = ba.load(0);
+	return ((SuperBlock*)super_block_raw.data())->pack_nodes;
 }
 
-BufferPointer new_empty_node(BufferAllocator& ba) {
-	auto new_page = allocate_page(ba);
-	auto node = (BTNode*)new_page.data();
-	*node = BTNode {
+BTREE_TEMPLATE
+Key BTREE::Node::key_at(size_t i) {
+	if constexpr (PACKABLE) {
+		if (header.format == NodeFormat::Packed) return packed_key_at(&header, i);
+	}
+	return header.is_leaf
+		? plain_entries<Record>(&header)[i].key
+		: plain_entries<Child>(&header)[i].key;
+}
+
+BTREE_TEMPLATE
+Value BTREE::Node::value_at(size_t i) {
+	if constexpr (PACKABLE) {
+		if (header.format == NodeFormat::Packed) return packed_value_at(&header, i);
+	}
+	return plain_entries<Record>(&header)[i].value;
+}
+
+BTREE_TEMPLATE
+BlockID BTREE::Node::child_at(size_t i) {
+	if constexpr (PACKABLE) {
+		if (header.format == NodeFormat::Packed) return packed_value_at(&header, i);
+	}
+	return plain_entries<Child>(&header)[i].value;
+}
+
+// The most entries a node may hold. Interior nodes split one entry earlier.
+BTREE_TEMPLATE
+template <typename Entry>
+size_t BTREE::node_capacity(BufferAllocator& ba) {
+	if constexpr (PACKABLE) {
+		if (pack_nodes(ba)) return MAX_PACKED;
+	}
+	return plain_capacity<Entry>;
+}
+
+BTREE_TEMPLATE
+template <typename Entry>
+auto BTREE::empty_node() -> Unpacked<Entry> {
+	return Unpacked<Entry> {
 		.header = BTNodeHeader {
-			.is_leaf= false,
+			.is_leaf = std::is_same_v<Entry, Record>,
 			.count = 0,
 		}
 	};
+}
 
-	for (size_t i = 0; i < MAX_KEY_PAIRS; i++) {
-		node->pairs[i].key = MAX_KEY_ID;
+BTREE_TEMPLATE
+template <typename Entry>
+auto BTREE::unpack(Node* node) -> Unpacked<Entry> {
+	Unpacked<Entry> out = {
+		.header = node->header,
+	};
+	for (size_t i = 0; i < node->header.count; i++) {
+		out.pairs[i].key = node->key_at(i);
+		if constexpr (std::is_same_v<Entry, Record>) {
+			out.pairs[i].value = node->value_at(i);
+		} else {
+			out.pairs[i].value = node->child_at(i);
+		}
 	}
+	return out;
+}
 
-	new_page.set_dirty();
-	return new_page;
+BTREE_TEMPLATE
+auto BTREE::unpack_leaf(Node* node) -> Leaf {
+	return unpack<Record>(node);
+}
+
+BTREE_TEMPLATE
+auto BTREE::unpack_interior(Node* node) -> Interior {
+	return unpack<Child>(node);
+}
+
+BTREE_TEMPLATE
+auto BTREE::unpack_node(Node* node) -> AnyNode {
+	if (node->header.is_leaf) return unpack_leaf(node);
+	return unpack_interior(node);
 }
 
-BufferPointer clone_node(BufferAllocator& ba, BTNode* old_node) {
+BTREE_TEMPLATE
+template <typename Entry>
+BufferPointer BTREE::write_entries(BufferAllocator& ba, Unpacked<Entry>& node) {
 	auto new_page = allocate_page(ba);
-	auto node = (BTNode*)new_page.data();
-	*node = *old_node;
+	auto out = (Node*)new_page.data();
+	out->header = node.header;
+
+	bool packed = false;
+	if constexpr (PACKABLE) {
+		packed = pack_nodes(ba) && pack_entries(&out->header, node.pairs, node.header.count);
+	}
+	if (!packed) {
+		assert(node.header.count <= plain_capacity<Entry>);
+		out->header.format = NodeFormat::Plain;
+		auto entries = plain_entries<Entry>(&out->header);
+		for (size_t i = 0; i < plain_capacity<Entry>; i++) {
+			entries[i] = i < node.header.count
+				? node.pairs[i]
+				: Entry { .key = MAX_KEY };
+		}
+	}
 
 	new_page.set_dirty();
 	return new_page;
 }
 
-bool BTNode::enough_entries() {
-	return this->header.count >= MAX_KEY_PAIRS/2;
+BTREE_TEMPLATE
+BufferPointer BTREE::write_node(BufferAllocator& ba, Leaf& node) {
+	return write_entries(ba, node);
+}
+
+BTREE_TEMPLATE
+BufferPointer BTREE::write_node(BufferAllocator& ba, Interior& node) {
+	return write_entries(ba, node);
+}
+
+BTREE_TEMPLATE
+BufferPointer BTREE::write_node(BufferAllocator& ba, AnyNode& node) {
+	return std::visit([&](auto& unpacked) {
+		return write_entries(ba, unpacked);
+	}, node);
 }
 
-bool BTNode::can_share_entry(){
-	return this->header.count >= (MAX_KEY_PAIRS/2)+1;
+BTREE_TEMPLATE
+BufferPointer BTREE::new_empty_leaf(BufferAllocator& ba) {
+	auto node = empty_node<Record>();
+	return write_node(ba, node);
 }
 
-std::optional<BlockID> search_btree(BufferAllocator& ba, BlockID id, KeyId key) {
+// Values are compared bytewise, they only need to be trivially copyable.
+template <typename Value>
+static bool same_value(Value a, Value b) {
+	return memcmp(&a, &b, sizeof(Value)) == 0;
+}
+
+BTREE_TEMPLATE
+auto BTREE::search(BufferAllocator& ba, BlockID id, Key key, Finger* finger) -> std::optional<Value> {
 	auto node_raw = ba.load(id);
-	auto node = (BTNode*)node_raw.data();
+	auto node = (Node*)node_raw.data();
 
 	if (node->header.is_leaf) {
-		return search_leaf(node, key);
-	} else {
-		return search_node(ba, node, key);
+		if (finger) finger->leaf = id;
+		for (size_t i = 0; i < node->header.count; i++) {
+			if (equal(node->key_at(i), key)) {
+				return node->value_at(i);
+			}
+		}
+		return {};
+	}
+
+	if (node->message_count() > 0) {
+		// Messages further up would make a finger to the leaf stale.
+		if (finger) finger->reset();
+		finger = nullptr;
+
+		if (auto message = find_message(node, key)) {
+			if (message->is_delete) return {};
+			Value value = message->value;
+			return value;
+		}
 	}
-}
 
-std::optional<BlockID> search_leaf(BTNode* node, KeyId key) {
 	for (size_t i = 0; i < node->header.count; i++) {
-		if (node->pairs[i].key == key) {
-			auto resp = node->pairs[i].value;
-			return resp;
+		if (less(key, node->key_at(i))) {
+			if (finger) {
+				finger->descend(i, node->header.count, [&](size_t j) { return node->key_at(j); });
+			}
+			return search(ba, node->child_at(i), key, finger);
 		}
 	}
 	return {};
 }
 
-std::optional<BlockID> search_node(BufferAllocator& ba, BTNode* node, KeyId key) {
-	if (node->header.count < 1 ) {
-		return {};
+BTREE_TEMPLATE
+void BTREE::find_path(BufferAllocator& ba, BlockID id, Key key, std::vector<BlockID>& path) {
+	path.clear();
+	while (true) {
+		path.push_back(id);
+		auto node_raw = ba.load(id);
+		auto node = (Node*)node_raw.data();
+		if (node->header.is_leaf) return;
+		if (node->message_count() > 0 && find_message(node, key)) return;
+
+		size_t i = 0;
+		while (i + 1 < node->header.count && !less(key, node->key_at(i))) i++;
+		id = node->child_at(i);
 	}
-
-	size_t i = 0;
-	for (; i < node->header.count; i++) {
-		if (key < node->pairs[i].key) {
-			BlockID subleaf_id = node->pairs[i].value;
-			return search_btree(ba, subleaf_id, key);
-		}
-	}
-	return {};
 }
 
-InsertPropagation insert_btree(BufferAllocator& ba, std::unordered_set<BlockID>& freed, BlockID id, KeyPair key_pair) {
+BTREE_TEMPLATE
+auto BTREE::insert(BufferAllocator& ba, FreedBlocks& freed, BlockID id, Record record,
+		Finger* finger) -> InsertPropagation {
 	auto node_raw = ba.load(id);
-	auto node = (BTNode*)node_raw.data();
+	auto node = (Node*)node_raw.data();
 
 	// Allow the page allocator to reclaim the copied page once
 	// this insert is complete
 	freed.insert(id);
 
 	if (node->header.is_leaf) {
-		return insert_leaf(ba, freed, node, key_pair);
+		auto leaf = unpack_leaf(node);
+		return insert_leaf(ba, &leaf, record, finger);
 	} else {
-		return insert_node(ba, freed, node, key_pair);
+		auto interior = unpack_interior(node);
+		return insert_node(ba, freed, &interior, record, finger);
 	}
 }
 
-InsertPropagation insert_leaf(BufferAllocator& ba, std::unordered_set<BlockID>& freed, BTNode* node, KeyPair key_pair) {
-	std::vector<KeyPair> temp_key_pairs;
-	bool pushed = false;
-	bool did_replace = false;
-	BlockID replaced = 0;	
-	for (size_t i = 0; i < node->header.count; i++) {
-		if (!pushed && key_pair.key == node->pairs[i].key) {
-			pushed = true;
-			did_replace = node->pairs[i].value != key_pair.value;
-			replaced = node->pairs[i].value;
-			temp_key_pairs.push_back(key_pair);
-		} else if (!pushed && key_pair.key < node->pairs[i].key) {
-			pushed = true;
-			temp_key_pairs.push_back(key_pair);
-			temp_key_pairs.push_back(node->pairs[i]);
-		} else {
-			temp_key_pairs.push_back(node->pairs[i]);
-		}
+/*
+ * The entries of a node with one entry inserted (or replaced) at `pos`. This
+ * lets inserts merge straight into the destination node(s) rather than
+ * building a temporary copy of the entries first.
+ */
+template <typename Unpacked, typename Entry>
+struct MergedPairs {
+	Unpacked* node;
+	size_t pos;
+	Entry inserted;
+	bool replace;
+
+	size_t size() const {
+		return replace ? node->header.count : node->header.count + 1;
 	}
-	if (!pushed) {
-		temp_key_pairs.push_back(key_pair);
+
+	Entry operator[](size_t i) const {
+		if (i < pos) return node->pairs[i];
+		if (i == pos) return inserted;
+		return replace ? node->pairs[i] : node->pairs[i-1];
+	}
+};
+
+BTREE_TEMPLATE
+auto BTREE::insert_leaf(BufferAllocator& ba, Leaf* node, Record record, Finger* finger) -> InsertPropagation {
+	size_t pos = 0;
+	for (; pos < node->header.count; pos++) {
+		if (!less(node->pairs[pos].key, record.key)) break;
+	}
+
+	bool did_replace = false;
+	Value replaced {};
+	bool exists = pos < node->header.count && equal(node->pairs[pos].key, record.key);
+	if (exists) {
+		did_replace = !same_value<Value>(node->pairs[pos].value, record.value);
+		replaced = node->pairs[pos].value;
 	}
-	
-	if (temp_key_pairs.size() <= MAX_KEY_PAIRS) {
-		// We don't split
 
-		// TODO: this should probably be a function
-		auto new_leaf_raw = new_empty_leaf(ba);
-		auto new_leaf = (BTNode*)new_leaf_raw.data();
-		new_leaf->header.count = temp_key_pairs.size();
-		new_leaf->header.is_leaf = true;
+	auto merged = MergedPairs<Leaf, Record> {
+		.node = node,
+		.pos = pos,
+		.inserted = record,
+		.replace = exists,
+	};
+
+	if (merged.size() <= node_capacity<Record>(ba)) {
+		// We don't split
+		auto new_leaf = empty_node<Record>();
+		new_leaf.header.count = merged.size();
 
-		for (size_t i = 0; i < temp_key_pairs.size(); i++) {
-			new_leaf->pairs[i] = temp_key_pairs[i];
+		for (size_t i = 0; i < merged.size(); i++) {
+			new_leaf.pairs[i] = merged[i];
 		}
 
-		new_leaf_raw.set_dirty();
+		auto new_leaf_raw = write_node(ba, new_leaf);
+		if (finger) finger->leaf = new_leaf_raw.id();
 
 		return InsertPropagation {
 			.is_split = false,
 			.update = new_leaf_raw.id(),
+			.did_insert = !exists,
 			.did_replace = did_replace,
 			.replaced = replaced,
 		};
 	} else {
 		//perform a split
 
-		auto split_at = temp_key_pairs.size()/2;
-		auto promoting = temp_key_pairs[split_at].key;
+		auto split_at = merged.size()/2;
+		auto promoting = merged[split_at].key;
 
-		auto new_left_raw = new_empty_leaf(ba);
-		auto new_left = (BTNode*)new_left_raw.data();
-		new_left->header.is_leaf = true;
+		auto new_left = empty_node<Record>();
 
 		// TODO: consider the split here
 		for (size_t i = 0; i < split_at; i++) {
-			new_left->pairs[i] = temp_key_pairs[i];
-			new_left->header.count++;
+			new_left.pairs[i] = merged[i];
+			new_left.header.count++;
 		}
 
-		auto new_right_raw = new_empty_leaf(ba);
-		auto new_right = (BTNode*)new_right_raw.data();
-		new_right->header.is_leaf = true;
+		auto new_right = empty_node<Record>();
 
-		for (size_t i = split_at; i < temp_key_pairs.size(); i++) {
-			new_right->pairs[i-split_at] = temp_key_pairs[i];
-			new_right->header.count++;
+		for (size_t i = split_at; i < merged.size(); i++) {
+			new_right.pairs[i-split_at] = merged[i];
+			new_right.header.count++;
 		}
 
-		new_left_raw.set_dirty();
-		new_right_raw.set_dirty();
+		auto new_left_raw = write_node(ba, new_left);
+		auto new_right_raw = write_node(ba, new_right);
+
+		if (finger && less(record.key, promoting)) {
+			finger->leaf = new_left_raw.id();
+			finger->high = promoting;
+		} else if (finger) {
+			finger->leaf = new_right_raw.id();
+			finger->has_low = true;
+			finger->low = promoting;
+		}
 
 		return InsertPropagation {
 			.is_split = true,
 			.key = promoting,
 			.left = new_left_raw.id(),
 			.right = new_right_raw.id(),
+			.did_insert = !exists,
 			.did_replace = did_replace,
 			.replaced = replaced,
 		};
 	}
 }
 
-InsertPropagation insert_node(BufferAllocator& ba, std::unordered_set<BlockID>& freed, BTNode* node, KeyPair key_pair) {
+BTREE_TEMPLATE
+auto BTREE::insert_node(BufferAllocator& ba, FreedBlocks& freed, Interior* node, Record record,
+		Finger* finger) -> InsertPropagation {
 
 	size_t i = 0;
 	for (; i < node->header.count; i++) {
-		if (key_pair.key < node->pairs[i].key) {
+		if (less(record.key, node->pairs[i].key)) {
 			break;
 		}
 	}
 
+	if (finger) {
+		finger->descend(i, node->header.count, [&](size_t j) { return node->pairs[j].key; });
+	}
+
 	BlockID subtree = node->pairs[i].value;
-	auto insert_prop = insert_btree(ba, freed, subtree, key_pair);
+	auto insert_prop = insert(ba, freed, subtree, record, finger);
 
 	if (insert_prop.is_split) {
-		std::vector<KeyPair> temp_key_pairs;
-		for (size_t j = 0; j < node->header.count; j++) {
-			// also push in the insertee
-			if (j == i) {
-				temp_key_pairs.push_back(KeyPair {
-						.key = insert_prop.key,
-						.value = insert_prop.left,
-						});
-				temp_key_pairs.push_back(node->pairs[j]);
-				temp_key_pairs[temp_key_pairs.size()-1].value = insert_prop.right;
-			} else {
-				temp_key_pairs.push_back(node->pairs[j]);
-			}
-
-		}
+		// The split child's entry now points at the right half, with the
+		// left half inserted in front of it.
+		Child right_pair = node->pairs[i];
+		right_pair.value = insert_prop.right;
+		auto merged = MergedPairs<Interior, Child> {
+			.node = node,
+			.pos = i,
+			.inserted = Child {
+				.key = insert_prop.key,
+				.value = insert_prop.left,
+			},
+			.replace = false,
+		};
+		auto entry = [&](size_t j) {
+			return j == i+1 ? right_pair : merged[j];
+		};
 
 		// test for split and propagate.
-		if (temp_key_pairs.size() >= MAX_KEY_PAIRS) {
+		if (merged.size() >= node_capacity<Child>(ba)) {
 			// TODO split and propagate
-			auto split_at = temp_key_pairs.size() / 2;
-			auto promoting = temp_key_pairs[split_at];
+			auto split_at = merged.size() / 2;
+			auto promoting = entry(split_at);
 
-			auto new_left_raw = new_empty_node(ba);
-			auto new_left = (BTNode*)new_left_raw.data();
+			auto new_left = empty_node<Child>();
 
 			// TODO: consider the split here
-			for (size_t i = 0; i <= split_at; i++) {
-				new_left->pairs[i] = temp_key_pairs[i];
-				new_left->header.count++;
+			for (size_t j = 0; j <= split_at; j++) {
+				new_left.pairs[j] = entry(j);
+				new_left.header.count++;
 			}
-			new_left->pairs[split_at].key = MAX_KEY_ID;
+			new_left.pairs[split_at].key = MAX_KEY;
 
-			auto new_right_raw = new_empty_node(ba);
-			auto new_right = (BTNode*)new_right_raw.data();
+			auto new_right = empty_node<Child>();
 
-			for (size_t i = split_at+1; i < temp_key_pairs.size(); i++) {
-				new_right->pairs[i-(split_at+1)] = temp_key_pairs[i];
-				new_right->header.count++;
+			for (size_t j = split_at+1; j < merged.size(); j++) {
+				new_right.pairs[j-(split_at+1)] = entry(j);
+				new_right.header.count++;
 			}
 
-			new_left_raw.set_dirty();
-			new_right_raw.set_dirty();
+			auto new_left_raw = write_node(ba, new_left);
+			auto new_right_raw = write_node(ba, new_right);
 
 			return InsertPropagation{
 				.is_split = true,
 				.key = promoting.key,
 				.left = new_left_raw.id(),
 				.right = new_right_raw.id(),
+				.did_insert = insert_prop.did_insert,
 				.did_replace = insert_prop.did_replace,
 				.replaced = insert_prop.replaced,
 			};
-			
-		} else { 
+
+		} else {
 			// we don't split
-			// TODO: this should probably be a function
-			auto new_node_raw = new_empty_node(ba);
-			auto new_node = (BTNode*)new_node_raw.data();
-			new_node->header.count = temp_key_pairs.size();
+			auto new_node = empty_node<Child>();
+			new_node.header.count = merged.size();
 
-			for (size_t i = 0; i < temp_key_pairs.size(); i++) {
-				new_node->pairs[i] = temp_key_pairs[i];
+			for (size_t j = 0; j < merged.size(); j++) {
+				new_node.pairs[j] = entry(j);
 			}
 
-			new_node_raw.set_dirty();
+			auto new_node_raw = write_node(ba, new_node);
 
 			return InsertPropagation {
 				.is_split = false,
 				.update = new_node_raw.id(),
+				.did_insert = insert_prop.did_insert,
 				.did_replace = insert_prop.did_replace,
 				.replaced = insert_prop.replaced,
 			};
@@ -278,94 +537,178 @@ InsertPropagation insert_node(BufferAllocator& ba, std::unordered_set<BlockID>&
 
 	} else {
 		// No split, just update to node to point at new child
-		auto new_node_raw = clone_node(ba, node);
-		auto new_node = (BTNode*)new_node_raw.data();
-		new_node->pairs[i].value = insert_prop.update;
+		auto new_node = *node;
+		new_node.pairs[i].value = insert_prop.update;
 
-		new_node_raw.set_dirty();
+		auto new_node_raw = write_node(ba, new_node);
 
 		return InsertPropagation {
 			.is_split = false,
 			.update = new_node_raw.id(),
+			.did_insert = insert_prop.did_insert,
 			.did_replace = insert_prop.did_replace,
 			.replaced = insert_prop.replaced,
 		};
 	}
 }
 
-
-KeyPair find_min_leaf(BufferAllocator& ba, BTNode* node) {
-	if (node->header.count == 0) return KeyPair{};
-
-	return node->pairs[0];
+BTREE_TEMPLATE
+void BTREE::scan(BufferAllocator& ba, BlockID id, const std::function<void(Key, Value)>& visit) {
+	scan(ba, id, MIN_KEY, MAX_KEY, visit);
 }
 
-KeyPair find_max_leaf(BufferAllocator& ba, BTNode* node) {
-	if (node->header.count == 0) return KeyPair{};
-
-	return node->pairs[node->header.count-1];
+BTREE_TEMPLATE
+void BTREE::scan(BufferAllocator& ba, BlockID id, Key low, Key high,
+		const std::function<void(Key, Value)>& visit) {
+	scan_node(ba, id, low, high, Messages {}, [&](Key key, Value value) {
+		visit(key, value);
+		return true;
+	});
 }
 
-KeyPair find_max_node(BufferAllocator& ba, BTNode* node);
-KeyPair find_min_node(BufferAllocator& ba, BTNode* node);
+BTREE_TEMPLATE
+bool BTREE::scan_until(BufferAllocator& ba, BlockID id, Key low, Key high,
+		const std::function<bool(Key, Value)>& visit) {
+	return scan_node(ba, id, low, high, Messages {}, visit);
+}
 
-KeyPair find_max_btree(BufferAllocator& ba, BlockID id) {
-	auto node_raw = ba.load(id);
-	auto node = (BTNode*)node_raw.data();
+BTREE_TEMPLATE
+void BTREE::diff(BufferAllocator& ba, BlockID a, BlockID b, const std::function<void(Key)>& visit) {
+	// Each tree's nodes that the other doesn't have, all of one height and
+	// in key order. Nodes are copied on write, so a block in both frontiers
+	// is a subtree both trees share, and only nodes of the same height can
+	// be one.
+	std::vector<BlockID> sides[2] = {{a}, {b}};
+	size_t heights[2] = {height(ba, a), height(ba, b)};
+	// Keys with a message in a node that differs, which may override what
+	// either tree's leaves hold.
+	std::vector<Key> buffered;
+	while (true) {
+		if (heights[0] == heights[1]) {
+			std::unordered_set<BlockID> in_a(sides[0].begin(), sides[0].end());
+			std::unordered_set<BlockID> shared;
+			for (auto id : sides[1]) {
+				if (in_a.contains(id)) shared.insert(id);
+			}
+			for (auto& side : sides) {
+				std::erase_if(side, [&](BlockID id) { return shared.contains(id); });
+			}
+			if (heights[0] == 0) break;
+		}
 
-	if (node->header.is_leaf) {
-		return find_max_leaf(ba, node);
-	} else {
-		return find_max_node(ba, node);
+		// Descend the taller tree, or both.
+		auto tallest = std::max(heights[0], heights[1]);
+		for (size_t s = 0; s < 2; s++) {
+			if (heights[s] != tallest) continue;
+			std::vector<BlockID> children;
+			for (auto id : sides[s]) {
+				auto node_raw = ba.load(id);
+				auto node = (Node*)node_raw.data();
+				for (size_t i = 0; i < node->header.count; i++) {
+					children.push_back(node->child_at(i));
+				}
+				for (size_t i = 0; i < node->message_count(); i++) {
+					buffered.push_back(node->message_at(i).key);
+				}
+			}
+			sides[s] = std::move(children);
+			heights[s]--;
+		}
 	}
-}
 
-KeyPair find_min_btree(BufferAllocator& ba, BlockID id) {
-	auto node_raw = ba.load(id);
-	auto node = (BTNode*)node_raw.data();
+	// Each key is in one leaf of a tree, so one the trees disagree on is
+	// in the leaves left over from either.
+	std::sort(buffered.begin(), buffered.end(), less);
+	Records records[2];
+	for (size_t s = 0; s < 2; s++) {
+		for (auto id : sides[s]) {
+			auto node_raw = ba.load(id);
+			auto node = (Node*)node_raw.data();
+			for (size_t i = 0; i < node->header.count; i++) {
+				auto key = node->key_at(i);
+				if (std::binary_search(buffered.begin(), buffered.end(), key, less)) continue;
+				records[s].push_back(Record { .key = key, .value = node->value_at(i) });
+			}
+		}
+	}
+	size_t i = 0, j = 0;
+	while (i < records[0].size() || j < records[1].size()) {
+		if (j == records[1].size() || (i < records[0].size() && less(records[0][i].key, records[1][j].key))) {
+			visit(records[0][i++].key);
+		} else if (i == records[0].size() || less(records[1][j].key, records[0][i].key)) {
+			visit(records[1][j++].key);
+		} else {
+			if (!same_value<Value>(records[0][i].value, records[1][j].value)) visit(records[0][i].key);
+			i++;
+			j++;
+		}
+	}
 
-	if (node->header.is_leaf) {
-		return find_min_leaf(ba, node);
-	} else {
-		return find_min_node(ba, node);
+	// Messages are looked up from the top, in both trees.
+	buffered.erase(std::unique(buffered.begin(), buffered.end(), equal), buffered.end());
+	for (auto key : buffered) {
+		auto in_a = search(ba, a, key);
+		auto in_b = search(ba, b, key);
+		if (in_a.has_value() != in_b.has_value()
+				|| (in_a && !same_value<Value>(*in_a, *in_b))) {
+			visit(key);
+		}
 	}
 }
 
-KeyPair find_max_node(BufferAllocator& ba, BTNode* node) {
-	if (node->header.count == 0) return KeyPair{};
-
-	auto max_child = node->pairs[node->header.count-1];
-	return find_max_btree(ba, max_child.value);
+// The number of levels below the node at `id`, 0 for a leaf.
+BTREE_TEMPLATE
+size_t BTREE::height(BufferAllocator& ba, BlockID id) {
+	size_t levels = 0;
+	while (true) {
+		auto node_raw = ba.load(id);
+		auto node = (Node*)node_raw.data();
+		if (node->header.is_leaf || node->header.count == 0) return levels;
+		id = node->child_at(0);
+		levels++;
+	}
 }
-KeyPair find_min_node(BufferAllocator& ba, BTNode* node){
-	if (node->header.count == 0) return KeyPair{};
 
-	auto min_child = node->pairs[0];
-	return find_min_btree(ba, min_child.value);
+// The smallest key in the subtree at `id`.
+BTREE_TEMPLATE
+Key BTREE::min_key(BufferAllocator& ba, BlockID id) {
+	auto node_raw = ba.load(id);
+	auto node = (Node*)node_raw.data();
+
+	if (node->header.count == 0) return Key {};
+	if (node->header.is_leaf) return node->key_at(0);
+	return min_key(ba, node->child_at(0));
 }
 
-DeletePropagation delete_btree(BufferAllocator& ba, std::unordered_set<BlockID>& freed, BlockID id, KeyId key) {
+BTREE_TEMPLATE
+auto BTREE::remove(BufferAllocator& ba, FreedBlocks& freed, BlockID id, Key key) -> DeletePropagation {
 	auto node_raw = ba.load(id);
-	auto node = (BTNode*)node_raw.data();
+	auto node = (Node*)node_raw.data();
 
-	auto result = node->header.is_leaf
-		? delete_leaf(ba, freed, node, key)
-		: delete_node(ba, freed, node, key);
+	auto result = [&] {
+		if (node->header.is_leaf) {
+			auto leaf = unpack_leaf(node);
+			return delete_leaf(&leaf, key);
+		}
+		auto interior = unpack_interior(node);
+		return delete_node(ba, freed, &interior, key);
+	}();
 
 	if (result.did_modify) {
 		freed.insert(id);
-	} 
+	}
 
 	return result;
 }
 
-DeletePropagation delete_leaf(BufferAllocator& ba, std::unordered_set<BlockID>& free, BTNode* node, KeyId key) {
+BTREE_TEMPLATE
+auto BTREE::delete_leaf(Leaf* node, Key key) -> DeletePropagation {
 
 	// check if node actually contains the key
 	bool found = false;
-	BlockID deleted_value = 0;
+	Value deleted_value {};
 	for(size_t i = 0; i < node->header.count; i++) {
-		if (node->pairs[i].key == key) {
+		if (equal(node->pairs[i].key, key)) {
 			found = true;
 			deleted_value = node->pairs[i].value;
 			break;
@@ -376,69 +719,66 @@ DeletePropagation delete_leaf(BufferAllocator& ba, std::unordered_set<BlockID>&
 	}
 
 	// Copy everything (except deleted key) to a new leaf.
-	auto new_leaf_raw = new_empty_leaf(ba);
-	auto new_leaf = (BTNode*)new_leaf_raw.data();
+	auto new_leaf = empty_node<Record>();
 
 	size_t j = 0;
 	for (size_t i = 0; i < node->header.count; i++) {
-		if (node->pairs[i].key == key) continue;
-		new_leaf->pairs[j] = node->pairs[i];
+		if (equal(node->pairs[i].key, key)) continue;
+		new_leaf.pairs[j] = node->pairs[i];
 		j++;
-		new_leaf->header.count++;
+		new_leaf.header.count++;
 	}
 
-	new_leaf_raw.set_dirty();
-
 	return DeletePropagation {
 		.did_modify = true,
 		.deleted_value = deleted_value,
-		.new_child = new_leaf_raw,
+		.new_node = new_leaf,
 	};
 }
 
-DeletePropagation delete_merge(BufferAllocator& ba,
-		std::unordered_set<BlockID>& freed,
-		BTNode* root, BTNode* left, BTNode* right,
+BTREE_TEMPLATE
+template <typename Entry>
+auto BTREE::delete_merge(BufferAllocator& ba,
+		FreedBlocks& freed,
+		Interior* root, Unpacked<Entry>* left, Unpacked<Entry>* right,
 		size_t left_idx, size_t right_idx,
-		BlockID deleted_value) {
+		Value deleted_value) -> DeletePropagation {
 
 	auto right_key = root->pairs[right_idx].key;
 	auto left_key = root->pairs[left_idx].key;
-	bool are_leaves = left->header.is_leaf;
 
-	auto new_node_raw = are_leaves ? new_empty_leaf(ba) : new_empty_node(ba);
-	auto new_node = (BTNode*)new_node_raw.data();
+	auto new_node = empty_node<Entry>();
 
-	for (size_t i = 0; i < left->header.count; i++, new_node->header.count++) {
-		new_node->pairs[new_node->header.count] = left->pairs[i];
+	for (size_t i = 0; i < left->header.count; i++, new_node.header.count++) {
+		new_node.pairs[new_node.header.count] = left->pairs[i];
 	}
-	if (!are_leaves && new_node->header.count > 0) {
-		new_node->pairs[new_node->header.count-1].key = left_key;
+	if constexpr (std::is_same_v<Entry, Child>) {
+		if (new_node.header.count > 0) {
+			new_node.pairs[new_node.header.count-1].key = left_key;
+		}
 	}
-	for (size_t i = 0; i < right->header.count; i++, new_node->header.count++) {
-		new_node->pairs[new_node->header.count] = right->pairs[i];
+	for (size_t i = 0; i < right->header.count; i++, new_node.header.count++) {
+		new_node.pairs[new_node.header.count] = right->pairs[i];
 	}
 
+	auto new_node_raw = write_node(ba, new_node);
+
 	// create new root
-	auto new_root_raw = new_empty_node(ba);
-	auto new_root = (BTNode*)new_root_raw.data();
+	auto new_root = empty_node<Child>();
 
 	for (size_t i = 0; i < root->header.count; i++) {
-		size_t j = new_root->header.count;
+		size_t j = new_root.header.count;
 		if (i == right_idx) continue;
 		else if (i == left_idx) {
-			new_root->pairs[j].key = right_key;
-			new_root->pairs[j].value = new_node_raw.id();
-			new_root->header.count++;
+			new_root.pairs[j].key = right_key;
+			new_root.pairs[j].value = new_node_raw.id();
+			new_root.header.count++;
 		} else {
-			new_root->pairs[j] = root->pairs[i];
-			new_root->header.count++;
+			new_root.pairs[j] = root->pairs[i];
+			new_root.header.count++;
 		}
 	}
 
-	new_node_raw.set_dirty();
-	new_root_raw.set_dirty();
-
 	// mark as free
 	freed.insert(root->pairs[left_idx].value);
 	freed.insert(root->pairs[right_idx].value);
@@ -446,52 +786,46 @@ DeletePropagation delete_merge(BufferAllocator& ba,
 	return DeletePropagation {
 		.did_modify = true,
 		.deleted_value = deleted_value,
-		.new_child = new_root_raw,
+		.new_node = new_root,
 	};
 }
 
-DeletePropagation move_from_right(BufferAllocator& ba,
-		std::unordered_set<BlockID>& freed,
-		BTNode* root, BTNode* node, BTNode* right,
+BTREE_TEMPLATE
+template <typename Entry>
+auto BTREE::move_from_right(BufferAllocator& ba,
+		FreedBlocks& freed,
+		Interior* root, Unpacked<Entry>* node, Unpacked<Entry>* right,
 		int node_idx, int right_idx,
-		BlockID deleted_value) {
+		Value deleted_value) -> DeletePropagation {
 
 	auto right_key = root->pairs[right_idx].key;
 	auto node_key = root->pairs[node_idx].key;
-	bool are_leaves = right->header.is_leaf;
 
 	// copy to the new node
-	auto new_node_raw = clone_node(ba, node);
-	auto new_node = (BTNode*)new_node_raw.data();
-	new_node->pairs[node->header.count].key = right->pairs[0].key;
-	new_node->pairs[node->header.count].value = right->pairs[0].value;
-	new_node->header.count++;
-	if (!are_leaves) {
-		new_node->pairs[new_node->header.count-2].key = node_key;
-		new_node->pairs[new_node->header.count-1].key = MAX_KEY_ID;
+	auto new_node = *node;
+	new_node.pairs[node->header.count] = right->pairs[0];
+	new_node.header.count++;
+	if constexpr (std::is_same_v<Entry, Child>) {
+		new_node.pairs[new_node.header.count-2].key = node_key;
+		new_node.pairs[new_node.header.count-1].key = MAX_KEY;
 	}
 
 	// shift right to the left.
-	auto new_right_raw = are_leaves ? new_empty_leaf(ba) : new_empty_node(ba);
-	auto new_right = (BTNode*)new_right_raw.data();
+	auto new_right = empty_node<Entry>();
 	for (size_t i = 0; i < right->header.count-1; i++) {
-		new_right->pairs[i] = right->pairs[i+1];
-		new_right->header.count++;
+		new_right.pairs[i] = right->pairs[i+1];
+		new_right.header.count++;
 	}
 
-	new_right_raw.set_dirty();
-	new_node_raw.set_dirty();
-	
-	// update the parent node
-	auto new_root_raw = clone_node(ba, root);
-	auto new_root = (BTNode*)new_root_raw.data();
-	auto new_max = find_min_btree(ba, new_right_raw.id());
-	new_root->pairs[node_idx].key = new_max.key;
-	new_root->pairs[node_idx].value = new_node_raw.id();
-	new_root->pairs[right_idx].key = right_key;
-	new_root->pairs[right_idx].value = new_right_raw.id();
+	auto new_right_raw = write_node(ba, new_right);
+	auto new_node_raw = write_node(ba, new_node);
 
-	new_root_raw.set_dirty();
+	// update the parent node
+	auto new_root = *root;
+	new_root.pairs[node_idx].key = min_key(ba, new_right_raw.id());
+	new_root.pairs[node_idx].value = new_node_raw.id();
+	new_root.pairs[right_idx].key = right_key;
+	new_root.pairs[right_idx].value = new_right_raw.id();
 
 	// mark as free
 	freed.insert(root->pairs[right_idx].value);
@@ -500,57 +834,52 @@ DeletePropagation move_from_right(BufferAllocator& ba,
 	return DeletePropagation {
 		.did_modify = true,
 		.deleted_value = deleted_value,
-		.new_child = new_root_raw,
+		.new_node = new_root,
 	};
 }
 
-DeletePropagation move_from_left(BufferAllocator& ba,
-		std::unordered_set<BlockID>& freed,
-		BTNode* root, BTNode* left, BTNode* node,
+BTREE_TEMPLATE
+template <typename Entry>
+auto BTREE::move_from_left(BufferAllocator& ba,
+		FreedBlocks& freed,
+		Interior* root, Unpacked<Entry>* left, Unpacked<Entry>* node,
 		int left_idx, int node_idx,
-		BlockID deleted_value) {
+		Value deleted_value) -> DeletePropagation {
 
 	auto left_key = root->pairs[left_idx].key;
 	auto node_key = root->pairs[node_idx].key;
-	bool are_leaves = left->header.is_leaf;
 
 	// copy to the new node
-	auto new_node_raw = are_leaves ? new_empty_leaf(ba) : new_empty_node(ba);
-	auto new_node = (BTNode*)new_node_raw.data();
-	
-	new_node->pairs[0] = left->pairs[left->header.count-1];
-	if (!are_leaves) {
-		new_node->pairs[0].key = left_key;
-	}
-	new_node->header.count++;
+	auto new_node = empty_node<Entry>();
+
+	new_node.pairs[0] = left->pairs[left->header.count-1];
+	if constexpr (std::is_same_v<Entry, Child>) {
+		new_node.pairs[0].key = left_key;
+	}
+	new_node.header.count++;
 	for(size_t i = 0; i < node->header.count; i++) {
-		new_node->pairs[1+i] = node->pairs[i];
-		new_node->header.count++;
+		new_node.pairs[1+i] = node->pairs[i];
+		new_node.header.count++;
 	}
 
 	// adjust the left node
-	auto new_left_raw = clone_node(ba, left);
-	auto new_left = (BTNode*)new_left_raw.data();
+	auto new_left = *left;
 
-	new_left->header.count--;
-	new_left->pairs[new_left->header.count] = KeyPair{.key=MAX_KEY_ID};
-	if (!are_leaves) {
-		new_left->pairs[new_left->header.count-1].key = MAX_KEY_ID;
+	new_left.header.count--;
+	new_left.pairs[new_left.header.count] = Entry { .key = MAX_KEY };
+	if constexpr (std::is_same_v<Entry, Child>) {
+		new_left.pairs[new_left.header.count-1].key = MAX_KEY;
 	}
-	
-	new_left_raw.set_dirty();
-	new_node_raw.set_dirty();
 
-	// update the parent node
-	auto new_root_raw = clone_node(ba, root);
-	auto new_root = (BTNode*)new_root_raw.data();
-	auto new_max = find_min_btree(ba, new_node_raw.id());
-	new_root->pairs[left_idx].key = new_max.key;
-	new_root->pairs[left_idx].value = new_left_raw.id();
-	new_root->pairs[node_idx].key = node_key;
-	new_root->pairs[node_idx].value = new_node_raw.id();
+	auto new_left_raw = write_node(ba, new_left);
+	auto new_node_raw = write_node(ba, new_node);
 
-	new_root_raw.set_dirty();
+	// update the parent node
+	auto new_root = *root;
+	new_root.pairs[left_idx].key = min_key(ba, new_node_raw.id());
+	new_root.pairs[left_idx].value = new_left_raw.id();
+	new_root.pairs[node_idx].key = node_key;
+	new_root.pairs[node_idx].value = new_node_raw.id();
 
 	// mark as free
 	freed.insert(root->pairs[left_idx].value);
@@ -559,46 +888,55 @@ DeletePropagation move_from_left(BufferAllocator& ba,
 	return DeletePropagation {
 		.did_modify = true,
 		.deleted_value = deleted_value,
-		.new_child = new_root_raw,
+		.new_node = new_root,
 	};
 }
 
-DeletePropagation delete_node(BufferAllocator& ba, std::unordered_set<BlockID>& free, BTNode* node, KeyId key) {
+BTREE_TEMPLATE
+auto BTREE::delete_node(BufferAllocator& ba, FreedBlocks& freed, Interior* node, Key key) -> DeletePropagation {
 
 	size_t idx = 0;
 	for (; idx < node->header.count; idx++) {
-		if (key < node->pairs[idx].key) {
+		if (less(key, node->pairs[idx].key)) {
 			break;
 		}
 	}
 
 	auto child = node->pairs[idx].value;
-	auto propagation = delete_btree(ba, free, child, key);
+	auto propagation = remove(ba, freed, child, key);
 
 	if (!propagation.did_modify) {
 		return propagation;
 	}
 
-	// There a few cases we need to handle 
+	return std::visit([&](auto& new_child) {
+		return rebalance(ba, freed, node, idx, new_child, propagation.deleted_value);
+	}, propagation.new_node);
+}
+
+BTREE_TEMPLATE
+template <typename Entry>
+auto BTREE::rebalance(BufferAllocator& ba, FreedBlocks& freed,
+		Interior* node, size_t idx, Unpacked<Entry>& new_child,
+		Value deleted_value) -> DeletePropagation {
+
+	// There a few cases we need to handle
 	// 1) the child has enough entries, so just update entry
 	// 2) not enough entries but the left node can share.
 	// 3) not enough entries but the right node can share.
 	// 4) not enough entries but can combine with left.
 	// 5) not enough entries but can comine with right.
-	
-	auto new_child_raw = propagation.new_child;
-	auto new_child = (BTNode*)new_child_raw.data();
+
+	auto capacity = node_capacity<Entry>(ba);
 
 	// 1)
-	if (new_child->enough_entries()) {
-		auto new_node_raw = clone_node(ba, node);
-		auto new_node = (BTNode*)new_node_raw.data();
-		new_node->pairs[idx].value = new_child_raw.id();
-		new_node_raw.set_dirty();
+	if (new_child.enough_entries(capacity)) {
+		auto new_node = *node;
+		new_node.pairs[idx].value = write_node(ba, new_child).id();
 		return DeletePropagation {
 			.did_modify = true,
-			.deleted_value = propagation.deleted_value,
-			.new_child = new_node_raw,
+			.deleted_value = deleted_value,
+			.new_node = new_node,
 		};
 	}
 
@@ -608,67 +946,837 @@ DeletePropagation delete_node(BufferAllocator& ba, std::unordered_set<BlockID>&
 	// only left neighbour (2,4)
 	if (right_idx >= node->header.count) {
 		auto left_node_raw = ba.load(node->pairs[left_idx].value);
-		auto left_node = (BTNode*)left_node_raw.data();
+		auto left_node = unpack<Entry>((Node*)left_node_raw.data());
 		// 2
-		if (left_node->can_share_entry())  {
-			return move_from_left(ba, free, 
-					node, left_node, new_child, 
-					left_idx, idx, 
-					propagation.deleted_value);
+		if (left_node.can_share_entry(capacity))  {
+			return move_from_left(ba, freed,
+					node, &left_node, &new_child,
+					left_idx, idx,
+					deleted_value);
 		}
 		// 4
-		return delete_merge(ba, free,
-				node, left_node, new_child,
+		return delete_merge(ba, freed,
+				node, &left_node, &new_child,
 				left_idx, idx,
-				propagation.deleted_value);
+				deleted_value);
 	}
 	// only right neighbour (3,5)
 	else if (left_idx < 0) {
 		auto right_node_raw = ba.load(node->pairs[right_idx].value);
-		auto right_node = (BTNode*)right_node_raw.data();
+		auto right_node = unpack<Entry>((Node*)right_node_raw.data());
 		// 3
-		if (right_node->can_share_entry()) {
-			return move_from_right(ba, free, 
-					node, new_child, right_node, 
+		if (right_node.can_share_entry(capacity)) {
+			return move_from_right(ba, freed,
+					node, &new_child, &right_node,
 					idx, right_idx,
-					propagation.deleted_value);
+					deleted_value);
 		}
 		// 5
-		return delete_merge(ba, free,
-				node, new_child, right_node,
+		return delete_merge(ba, freed,
+				node, &new_child, &right_node,
 				idx, right_idx,
-				propagation.deleted_value);
+				deleted_value);
 	}
 	// both neighbours (2,4,3)
 	else {
 		auto left_node_raw = ba.load(node->pairs[left_idx].value);
-		auto left_node = (BTNode*)left_node_raw.data();
+		auto left_node = unpack<Entry>((Node*)left_node_raw.data());
 
 		// 2
-		if (left_node->can_share_entry()) {
-			return move_from_left(ba, free, 
-					node, left_node, new_child, 
-					left_idx, idx, 
-					propagation.deleted_value);
+		if (left_node.can_share_entry(capacity)) {
+			return move_from_left(ba, freed,
+					node, &left_node, &new_child,
+					left_idx, idx,
+					deleted_value);
 		}
 
 		auto right_node_raw = ba.load(node->pairs[right_idx].value);
-		auto right_node = (BTNode*)right_node_raw.data();
+		auto right_node = unpack<Entry>((Node*)right_node_raw.data());
 
 		// 3
-		if (right_node->can_share_entry()) {
-			return move_from_right(ba, free, 
-					node, new_child, right_node,
+		if (right_node.can_share_entry(capacity)) {
+			return move_from_right(ba, freed,
+					node, &new_child, &right_node,
 					idx, right_idx,
-					propagation.deleted_value);
+					deleted_value);
 		}
 
 		// 4
-		return delete_merge(ba, free,
-				node, left_node, new_child,
+		return delete_merge(ba, freed,
+				node, &left_node, &new_child,
 				left_idx, idx,
-				propagation.deleted_value);
+				deleted_value);
+
+	}
+
+}
+
+/*
+ * Message buffers
+ */
+
+/*
+ * An empty T borrowed from the calling thread for the scope, for the
+ * vectors the buffered paths build. Those recurse a level at a time, so a
+ * scope nested in another gets a T of its own, and as they keep their
+ * capacity a steady state update never touches the heap.
+ */
+template <typename T>
+class Scratch {
+	public:
+		Scratch() {
+			auto& all = pool();
+			if (depth() == all.size()) all.push_back(std::make_unique<T>());
+			m_value = all[depth()++].get();
+			m_value->clear();
+		}
+		~Scratch() { depth()--; }
+		Scratch(const Scratch&) = delete;
+		Scratch& operator=(const Scratch&) = delete;
+
+		T& operator*() { return *m_value; }
+		T* operator->() { return m_value; }
+
+	private:
+		static std::vector<std::unique_ptr<T>>& pool() {
+			thread_local std::vector<std::unique_ptr<T>> all;
+			return all;
+		}
+		static size_t& depth() {
+			thread_local size_t in_use = 0;
+			return in_use;
+		}
+
+		T* m_value;
+};
+
+BTREE_TEMPLATE
+size_t BTREE::Node::message_count() {
+	if constexpr (BUFFERABLE) {
+		if (header.is_leaf) return 0;
+		return ((MessageBufferHeader*)((uint8_t*)this + BUFFER_OFFSET))->count;
+	}
+	return 0;
+}
+
+BTREE_TEMPLATE
+auto BTREE::Node::message_at(size_t i) -> Message {
+	auto messages = (Message*)((uint8_t*)this + BUFFER_OFFSET + sizeof(MessageBufferHeader));
+	return messages[i];
+}
+
+BTREE_TEMPLATE
+auto BTREE::find_message(Node* node, Key key) -> std::optional<Message> {
+	size_t low = 0;
+	size_t high = node->message_count();
+	while (low < high) {
+		auto mid = (low + high) / 2;
+		auto message = node->message_at(mid);
+		if (less(message.key, key)) {
+			low = mid + 1;
+		} else if (less(key, message.key)) {
+			high = mid;
+		} else {
+			return message;
+		}
+	}
+	return {};
+}
+
+// Merges the sorted `newer` messages into `older`, replacing older messages
+// for the same key.
+BTREE_TEMPLATE
+void BTREE::merge_messages(Messages& older, const Message* newer, size_t count) {
+	if (count == 0) return;
+
+	Scratch<Messages> merged;
+	merged->reserve(older.size() + count);
+	size_t i = 0;
+	size_t j = 0;
+	while (i < older.size() || j < count) {
+		if (j == count || (i < older.size() && less(older[i].key, newer[j].key))) {
+			merged->push_back(older[i++]);
+			continue;
+		}
+		if (i < older.size() && equal(older[i].key, newer[j].key)) i++;
+		merged->push_back(newer[j++]);
+	}
+	older.swap(*merged);
+}
+
+// Appends the records of `node` with the sorted `messages` applied.
+BTREE_TEMPLATE
+void BTREE::merge_leaf(Node* node, const Message* messages, size_t count, Records& out) {
+	size_t j = 0;
+	auto take_message = [&] {
+		if (!messages[j].is_delete) {
+			out.push_back(Record {
+				.key = messages[j].key,
+				.value = messages[j].value,
+			});
+		}
+		j++;
+	};
+
+	for (size_t i = 0; i < node->header.count; i++) {
+		auto key = node->key_at(i);
+		while (j < count && less(messages[j].key, key)) take_message();
+		if (j < count && equal(messages[j].key, key)) {
+			take_message();
+			continue;
+		}
+		out.push_back(Record {
+			.key = key,
+			.value = node->value_at(i),
+		});
+	}
+	while (j < count) take_message();
+}
+
+// Visits the records of the subtree at `id` in [low, high). `pending` holds
+// the messages for the subtree from the buffers above it.
+BTREE_TEMPLATE
+bool BTREE::scan_node(BufferAllocator& ba, BlockID id, Key low, Key high, const Messages& pending,
+		const std::function<bool(Key, Value)>& visit) {
+	auto node_raw = ba.load(id);
+	auto node = (Node*)node_raw.data();
+
+	if (node->header.is_leaf) {
+		Scratch<Records> records;
+		merge_leaf(node, pending.data(), pending.size(), *records);
+		for (auto& record : *records) {
+			if (!less(record.key, low) && less(record.key, high)) {
+				if (!visit(record.key, record.value)) return false;
+			}
+		}
+		return true;
+	}
+
+	Scratch<Messages> messages;
+	for (size_t i = 0; i < node->message_count(); i++) {
+		messages->push_back(node->message_at(i));
+	}
+	merge_messages(*messages, pending.data(), pending.size());
+
+	// Child i takes the messages below its key, the last one the rest.
+	size_t start = 0;
+	Scratch<Messages> below;
+	for (size_t i = 0; i < node->header.count; i++) {
+		if (i > 0 && !less(node->key_at(i-1), high)) break;
+
+		bool last = i + 1 == node->header.count;
+		auto end = start;
+		while (end < messages->size() && (last || less((*messages)[end].key, node->key_at(i)))) end++;
+		if (last || less(low, node->key_at(i))) {
+			below->assign(messages->begin() + start, messages->begin() + end);
+			if (!scan_node(ba, node->child_at(i), low, high, *below, visit)) return false;
+		}
+		start = end;
+	}
+	return true;
+}
+
+// Nodes written by the buffered update in progress. Nothing else has seen
+// them, so one replaced again by the same update is freed straight away.
+static thread_local std::vector<BlockID> fresh_nodes;
+
+BTREE_TEMPLATE
+void BTREE::retire(BufferAllocator& ba, FreedBlocks& freed, BlockID id) {
+	auto fresh = std::find(fresh_nodes.begin(), fresh_nodes.end(), id);
+	if (fresh == fresh_nodes.end()) {
+		freed.insert(id);
+		return;
+	}
+	fresh_nodes.erase(fresh);
+	free_page(ba, id);
+}
+
+BTREE_TEMPLATE
+BlockID BTREE::write_leaf_run(BufferAllocator& ba, const Record* records, size_t count) {
+	auto leaf = empty_node<Record>();
+	leaf.header.count = count;
+	std::copy(records, records + count, leaf.pairs);
+
+	auto id = write_node(ba, leaf).id();
+	fresh_nodes.push_back(id);
+	return id;
+}
+
+BTREE_TEMPLATE
+BlockID BTREE::write_interior_run(BufferAllocator& ba, const Child* children, size_t count,
+		const Message* messages, size_t message_count) {
+	assert(message_count <= BUFFER_CAPACITY);
+	auto interior = empty_node<Child>();
+	interior.header.count = count;
+	std::copy(children, children + count, interior.pairs);
+	interior.pairs[count-1].key = MAX_KEY;
+
+	auto page = write_node(ba, interior);
+	if constexpr (BUFFERABLE) {
+		auto buffer = (uint8_t*)page.data() + BUFFER_OFFSET;
+		((MessageBufferHeader*)buffer)->count = message_count;
+		std::copy(messages, messages + message_count, (Message*)(buffer + sizeof(MessageBufferHeader)));
+	}
+	fresh_nodes.push_back(page.id());
+	return page.id();
+}
+
+// Writes `records` as the fewest leaves that hold them, filled evenly, and
+// appends an entry for each to `out`. The caller sets the last entry's key.
+BTREE_TEMPLATE
+void BTREE::chunk_leaf(BufferAllocator& ba, const Records& records, Children& out) {
+	auto count = records.size();
+	if (count == 0) return;
+
+	auto capacity = node_capacity<Record>(ba);
+	auto runs = (count + capacity - 1) / capacity;
+	for (size_t r = 0; r < runs; r++) {
+		auto start = r * count / runs;
+		auto end = (r + 1) * count / runs;
+		out.push_back(Child {
+			.key = end < count ? records[end].key : Key {},
+			.value = write_leaf_run(ba, records.data() + start, end - start),
+		});
+	}
+}
+
+// As chunk_leaf, each node taking the messages for its children.
+BTREE_TEMPLATE
+void BTREE::chunk_interior(BufferAllocator& ba, PendingInterior& node, Children& out) {
+	auto count = node.children.size();
+	if (count == 0) return;
+
+	// Interior nodes split once they reach capacity.
+	auto capacity = node_capacity<Child>(ba) - 1;
+	auto runs = (count + capacity - 1) / capacity;
+	size_t message = 0;
+	for (size_t r = 0; r < runs; r++) {
+		auto start = r * count / runs;
+		auto end = (r + 1) * count / runs;
+		auto separator = node.children[end-1].key;
+
+		auto first_message = message;
+		while (message < node.messages.size()
+				&& (end == count || less(node.messages[message].key, separator))) {
+			message++;
+		}
+		out.push_back(Child {
+			.key = separator,
+			.value = write_interior_run(ba, node.children.data() + start, end - start,
+					node.messages.data() + first_message, message - first_message),
+		});
+	}
+}
+
+BTREE_TEMPLATE
+bool BTREE::underfull(BufferAllocator& ba, BlockID id) {
+	auto node_raw = ba.load(id);
+	auto node = (Node*)node_raw.data();
+	return node->header.is_leaf
+		? node->header.count < node_capacity<Record>(ba)/2
+		: node->header.count < node_capacity<Child>(ba)/2;
+}
+
+// Applies the sorted `messages` to the subtree at `id`, appending the nodes
+// replacing it to `out`. There may be none, if it emptied, or several.
+BTREE_TEMPLATE
+void BTREE::apply(BufferAllocator& ba, FreedBlocks& freed, BlockID id,
+		const Message* messages, size_t count, Children& out) {
+	Scratch<Records> records;
+	Scratch<PendingInterior> pending;
+	bool is_leaf;
+	{
+		auto node_raw = ba.load(id);
+		auto node = (Node*)node_raw.data();
+		is_leaf = node->header.is_leaf;
+
+		if (is_leaf) {
+			merge_leaf(node, messages, count, *records);
+		} else {
+			for (size_t i = 0; i < node->header.count; i++) {
+				pending->children.push_back(Child {
+					.key = node->key_at(i),
+					.value = node->child_at(i),
+				});
+			}
+			for (size_t i = 0; i < node->message_count(); i++) {
+				pending->messages.push_back(node->message_at(i));
+			}
+			merge_messages(pending->messages, messages, count);
+		}
+	}
+	retire(ba, freed, id);
+
+	if (is_leaf) {
+		chunk_leaf(ba, *records, out);
+	} else {
+		normalize(ba, freed, *pending, out);
+	}
+}
+
+// Flushes `node` until its messages fit a buffer, then writes it out.
+BTREE_TEMPLATE
+void BTREE::normalize(BufferAllocator& ba, FreedBlocks& freed, PendingInterior& node, Children& out) {
+	while (node.messages.size() > BUFFER_CAPACITY) {
+		flush_largest(ba, freed, node);
+	}
+	chunk_interior(ba, node, out);
+}
+
+// Pushes the messages for the child with the most of them down a level.
+BTREE_TEMPLATE
+void BTREE::flush_largest(BufferAllocator& ba, FreedBlocks& freed, PendingInterior& node) {
+	size_t best = 0;
+	size_t best_start = 0;
+	size_t best_end = 0;
+	size_t start = 0;
+	for (size_t i = 0; i < node.children.size(); i++) {
+		bool last = i + 1 == node.children.size();
+		auto end = start;
+		while (end < node.messages.size() && (last || less(node.messages[end].key, node.children[i].key))) {
+			end++;
+		}
+		if (end - start > best_end - best_start) {
+			best = i;
+			best_start = start;
+			best_end = end;
+		}
+		start = end;
+	}
+
+	Scratch<Messages> batch;
+	batch->assign(node.messages.begin() + best_start, node.messages.begin() + best_end);
+	node.messages.erase(node.messages.begin() + best_start, node.messages.begin() + best_end);
+
+	Scratch<Children> pieces;
+	apply(ba, freed, node.children[best].value, batch->data(), batch->size(), *pieces);
+	replace_child(ba, freed, node, best, *pieces);
+}
+
+// Puts `pieces` in place of child `idx`, merging an underfull result with a
+// neighbour.
+BTREE_TEMPLATE
+void BTREE::replace_child(BufferAllocator& ba, FreedBlocks& freed, PendingInterior& node,
+		size_t idx, Children& pieces) {
+	if (splice_child(node, idx, pieces) == 1) {
+		repair_child(ba, freed, node, idx);
+	}
+}
+
+// Puts `pieces` in place of child `idx` as is, returning how many there were.
+BTREE_TEMPLATE
+size_t BTREE::splice_child(PendingInterior& node, size_t idx, Children& pieces) {
+	auto& children = node.children;
+	if (pieces.empty()) {
+		// The subtree emptied, its left neighbour takes over its keys.
+		if (idx > 0) children[idx-1].key = children[idx].key;
+		children.erase(children.begin() + idx);
+		return 0;
+	}
+
+	pieces.back().key = children[idx].key;
+	children.erase(children.begin() + idx);
+	children.insert(children.begin() + idx, pieces.begin(), pieces.end());
+	return pieces.size();
+}
+
+// Merges child `idx` with a neighbour while it is underfull.
+BTREE_TEMPLATE
+void BTREE::repair_child(BufferAllocator& ba, FreedBlocks& freed, PendingInterior& node, size_t idx) {
+	auto& children = node.children;
+	Scratch<Children> pieces;
+	while (children.size() > 1 && underfull(ba, children[idx].value)) {
+		auto left = idx > 0 ? idx - 1 : idx;
+		pieces->clear();
+		merge_siblings(ba, freed, children[left], children[left+1], *pieces);
+		pieces->back().key = children[left+1].key;
+		children.erase(children.begin() + left, children.begin() + left + 2);
+		children.insert(children.begin() + left, pieces->begin(), pieces->end());
+
+		// Only a single piece can still be short of entries.
+		if (pieces->size() > 1) return;
+		idx = left;
+	}
+}
+
+// Merges the children of `node` written by this update that came out
+// underfull with their neighbours.
+BTREE_TEMPLATE
+void BTREE::repair_fresh(BufferAllocator& ba, FreedBlocks& freed, PendingInterior& node) {
+	auto& children = node.children;
+	for (size_t i = 0; i < children.size();) {
+		auto fresh = std::find(fresh_nodes.begin(), fresh_nodes.end(), children[i].value);
+		if (fresh != fresh_nodes.end() && children.size() > 1 && underfull(ba, children[i].value)) {
+			repair_child(ba, freed, node, i);
+			i = 0;
+			continue;
+		}
+		i++;
+	}
+}
+
+BTREE_TEMPLATE
+void BTREE::merge_siblings(BufferAllocator& ba, FreedBlocks& freed, Child left, Child right,
+		Children& out) {
+	Scratch<Records> records;
+	Scratch<PendingInterior> pending;
+	bool is_leaf;
+	for (auto sibling : {left, right}) {
+		auto node_raw = ba.load(sibling.value);
+		auto node = (Node*)node_raw.data();
+		is_leaf = node->header.is_leaf;
+
+		if (is_leaf) {
+			merge_leaf(node, nullptr, 0, *records);
+			continue;
+		}
+		// The left node's last entry now runs up to the separator.
+		if (!pending->children.empty()) {
+			pending->children.back().key = left.key;
+		}
+		for (size_t i = 0; i < node->header.count; i++) {
+			pending->children.push_back(Child {
+				.key = node->key_at(i),
+				.value = node->child_at(i),
+			});
+		}
+		for (size_t i = 0; i < node->message_count(); i++) {
+			pending->messages.push_back(node->message_at(i));
+		}
+	}
+	retire(ba, freed, left.value);
+	retire(ba, freed, right.value);
+
+	if (is_leaf) {
+		chunk_leaf(ba, *records, out);
+	} else {
+		// Children that were underfull at the edges of the two nodes,
+		// with no neighbour then, have one now.
+		repair_fresh(ba, freed, *pending);
+		normalize(ba, freed, *pending, out);
+	}
+}
+
+BTREE_TEMPLATE
+BlockID BTREE::apply_buffered(BufferAllocator& ba, FreedBlocks& freed, BlockID root, Message message) {
+	assert(BUFFERABLE);
+	fresh_nodes.clear();
+
+	Scratch<Children> pieces;
+	apply(ba, freed, root, &message, 1, *pieces);
+	return make_root(ba, freed, *pieces);
+}
+
+// The root of a tree made of `pieces`, the nodes that replaced the old root.
+BTREE_TEMPLATE
+BlockID BTREE::make_root(BufferAllocator& ba, FreedBlocks& freed, Children& pieces) {
+	while (true) {
+		if (pieces.empty()) {
+			return new_empty_leaf(ba).id();
+		}
+
+		// The root split, add a level above it.
+		if (pieces.size() > 1) {
+			Scratch<PendingInterior> level;
+			level->children.swap(pieces);
+			pieces.clear();
+			chunk_interior(ba, *level, pieces);
+			continue;
+		}
+
+		auto id = pieces[0].value;
+		BlockID child;
+		Scratch<Messages> messages;
+		{
+			auto node_raw = ba.load(id);
+			auto node = (Node*)node_raw.data();
+			if (node->header.is_leaf || node->header.count > 1) {
+				return id;
+			}
+
+			// A root with a single child is dropped, once its messages
+			// are pushed down.
+			child = node->child_at(0);
+			for (size_t i = 0; i < node->message_count(); i++) {
+				messages->push_back(node->message_at(i));
+			}
+		}
+		retire(ba, freed, id);
+
+		pieces.clear();
+		if (messages->empty()) {
+			pieces.push_back(Child {
+				.value = child,
+			});
+		} else {
+			apply(ba, freed, child, messages->data(), messages->size(), pieces);
+		}
+	}
+}
+
+/*
+ * Range deletes
+ */
+
+BTREE_TEMPLATE
+BlockID BTREE::delete_range(BufferAllocator& ba, FreedBlocks& freed, BlockID root,
+		Key low, Key high, RangeDeletion& deletion) {
+	if (!less(low, high)) return root;
+	fresh_nodes.clear();
+
+	Scratch<Children> pieces;
+	if (!delete_range_node(ba, freed, root, low, high, nullptr, 0, deletion, *pieces)) {
+		return root;
+	}
+	return make_root(ba, freed, *pieces);
+}
+
+// Removes the records in [low, high) from the subtree at `id`, appending the
+// nodes replacing it to `out`. `messages` are the buffered messages for the
+// subtree from above, none of them in the range. Returns false, leaving the
+// subtree in place, if there was nothing to do.
+BTREE_TEMPLATE
+bool BTREE::delete_range_node(BufferAllocator& ba, FreedBlocks& freed, BlockID id,
+		Key low, Key high, const Message* messages, size_t count,
+		RangeDeletion& deletion, Children& out) {
+	auto in_range = [&](Key key) { return !less(key, low) && less(key, high); };
+
+	Scratch<Records> records;
+	Scratch<PendingInterior> pending;
+	bool is_leaf;
+	bool modified = count > 0;
+	{
+		auto node_raw = ba.load(id);
+		auto node = (Node*)node_raw.data();
+		is_leaf = node->header.is_leaf;
+
+		if (is_leaf) {
+			Scratch<Records> merged;
+			merge_leaf(node, messages, count, *merged);
+			for (auto& record : *merged) {
+				if (in_range(record.key)) {
+					deletion.removed.push_back(record);
+					modified = true;
+				} else {
+					records->push_back(record);
+				}
+			}
+		} else {
+			for (size_t i = 0; i < node->header.count; i++) {
+				pending->children.push_back(Child {
+					.key = node->key_at(i),
+					.value = node->child_at(i),
+				});
+			}
+			for (size_t i = 0; i < node->message_count(); i++) {
+				auto message = node->message_at(i);
+				if (in_range(message.key)) {
+					modified = true;
+				} else {
+					pending->messages.push_back(message);
+				}
+			}
+			merge_messages(pending->messages, messages, count);
+		}
+	}
+
+	if (!is_leaf) {
+		// Child i holds the keys from the previous child's key up to its
+		// own. Those entirely inside the range are detached whole, the
+		// (at most two) partly inside it are trimmed. Going right to left
+		// keeps the indices still to visit stable.
+		auto& children = pending->children;
+		Scratch<Children> pieces;
+		for (size_t i = children.size(); i-- > 0;) {
+			auto lower = i > 0 ? children[i-1].key : MIN_KEY;
+			auto upper = children[i].key;
+			if (!less(low, upper) || !less(lower, high)) continue;
+
+			pieces->clear();
+			if (!less(lower, low) && !less(high, upper)) {
+				deletion.detached.push_back(children[i].value);
+			} else {
+				// A trimmed child takes its messages along, they would
+				// have nowhere to go if it emptied.
+				auto first = std::find_if(pending->messages.begin(), pending->messages.end(),
+						[&](const Message& m) { return !less(m.key, lower); });
+				auto last = std::find_if(first, pending->messages.end(),
+						[&](const Message& m) { return !less(m.key, upper); });
+				Scratch<Messages> batch;
+				batch->assign(first, last);
+				pending->messages.erase(first, last);
+
+				if (!delete_range_node(ba, freed, children[i].value, low, high,
+						batch->data(), batch->size(), deletion, *pieces)) {
+					continue;
+				}
+			}
+			splice_child(*pending, i, *pieces);
+			modified = true;
+		}
 
+		// Then trimmed children that came out underfull take entries
+		// from their neighbours.
+		repair_fresh(ba, freed, *pending);
 	}
 
+	if (!modified) {
+		out.push_back(Child {
+			.value = id,
+		});
+		return false;
+	}
+
+	retire(ba, freed, id);
+	if (is_leaf) {
+		chunk_leaf(ba, *records, out);
+	} else {
+		normalize(ba, freed, *pending, out);
+	}
+	return true;
+}
+
+/*
+ * Pinned top levels
+ */
+
+BTREE_TEMPLATE
+auto BTREE::PinnedTree::find(BlockID id) const -> const PinnedNode* {
+	for (size_t i = 0; i < count; i++) {
+		if (nodes[i].id == id) return &nodes[i];
+	}
+	return nullptr;
+}
+
+BTREE_TEMPLATE
+int BTREE::pin_node(BufferAllocator& ba, PinnedTree& pinned, const PinnedTree* previous,
+		BlockID id, size_t level) {
+	int index = pinned.count++;
+	auto& pinned_node = pinned.nodes[index];
+	pinned_node.id = id;
+
+	// Blocks are copied on write, so a node still in the tree with the
+	// same id as one in the previous copy hasn't changed.
+	auto reused = previous ? previous->find(id) : nullptr;
+	if (reused) {
+		pinned_node.node = reused->node;
+		pinned_node.has_messages = reused->has_messages;
+	} else {
+		auto node_raw = ba.load(id);
+		auto node = (Node*)node_raw.data();
+		pinned_node.node = unpack_node(node);
+		pinned_node.has_messages = node->message_count() > 0;
+	}
+
+	for (size_t i = 0; i < max_capacity<Child>; i++) {
+		pinned_node.children[i] = -1;
+	}
+	auto interior = std::get_if<Interior>(&pinned_node.node);
+	if (!interior || level + 1 >= PINNED_LEVELS) {
+		return index;
+	}
+	for (size_t i = 0; i < interior->header.count; i++) {
+		auto child = interior->pairs[i].value;
+		pinned.nodes[index].children[i] = pin_node(ba, pinned, previous, child, level + 1);
+	}
+	return index;
+}
+
+BTREE_TEMPLATE
+auto BTREE::search_pinned(BufferAllocator& ba, const PinnedTree& pinned, Key key,
+		Finger* finger) -> std::optional<Value> {
+	// The leaf is still in this version of the tree, so skip the descent.
+	if (finger && finger->generation == pinned.generation && finger->leaf && finger->covers(key)) {
+		return search(ba, finger->leaf, key);
+	}
+	if (finger) {
+		*finger = Finger {
+			.generation = pinned.generation,
+		};
+	}
+
+	auto current = &pinned.nodes[0];
+	while (true) {
+		if (auto leaf = std::get_if<Leaf>(&current->node)) {
+			// Pinned leaves are already in memory.
+			if (finger) finger->reset();
+			for (size_t i = 0; i < leaf->header.count; i++) {
+				if (equal(leaf->pairs[i].key, key)) return leaf->pairs[i].value;
+			}
+			return {};
+		}
+
+		// Pinned copies don't hold the buffer.
+		if (current->has_messages) {
+			if (finger) finger->reset();
+			return search(ba, current->id, key);
+		}
+
+		auto& node = std::get<Interior>(current->node);
+		size_t i = 0;
+		for (; i < node.header.count; i++) {
+			if (less(key, node.pairs[i].key)) break;
+		}
+		if (i == node.header.count) return {};
+
+		if (finger) {
+			finger->descend(i, node.header.count, [&](size_t j) { return node.pairs[j].key; });
+		}
+
+		auto child = current->children[i];
+		if (child < 0) {
+			return search(ba, node.pairs[i].value, key, finger);
+		}
+		current = &pinned.nodes[child];
+	}
 }
+
+BTREE_TEMPLATE
+auto BTREE::PinnedRoot::take_unused() -> std::shared_ptr<PinnedTree> {
+	auto current = m_current.load();
+	for (auto& pinned : m_pool) {
+		if (!pinned) {
+			pinned = std::make_shared<PinnedTree>();
+			return pinned;
+		}
+		// Only the pool holds it, so no reader can be using it.
+		if (pinned != current && pinned.use_count() == 1) {
+			return pinned;
+		}
+	}
+	// Readers are holding on to every pooled copy.
+	return std::make_shared<PinnedTree>();
+}
+
+BTREE_TEMPLATE
+uint64_t BTREE::PinnedRoot::publish(BufferAllocator& ba, BlockID root, BlockID replaced) {
+	auto previous = m_current.load();
+	auto pinned = take_unused();
+
+	pinned->owner = &ba;
+	pinned->root = root;
+	pinned->generation = ++m_generation;
+	pinned->count = 0;
+	// Only reuse nodes from the version this one was copied from.
+	bool is_successor = previous && previous->owner == &ba
+		&& replaced != 0 && previous->root == replaced;
+	pin_node(ba, *pinned, is_successor ? previous.get() : nullptr, root, 0);
+
+	m_current.store(pinned);
+	return pinned->generation;
+}
+
+BTREE_TEMPLATE
+auto BTREE::PinnedRoot::current(BufferAllocator& ba) -> std::shared_ptr<const PinnedTree> {
+	auto pinned = m_current.load();
+	if (!pinned || pinned->owner != &ba) return nullptr;
+	return pinned;
+}
+
+/*
+ * Trees in use
+ */
+
+template struct BTree<KeyId, BlockID, std::less<KeyId>,
+	sizeof(BTNodeHeader) + MAX_KEY_PAIRS * (sizeof(KeyId) + sizeof(BlockID))>;
+template struct BTree<uint32_t, uint64_t, std::less<uint32_t>, 512>;
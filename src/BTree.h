@@ -1,69 +1,427 @@
 #pragma once
 
-#include <unordered_set>
 #include <optional>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <variant>
+#include <vector>
 
 #include "buffer_allocator.h"
+#include "page_allocator.h"
 #include "definitions.h"
 
 /*
  * A copy on write b tree implementation.
  * This is essentially a b+ tree without the neighbour relation.
+ *
+ * The tree is a template over its key, value and node size, so each tree
+ * gets search, split and merge code compiled for its own record layout.
+ * Leaves hold records, interior nodes hold the block ids of their children,
+ * each under the smallest key of the next child. The last key of an
+ * interior node is std::numeric_limits<Key>::max(), which is reserved, so
+ * keys must be ordered by std::less.
+ *
+ * Members are defined in BTree.cpp, which instantiates each tree in use.
  */
 
-// BTree node
-struct [[gnu::packed]] KeyPair {
-	KeyId key { 0 };
-	BlockID value { 0 };
-};
+/*
+ * Nodes are either stored as plain arrays of entries, or packed. A packed
+ * node stores each key as an offset from the node's smallest key and each
+ * value as a (shifted) offset from its smallest value, using the narrowest
+ * width that fits. Keys in a node share their high order bytes and block ids
+ * are page aligned, so this usually stores a pair in a handful of bytes.
+ * Only trees of integer keys and block id values can be packed.
+ */
+enum class NodeFormat : uint8_t { Plain = 0, Packed = 1 };
 
 struct [[gnu::packed]] BTNodeHeader {
 	bool is_leaf { false };
 	size_t count { 0 };
+	NodeFormat format { NodeFormat::Plain };
 };
 
-//const size_t MAX_KEY_PAIRS = (PAGE_SIZE - sizeof(BTNodeHeader)) / sizeof(KeyPair);
-const size_t MAX_KEY_PAIRS = 6;
-struct [[gnu::packed]] BTNode {
-	BTNodeHeader header;
-	KeyPair pairs[MAX_KEY_PAIRS];
-
-	bool enough_entries();
-	bool can_share_entry();
+struct [[gnu::packed]] PackedNodeHeader {
+	KeyId key_base { 0 };
+	BlockID value_base { 0 };
+	uint8_t key_width { 0 };
+	uint8_t value_width { 0 };
+	uint8_t value_shift { 0 };
 };
 
-BufferPointer new_empty_leaf(BufferAllocator& ba);
-BufferPointer new_empty_node(BufferAllocator& ba);
+// `NodeSize` is the number of bytes of its page a plain node uses.
+template <typename Key, typename Value, typename Compare = std::less<Key>, size_t NodeSize = PAGE_SIZE>
+struct BTree {
+	static_assert(NodeSize <= PAGE_SIZE, "nodes are stored one per page");
+	// The MAX_KEY sentinel and packed key offsets both take keys to ascend.
+	static_assert(std::is_same_v<Compare, std::less<Key>>, "keys must be ordered by std::less");
+	static_assert(std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<Value>,
+			"entries are copied straight into pages");
 
-BufferPointer clone_node(BufferAllocator& ba, BTNode* node);
+	// Leaf entry.
+	struct [[gnu::packed]] Record {
+		Key key {};
+		Value value {};
+	};
 
-std::optional<BlockID> search_btree(BufferAllocator& ba, BlockID id, KeyId key);
-std::optional<BlockID> search_leaf(BTNode* node, KeyId key);
-std::optional<BlockID> search_node(BufferAllocator& ba, BTNode* node, KeyId key);
+	// Interior node entry.
+	struct [[gnu::packed]] Child {
+		Key key {};
+		BlockID value { 0 };
+	};
 
-struct InsertPropagation {
-	bool is_split { false };
-	// set on split
-	KeyId key { 0 };
-	BlockID left { 0 };
-	BlockID right { 0 };
-	// set on non split
-	BlockID update { 0 };
+	static constexpr Key MAX_KEY = std::numeric_limits<Key>::max();
+	static constexpr Key MIN_KEY = std::numeric_limits<Key>::lowest();
 
-	bool did_replace { false };
-	BlockID replaced { 0 };
-};
+	template <typename Entry>
+	static constexpr size_t plain_capacity = (NodeSize - sizeof(BTNodeHeader)) / sizeof(Entry);
+
+	static_assert(plain_capacity<Record> >= 4 && plain_capacity<Child> >= 4,
+			"nodes must hold enough entries to split");
+
+	static constexpr bool PACKABLE = std::is_same_v<Key, uint64_t> && std::is_same_v<Value, BlockID>;
+
+	// Packing lets a node hold more entries, bounded so a split always
+	// produces halves that fit a plain node, and so a packed node that
+	// can't be narrowed still fits in a page.
+	static constexpr size_t MAX_PACKED = PACKABLE
+		? std::min(2 * (plain_capacity<Record> - 1),
+				(PAGE_SIZE - sizeof(BTNodeHeader) - sizeof(PackedNodeHeader)) / sizeof(Record))
+		: 0;
+
+	template <typename Entry>
+	static constexpr size_t max_capacity = std::max(plain_capacity<Entry>, MAX_PACKED);
+
+	// A node decoded onto the stack. The mutation code works on these and
+	// encodes the result into a fresh page with write_node.
+	template <typename Entry>
+	struct Unpacked {
+		BTNodeHeader header;
+		Entry pairs[max_capacity<Entry>];
+
+		// Both measured against the node_capacity the tree fills nodes to.
+		bool enough_entries(size_t capacity) const { return header.count >= capacity/2; }
+		bool can_share_entry(size_t capacity) const { return header.count >= capacity/2 + 1; }
+	};
+	using Leaf = Unpacked<Record>;
+	using Interior = Unpacked<Child>;
+	using AnyNode = std::variant<Interior, Leaf>;
+
+	/*
+	 * In a buffered (B epsilon) tree interior nodes also carry pending
+	 * inserts and deletes, in the part of their page the entries don't use.
+	 * An update only rewrites the root until its buffer fills, then the
+	 * messages for one child are flushed down a level in a single write.
+	 * Buffers are sorted by key with at most one message per key, and a
+	 * message overrides anything for its key further down the tree.
+	 */
+	struct [[gnu::packed]] Message {
+		Key key {};
+		Value value {};
+		bool is_delete { false };
+	};
+
+	struct [[gnu::packed]] MessageBufferHeader {
+		size_t count { 0 };
+	};
+
+	// Buffers start past the largest encoding of a node's entries.
+	static constexpr size_t BUFFER_OFFSET = std::max(NodeSize, PACKABLE
+			? sizeof(BTNodeHeader) + sizeof(PackedNodeHeader) + MAX_PACKED * sizeof(Record)
+			: 0);
+	static constexpr size_t BUFFER_CAPACITY = PAGE_SIZE > BUFFER_OFFSET + sizeof(MessageBufferHeader)
+		? (PAGE_SIZE - BUFFER_OFFSET - sizeof(MessageBufferHeader)) / sizeof(Message)
+		: 0;
+	// Too small a buffer wouldn't batch anything.
+	static constexpr bool BUFFERABLE = BUFFER_CAPACITY >= 4 * max_capacity<Child>;
+
+	// A node in the buffer pool, entries follow the header.
+	struct [[gnu::packed]] Node {
+		BTNodeHeader header;
+
+		// Decode entries in place, whatever the format.
+		Key key_at(size_t i);
+		// Leaves only.
+		Value value_at(size_t i);
+		// Interior nodes only.
+		BlockID child_at(size_t i);
+
+		// Interior nodes only, there are none unless the tree is buffered.
+		size_t message_count();
+		Message message_at(size_t i);
+	};
+
+	static Leaf unpack_leaf(Node* node);
+	static Interior unpack_interior(Node* node);
+	static AnyNode unpack_node(Node* node);
+	static BufferPointer write_node(BufferAllocator& ba, Leaf& node);
+	static BufferPointer write_node(BufferAllocator& ba, Interior& node);
+	static BufferPointer write_node(BufferAllocator& ba, AnyNode& node);
+
+	static BufferPointer new_empty_leaf(BufferAllocator& ba);
+
+	/*
+	 * The last leaf a thread reached and the keys it covers, [low, high).
+	 * Nodes are copied on write, so the leaf stays valid for as long as the
+	 * tree version it was found in, identified by its PinnedTree generation.
+	 * Keys near the previous one, e.g. ones handed out sequentially, are
+	 * then looked up without walking down from the root.
+	 */
+	struct Finger {
+		// 0 while nothing is cached.
+		uint64_t generation { 0 };
+		BlockID leaf { 0 };
+		bool has_low { false };
+		Key low {};
+		Key high { MAX_KEY };
+
+		bool covers(Key key) const {
+			return (!has_low || !less(key, low)) && less(key, high);
+		}
+		// Narrows the range to child `i` of an interior node with `count`
+		// entries, whose last key is the sentinel.
+		template <typename KeyOf>
+		void descend(size_t i, size_t count, KeyOf key_of) {
+			if (i > 0) {
+				has_low = true;
+				low = key_of(i-1);
+			}
+			if (i + 1 < count) high = key_of(i);
+		}
+		void reset() { *this = Finger {}; }
+	};
+
+	// Records the leaf reached in `finger`, if given.
+	static std::optional<Value> search(BufferAllocator& ba, BlockID id, Key key, Finger* finger = nullptr);
+	// The nodes from `id` down to the one holding `key`'s record: its leaf,
+	// or the first node buffering a message for it.
+	static void find_path(BufferAllocator& ba, BlockID id, Key key, std::vector<BlockID>& path);
+
+	struct InsertPropagation {
+		bool is_split { false };
+		// set on split
+		Key key {};
+		BlockID left { 0 };
+		BlockID right { 0 };
+		// set on non split
+		BlockID update { 0 };
+
+		// The key wasn't in the tree before.
+		bool did_insert { false };
+		bool did_replace { false };
+		Value replaced {};
+	};
+
+	// Points `finger` at the leaf now holding the record, the caller sets
+	// its generation once the new root is published.
+	static InsertPropagation insert(BufferAllocator& ba, FreedBlocks& freed, BlockID id, Record record,
+			Finger* finger = nullptr);
+
+	struct DeletePropagation {
+		bool did_modify { false };
+		Value deleted_value {};
+		// The replacement node. It isn't written yet, as the parent may
+		// still have to rebalance it with a neighbour.
+		AnyNode new_node;
+	};
+
+	static DeletePropagation remove(BufferAllocator& ba, FreedBlocks& freed, BlockID id, Key key);
+
+	// Calls `visit` on every record of the tree at `id`, in key order.
+	static void scan(BufferAllocator& ba, BlockID id, const std::function<void(Key, Value)>& visit);
+	// Only the records with keys in [low, high), skipping subtrees outside it.
+	static void scan(BufferAllocator& ba, BlockID id, Key low, Key high,
+			const std::function<void(Key, Value)>& visit);
+	// Stops as soon as `visit` returns false, returning false if it did.
+	static bool scan_until(BufferAllocator& ba, BlockID id, Key low, Key high,
+			const std::function<bool(Key, Value)>& visit);
+	// Calls `visit` on every key whose record differs between the trees at
+	// `a` and `b`, or is in only one of them. Subtrees both trees share are
+	// skipped without being read, so this costs about what differs.
+	static void diff(BufferAllocator& ba, BlockID a, BlockID b, const std::function<void(Key)>& visit);
 
-InsertPropagation insert_btree(BufferAllocator& ba, std::unordered_set<BlockID>& free, BlockID id, KeyPair key_pair);
-InsertPropagation insert_leaf(BufferAllocator& ba, std::unordered_set<BlockID>& free, BTNode* node, KeyPair key_pair);
-InsertPropagation insert_node(BufferAllocator& ba, std::unordered_set<BlockID>& free, BTNode* node, KeyPair key_pair);
+	// What a range delete took out of the tree.
+	struct RangeDeletion {
+		// Roots of subtrees that were entirely inside the range. They are
+		// unlinked rather than walked, releasing them is up to the caller.
+		std::vector<BlockID> detached;
+		// The records removed from the leaves on the range's boundaries.
+		std::vector<Record> removed;
+	};
 
-struct DeletePropagation {
-	bool did_modify { false };
-	BlockID deleted_value { 0 };
-	BufferPointer new_child;
+	/*
+	 * Removes every record with a key in [low, high), returning the new root.
+	 * Only the nodes on the paths to the two ends of the range are copied and
+	 * rebalanced, everything in between is detached. Works on buffered trees
+	 * too, where the messages in the range are dropped along the way.
+	 */
+	static BlockID delete_range(BufferAllocator& ba, FreedBlocks& freed, BlockID root,
+			Key low, Key high, RangeDeletion& deletion);
+
+	// Applies `message` to the buffered tree at `root`, returning the new
+	// root. A buffered tree must only be modified this way.
+	static BlockID apply_buffered(BufferAllocator& ba, FreedBlocks& freed, BlockID root, Message message);
+
+	/*
+	 * Decoded in memory copies of the top PINNED_LEVELS levels of a tree.
+	 * Every operation walks through these nodes, so lookups start from the
+	 * pinned copy and only go through the buffer pool below it.
+	 */
+	static constexpr size_t PINNED_LEVELS = 2;
+
+	static constexpr size_t pinned_node_capacity(size_t levels) {
+		return levels == 0 ? 0 : 1 + max_capacity<Child> * pinned_node_capacity(levels - 1);
+	}
+	static constexpr size_t MAX_PINNED_NODES = pinned_node_capacity(PINNED_LEVELS);
+
+	struct PinnedNode {
+		BlockID id { 0 };
+		AnyNode node;
+		// Lookups through a node with buffered messages go to its page.
+		bool has_messages { false };
+		// Index of each child in PinnedTree::nodes, or -1 if it isn't pinned.
+		int children[max_capacity<Child>];
+	};
+
+	struct PinnedTree {
+		BufferAllocator* owner { nullptr };
+		BlockID root { 0 };
+		// Distinguishes tree versions, even ones that reuse a root block.
+		uint64_t generation { 0 };
+		size_t count { 0 };
+		// The root is nodes[0].
+		PinnedNode nodes[MAX_PINNED_NODES];
+
+		const PinnedNode* find(BlockID id) const;
+	};
+
+	// Starts from `finger` when it covers the key, and otherwise records
+	// the leaf reached in it.
+	static std::optional<Value> search_pinned(BufferAllocator& ba, const PinnedTree& pinned, Key key,
+			Finger* finger = nullptr);
+
+	/*
+	 * The pinned copy of the current tree version. Writers publish a new
+	 * copy whenever they commit a new root, readers pick up whichever copy
+	 * is current without taking a lock.
+	 */
+	class PinnedRoot {
+		private:
+			std::atomic<std::shared_ptr<const PinnedTree>> m_current;
+
+			// Retired copies are reused once no reader holds them, so
+			// publishing doesn't allocate in the steady state.
+			static const size_t POOL_SIZE = 4;
+			std::shared_ptr<PinnedTree> m_pool[POOL_SIZE];
+			// Only written by publish, under the writer lock.
+			uint64_t m_generation { 0 };
+
+			std::shared_ptr<PinnedTree> take_unused();
+
+		public:
+			// `replaced` is the root this one succeeds, or 0 for a new tree.
+			// Returns the generation of the new version.
+			uint64_t publish(BufferAllocator& ba, BlockID root, BlockID replaced);
+			std::shared_ptr<const PinnedTree> current(BufferAllocator& ba);
+	};
+
+	private:
+		static bool less(const Key& a, const Key& b) { return Compare{}(a, b); }
+		static bool equal(const Key& a, const Key& b) { return !less(a, b) && !less(b, a); }
+
+		template <typename Entry>
+		static size_t node_capacity(BufferAllocator& ba);
+		template <typename Entry>
+		static Unpacked<Entry> empty_node();
+		template <typename Entry>
+		static Unpacked<Entry> unpack(Node* node);
+		template <typename Entry>
+		static BufferPointer write_entries(BufferAllocator& ba, Unpacked<Entry>& node);
+
+		static InsertPropagation insert_leaf(BufferAllocator& ba, Leaf* node, Record record, Finger* finger);
+		static InsertPropagation insert_node(BufferAllocator& ba, FreedBlocks& freed, Interior* node, Record record,
+				Finger* finger);
+
+		static Key min_key(BufferAllocator& ba, BlockID id);
+		static size_t height(BufferAllocator& ba, BlockID id);
+
+		static DeletePropagation delete_leaf(Leaf* node, Key key);
+		static DeletePropagation delete_node(BufferAllocator& ba, FreedBlocks& freed, Interior* node, Key key);
+
+		template <typename Entry>
+		static DeletePropagation rebalance(BufferAllocator& ba, FreedBlocks& freed,
+				Interior* node, size_t idx, Unpacked<Entry>& new_child, Value deleted_value);
+		template <typename Entry>
+		static DeletePropagation delete_merge(BufferAllocator& ba, FreedBlocks& freed,
+				Interior* root, Unpacked<Entry>* left, Unpacked<Entry>* right,
+				size_t left_idx, size_t right_idx, Value deleted_value);
+		template <typename Entry>
+		static DeletePropagation move_from_right(BufferAllocator& ba, FreedBlocks& freed,
+				Interior* root, Unpacked<Entry>* node, Unpacked<Entry>* right,
+				int node_idx, int right_idx, Value deleted_value);
+		template <typename Entry>
+		static DeletePropagation move_from_left(BufferAllocator& ba, FreedBlocks& freed,
+				Interior* root, Unpacked<Entry>* left, Unpacked<Entry>* node,
+				int left_idx, int node_idx, Value deleted_value);
+
+		static int pin_node(BufferAllocator& ba, PinnedTree& pinned, const PinnedTree* previous,
+				BlockID id, size_t level);
+
+		using Records = std::vector<Record>;
+		using Children = std::vector<Child>;
+		using Messages = std::vector<Message>;
+
+		// An interior node being rebuilt by a flush.
+		struct PendingInterior {
+			Children children;
+			Messages messages;
+
+			void clear() { children.clear(); messages.clear(); }
+		};
+
+		static std::optional<Message> find_message(Node* node, Key key);
+		static void merge_leaf(Node* node, const Message* messages, size_t count, Records& out);
+		static void merge_messages(Messages& older, const Message* newer, size_t count);
+		static bool scan_node(BufferAllocator& ba, BlockID id, Key low, Key high, const Messages& pending,
+				const std::function<bool(Key, Value)>& visit);
+
+		static void retire(BufferAllocator& ba, FreedBlocks& freed, BlockID id);
+		static BlockID write_leaf_run(BufferAllocator& ba, const Record* records, size_t count);
+		static BlockID write_interior_run(BufferAllocator& ba, const Child* children, size_t count,
+				const Message* messages, size_t message_count);
+		static void chunk_leaf(BufferAllocator& ba, const Records& records, Children& out);
+		static void chunk_interior(BufferAllocator& ba, PendingInterior& node, Children& out);
+		static bool underfull(BufferAllocator& ba, BlockID id);
+
+		static void apply(BufferAllocator& ba, FreedBlocks& freed, BlockID id,
+				const Message* messages, size_t count, Children& out);
+		static void normalize(BufferAllocator& ba, FreedBlocks& freed, PendingInterior& node, Children& out);
+		static void flush_largest(BufferAllocator& ba, FreedBlocks& freed, PendingInterior& node);
+		static void replace_child(BufferAllocator& ba, FreedBlocks& freed, PendingInterior& node,
+				size_t idx, Children& pieces);
+		static size_t splice_child(PendingInterior& node, size_t idx, Children& pieces);
+		static void repair_child(BufferAllocator& ba, FreedBlocks& freed, PendingInterior& node, size_t idx);
+		static void repair_fresh(BufferAllocator& ba, FreedBlocks& freed, PendingInterior& node);
+		static void merge_siblings(BufferAllocator& ba, FreedBlocks& freed, Child left, Child right,
+				Children& out);
+		static BlockID make_root(BufferAllocator& ba, FreedBlocks& freed, Children& pieces);
+
+		static bool delete_range_node(BufferAllocator& ba, FreedBlocks& freed, BlockID id,
+				Key low, Key high, const Message* messages, size_t count,
+				RangeDeletion& deletion, Children& out);
 };
 
-DeletePropagation delete_btree(BufferAllocator& ba, std::unordered_set<BlockID>& free, BlockID id, KeyId key);
-DeletePropagation delete_leaf(BufferAllocator& ba, std::unordered_set<BlockID>& free, BTNode* node, KeyId key);
-DeletePropagation delete_node(BufferAllocator& ba, std::unordered_set<BlockID>& free, BTNode* node, KeyId key);
+//const size_t MAX_KEY_PAIRS = (PAGE_SIZE - sizeof(BTNodeHeader)) / sizeof(KeyPair);
+const size_t MAX_KEY_PAIRS = 6;
+
+// The tree mapping file system keys to the blocks holding them.
+using FileTree = BTree<KeyId, BlockID, std::less<KeyId>,
+	sizeof(BTNodeHeader) + MAX_KEY_PAIRS * (sizeof(KeyId) + sizeof(BlockID))>;
+using KeyPair = FileTree::Record;
+
+// Narrow keys in small nodes. Only the tests build it, so the template is
+// exercised with a record layout and node size other than FileTree's.
+using SmallTree = BTree<uint32_t, uint64_t, std::less<uint32_t>, 512>;
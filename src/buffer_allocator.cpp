@@ -1,4 +1,5 @@
 #include <cstring>
+#include <unistd.h>
 
 #include "buffer_allocator.h"
 
@@ -18,9 +19,57 @@ BufferAllocator::BufferAllocator(FILE* file, size_t capacity) : m_file(file), m_
 	for(size_t i = 0; i < m_capacity; i++) {
 		m_tags[i].index = i;
 	}
+
+	size_t slots = 1;
+	while (slots < 2 * m_capacity) slots <<= 1;
+	m_index_slots = new IndexSlot[slots];
+	m_index_mask = slots - 1;
+}
+
+size_t BufferAllocator::index_home(size_t offset) {
+	// Offsets are page aligned, so hash the page number.
+	return ((offset / PAGE_SIZE) * 0x9E3779B97F4A7C15ull >> 17) & m_index_mask;
+}
+
+int BufferAllocator::find_index(size_t offset) {
+	for (size_t i = index_home(offset); ; i = (i + 1) & m_index_mask) {
+		auto& slot = m_index_slots[i];
+		if (slot.index < 0) return -1;
+		if (slot.offset == offset) return slot.index;
+	}
+}
+
+void BufferAllocator::insert_index(size_t offset, size_t index) {
+	size_t i = index_home(offset);
+	while (m_index_slots[i].index >= 0 && m_index_slots[i].offset != offset) {
+		i = (i + 1) & m_index_mask;
+	}
+	m_index_slots[i] = IndexSlot { .offset = offset, .index = (int)index };
+}
+
+void BufferAllocator::erase_index(size_t offset) {
+	size_t i = index_home(offset);
+	for (; m_index_slots[i].offset != offset; i = (i + 1) & m_index_mask) {
+		if (m_index_slots[i].index < 0) return;
+	}
+
+	// Shift back any later entries of the probe run that would become
+	// unreachable through the hole.
+	for (size_t j = (i + 1) & m_index_mask; m_index_slots[j].index >= 0; j = (j + 1) & m_index_mask) {
+		size_t home = index_home(m_index_slots[j].offset);
+		bool reachable = i <= j
+			? (i < home && home <= j)
+			: (i < home || home <= j);
+		if (!reachable) {
+			m_index_slots[i] = m_index_slots[j];
+			i = j;
+		}
+	}
+	m_index_slots[i] = IndexSlot {};
 }
 
 BlockID BufferAllocator::get_id(size_t index) {
+	std::scoped_lock lock(m_lock);
 	if (index < 0 || m_capacity <= index)
 		return -1; // TODO: handle bad argument
 	auto tag = &m_tags[index];
@@ -28,6 +77,7 @@ BlockID BufferAllocator::get_id(size_t index) {
 }
 
 void BufferAllocator::set_dirty(size_t index) {
+	std::scoped_lock lock(m_lock);
 	if (index < 0 || m_capacity <= index)
 		return;
 	auto tag = &m_tags[index];
@@ -53,13 +103,14 @@ void BufferAllocator::unallocate(size_t index) {
 	tag->next = m_free;
 	tag->references = 0;
 	tag->dirty = false;
-	m_offset_to_index.erase(tag->offset);
+	erase_index(tag->offset);
 	tag->offset = 0;
 
 	m_free = tag;
 }
 
 size_t BufferAllocator::obtain(size_t index) {
+	std::scoped_lock lock(m_lock);
 	if (index < 0 || m_capacity <= index)
 		return -1;
 	auto tag = &m_tags[index];
@@ -74,23 +125,43 @@ char* BufferAllocator::get_buffer(size_t index) {
 }
 
 void BufferAllocator::release(size_t index) {
+	std::unique_lock lock(m_lock);
 	if (index < 0 || m_capacity <= index)
 		return;
 
 	auto tag = &m_tags[index];
 	tag->references--;
-	//printf("releasing %d %d\n", index, tag->references);
-	if (tag->references <= 0) {
-		//printf("flushing %d\n", index);
-		flush(index);
+	if (tag->references > 0) return;
+
+	auto offset = tag->offset;
+	flush(lock, index);
+	// The frame may have been loaded again while it was written back, or
+	// dirtied and released again, in which case that release frees it.
+	if (tag->references <= 0 && !tag->dirty && !tag->writing && find_index(offset) == (int)index) {
 		unallocate(index);
 	}
 }
 
+bool BufferAllocator::being_written(size_t offset) {
+	for (auto [start, len] : m_unloaded_writes) {
+		if (start <= offset && offset < start + len) return true;
+	}
+	return false;
+}
+
 BufferPointer BufferAllocator::load(size_t offset) {
-	if (m_offset_to_index.count(offset) > 0) {
-		auto idx = m_offset_to_index[offset];
-		return BufferPointer(*this, idx, get_buffer(idx));
+	std::unique_lock lock(m_lock);
+	while (being_written(offset)) {
+		m_io_done.wait(lock);
+	}
+
+	auto cached = find_index(offset);
+	if (cached >= 0) {
+		BufferPointer page(*this, cached, get_buffer(cached));
+		while (m_tags[cached].loading) {
+			m_io_done.wait(lock);
+		}
+		return page;
 	}
 
 	// TODO: unallocate on failure
@@ -100,30 +171,84 @@ BufferPointer BufferAllocator::load(size_t offset) {
 	auto tag = &m_tags[idx];
 	char* buffer = get_buffer(idx);
 
+	// Indexed before it's read, so loads of the same block wait for it.
 	tag->offset = offset;
+	tag->loading = true;
+	insert_index(offset, idx);
+	BufferPointer page(*this, idx, buffer);
 
+	lock.unlock();
 	// TODO: error checking
-	fseek(m_file, offset, SEEK_SET);
-	fread(buffer, sizeof(char), PAGE_SIZE, m_file);
+	pread(fd(), buffer, PAGE_SIZE, offset);
+	lock.lock();
+
+	tag->loading = false;
+	m_io_done.notify_all();
+	return page;
+}
+
+BufferPointer BufferAllocator::find_loaded(size_t offset) {
+	std::scoped_lock lock(m_lock);
+	auto cached = find_index(offset);
+	if (cached < 0) return BufferPointer();
+	return BufferPointer(*this, cached, get_buffer(cached));
+}
+
+int BufferAllocator::fd() {
+	return fileno(m_file);
+}
+
+bool BufferAllocator::write_unloaded(size_t offset, size_t len, const std::function<void(int)>& write) {
+	std::unique_lock lock(m_lock);
+	for (size_t page = offset; page < offset + len; page += PAGE_SIZE) {
+		if (find_index(page) >= 0 || being_written(page)) return false;
+	}
 
-	m_offset_to_index[offset] = idx;
+	m_unloaded_writes.emplace_back(offset, len);
+	lock.unlock();
+	write(fd());
+	lock.lock();
 
-	return BufferPointer(*this, idx, buffer);
+	std::erase(m_unloaded_writes, std::make_pair(offset, len));
+	m_io_done.notify_all();
+	return true;
 }
 
 void BufferAllocator::flush(size_t index) {
+	std::unique_lock lock(m_lock);
 	if (index < 0 || m_capacity <= index)
 		return;
+	flush(lock, index);
+}
 
+void BufferAllocator::flush(std::unique_lock<std::recursive_mutex>& lock, size_t index) {
 	auto tag = &m_tags[index];
+	while (tag->writing) {
+		m_io_done.wait(lock);
+	}
 	if (!tag->dirty) return;
 	char* buffer = get_buffer(index);
 
+	// Dirtied again while it's written, it's written again after.
+	tag->dirty = false;
+	tag->writing = true;
+	auto offset = tag->offset;
+
+	lock.unlock();
 	// TODO: error checking
-	fseek(m_file, tag->offset, SEEK_SET);
-	fwrite(buffer, sizeof(char), PAGE_SIZE, m_file);
+	// Unbuffered, so the image is as current for readers of fd().
+	pwrite(fd(), buffer, PAGE_SIZE, offset);
+	lock.lock();
 
-	tag->dirty = false;
+	tag->writing = false;
+	m_io_done.notify_all();
+}
+
+void BufferAllocator::flush_all() {
+	std::unique_lock lock(m_lock);
+	for (size_t i = 0; i < m_capacity; i++) {
+		if (m_tags[i].references > 0) flush(lock, i);
+	}
 }
 
 void BufferPointer::write(void* buf, size_t len, size_t offset) {
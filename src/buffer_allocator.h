@@ -1,8 +1,12 @@
 #pragma once
 
-#include <unordered_map>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdio>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 #include "definitions.h"
 
@@ -12,6 +16,10 @@ struct BufferTag {
 	int references { 0 };
 	bool dirty { false };
 	size_t offset { 0 };
+	// The frame is being read from or written to the image, which is done
+	// without holding the pool's lock.
+	bool loading { false };
+	bool writing { false };
 };
 
 class BufferPointer;
@@ -21,24 +29,64 @@ class BufferAllocator {
 	private:
 		
 		FILE* m_file { nullptr }; 
+		// Readers load pages concurrently with the writer, so the pool's
+		// bookkeeping is guarded. Recursive as load() hands out a pointer
+		// which obtains the frame.
+		std::recursive_mutex m_lock;
+		// Signalled whenever I/O on a frame or a write_unloaded finishes.
+		std::condition_variable_any m_io_done;
+		// Ranges write_unloaded is writing, which can't be loaded meanwhile.
+		std::vector<std::pair<size_t, size_t>> m_unloaded_writes;
 		BufferTag* m_free { nullptr };
 		size_t m_capacity { 0 };
 		BufferTag* m_tags { nullptr };
 		char* m_buffers { nullptr };
 
-		std::unordered_map<size_t, size_t> m_offset_to_index;
+		// Open addressed (linear probing) map of block offset to buffer
+		// index. It has twice as many slots as there are buffers so it
+		// never fills, which means loads never allocate.
+		struct IndexSlot {
+			size_t offset { 0 };
+			int index { -1 };
+		};
+		IndexSlot* m_index_slots { nullptr };
+		size_t m_index_mask { 0 };
+
+		size_t index_home(size_t offset);
+		int find_index(size_t offset);
+		void insert_index(size_t offset, size_t index);
+		void erase_index(size_t offset);
 
 		size_t allocate();
 		void unallocate(size_t index);
 
 		void evict(size_t index);
 
+		bool being_written(size_t offset);
+		// Writes the frame back if dirty, dropping `lock`, which must be
+		// held exactly once, while it does.
+		void flush(std::unique_lock<std::recursive_mutex>& lock, size_t index);
+
 	public:
 		BufferAllocator(FILE* file, size_t capacity);
 
 		
 		BufferPointer load(size_t offset);
+		// The frame holding `offset` if it is loaded, without loading it.
+		BufferPointer find_loaded(size_t offset);
 		void flush(size_t index);
+		// Writes back every dirty frame, pinned or not.
+		void flush_all();
+
+		// The image, for reading blocks that aren't loaded without going
+		// through a frame. Frames are written back once released, so only
+		// a loaded block can be newer than the image.
+		int fd();
+		// Calls `write` with fd() to write [offset, offset + len) of the
+		// image straight, if none of its blocks are loaded, holding off
+		// loads of them until it returns so no frame sees half of it.
+		// Returns false without calling it otherwise.
+		bool write_unloaded(size_t offset, size_t len, const std::function<void(int)>& write);
 
 		char* get_buffer(size_t index);
 		size_t obtain(size_t index);
@@ -6,7 +6,15 @@
 
 using BlockID = uint64_t;
 
-const size_t PAGE_SIZE = 4096;
+// The block size every on-disk structure is laid out for: 4K, 16K or 64K,
+// picked per build (make BLOCK_SIZE=16384). Larger blocks suit big files
+// and packed, high fanout trees, 4K suits images of small files.
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE 4096
+#endif
+const size_t PAGE_SIZE = BLOCK_SIZE;
+static_assert(PAGE_SIZE == 4096 || PAGE_SIZE == 16384 || PAGE_SIZE == 65536,
+		"blocks are 4K, 16K or 64K");
 
 // Free list, could be more optimised
 struct [[gnu::packed]] FreeList {
@@ -28,11 +36,101 @@ struct [[gnu::packed]] FreeListPage {
 using KeyId = uint64_t;
 const KeyId MAX_KEY_ID = std::numeric_limits<uint64_t>::max();
 
+/*
+ * Tree keys are structured as (object, record type, offset), packed into a
+ * KeyId high bits first so comparing KeyIds compares the parts in that
+ * order. Every record of an object (an inode) then sits in one contiguous
+ * run of the tree, which a single range scan visits type by type. The
+ * offset is a position or a hash, depending on the record type.
+ */
+enum class RecordType : uint8_t {
+	// The block holding the object itself, at offset 0, followed by its
+	// attributes (see InodeAttr). Those values are the attributes
+	// themselves rather than blocks.
+	Inode = 0,
+	// Block number `offset` of a file's contents, a page each.
+	Data = 1,
+	// The entries of a directory whose names hash up to `offset`, a page
+	// each (see dir_index.h).
+	DirBucket = 2,
+};
+
+const unsigned KEY_TYPE_BITS = 8;
+const unsigned KEY_OFFSET_BITS = 24;
+const unsigned KEY_OBJECT_BITS = 64 - KEY_TYPE_BITS - KEY_OFFSET_BITS;
+
+// Objects are numbered from 1, as handed out by SuperBlock::next_key.
+const KeyId MAX_OBJECT_ID = (KeyId(1) << KEY_OBJECT_BITS) - 1;
+const uint64_t MAX_KEY_OFFSET = (uint64_t(1) << KEY_OFFSET_BITS) - 1;
+
+constexpr KeyId make_key(KeyId object, RecordType type, uint64_t offset) {
+	return object << (KEY_TYPE_BITS + KEY_OFFSET_BITS)
+		| KeyId(type) << KEY_OFFSET_BITS
+		| (offset & MAX_KEY_OFFSET);
+}
+
+constexpr KeyId key_object(KeyId key) { return key >> (KEY_TYPE_BITS + KEY_OFFSET_BITS); }
+constexpr RecordType key_type(KeyId key) { return RecordType((key >> KEY_OFFSET_BITS) & 0xff); }
+constexpr uint64_t key_offset(KeyId key) { return key & MAX_KEY_OFFSET; }
+
+/*
+ * The attributes stat reports, kept beside the inode block so reading them
+ * is a scan of the leaf that holds it and never loads a page. The block
+ * still says what kind of object it is and, for files, how large. Tree
+ * values are 64 bits, so each attribute is a record of its own. Nothing
+ * records an owner, an access time or a change time.
+ */
+enum class InodeAttr : uint8_t {
+	// st_mode in the low 32 bits, the link count in the high ones.
+	Mode = 1,
+	Size = 2,
+	// Nanoseconds since the epoch.
+	MTime = 3,
+};
+
+// The key of an object's own block.
+constexpr KeyId inode_key(KeyId object) { return make_key(object, RecordType::Inode, 0); }
+// The key of one of an object's attributes.
+constexpr KeyId attr_key(KeyId object, InodeAttr attr) { return make_key(object, RecordType::Inode, uint64_t(attr)); }
+// Whether the value of `key` is a block, which the tree counts and frees.
+constexpr bool holds_block(KeyId key) { return key_type(key) != RecordType::Inode || key_offset(key) == 0; }
+// The key of block `index` of a file.
+constexpr KeyId data_key(KeyId object, uint64_t index) { return make_key(object, RecordType::Data, index); }
+// The key of the directory bucket ending at `hash`.
+constexpr KeyId bucket_key(KeyId object, uint64_t hash) { return make_key(object, RecordType::DirBucket, hash); }
+// The keys of an object's records are [object_start(object), object_end(object)).
+constexpr KeyId object_start(KeyId object) { return make_key(object, RecordType::Inode, 0); }
+constexpr KeyId object_end(KeyId object) { return make_key(object + 1, RecordType::Inode, 0); }
+
+
 
+// Bumped whenever blocks are laid out differently, so an image is only read
+// by a build that understands it. 1 added the format byte of node headers
+// (see BTree.h), images from before have 0.
+const uint32_t FORMAT_VERSION = 1;
 
 struct [[gnu::packed]] SuperBlock {
 	BlockID next_key { 0 };
 	FreeList free_list { 0 };
 	BlockID tree_root { 0 };
+	// Store b tree nodes in the packed format (see BTree.h).
+	bool pack_nodes { false };
+	// Snapshot bookkeeping reserved at creation (see snapshot.h).
+	BlockID share_table { 0 };
+	size_t share_table_pages { 0 };
+	BlockID snapshot_table { 0 };
+	// Keep message buffers in interior nodes (see BTree.h).
+	bool buffer_nodes { false };
+	// The block size the image was created with. Only a build with the
+	// same PAGE_SIZE can open it.
+	size_t block_size { 0 };
+	// Files up to this size keep their contents in their inode (see File
+	// in file_system.h).
+	size_t inline_limit { 0 };
+	// The intent log reserved at creation (see intent_log.h).
+	BlockID log_start { 0 };
+	size_t log_pages { 0 };
+	// See FORMAT_VERSION.
+	uint32_t format_version { 0 };
 };
 
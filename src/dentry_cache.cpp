@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <cstring>
+
+#include "dentry_cache.h"
+#include "dir_index.h"
+
+// Bounds each shard however large the image is.
+const size_t MAX_SHARD_ENTRIES = 1 << 12;
+
+KeyId DentryCache::key(KeyId parent, const char* name, size_t len) {
+	return bucket_key(parent, name_hash(name, len));
+}
+
+DentryCache::Shard& DentryCache::shard(KeyId key) {
+	// The low bits are the name hash, the parent is mixed in so one large
+	// directory doesn't land in one shard per hash.
+	return m_shards[(key ^ key_object(key) * 0x9e3779b97f4a7c15ull) % SHARDS];
+}
+
+std::list<DentryCache::Entry>::iterator DentryCache::find(Shard& shard, KeyId key, const char* name, size_t len) {
+	auto [begin, end] = shard.index.equal_range(key);
+	for (auto it = begin; it != end; it++) {
+		auto& entry = *it->second;
+		if (entry.name.size() == len && memcmp(entry.name.data(), name, len) == 0) {
+			return it->second;
+		}
+	}
+	return shard.entries.end();
+}
+
+void DentryCache::erase(Shard& shard, std::list<Entry>::iterator entry) {
+	auto [begin, end] = shard.index.equal_range(entry->key);
+	for (auto it = begin; it != end; it++) {
+		if (it->second == entry) {
+			shard.index.erase(it);
+			break;
+		}
+	}
+	shard.entries.erase(entry);
+}
+
+void DentryCache::reset(BufferAllocator& ba, size_t capacity) {
+	m_owner.store(nullptr);
+	m_shard_capacity = std::clamp<size_t>(capacity / SHARDS, 1, MAX_SHARD_ENTRIES);
+	for (auto& shard : m_shards) {
+		std::scoped_lock lock(shard.lock);
+		shard.entries.clear();
+		shard.index.clear();
+		// Keeps counting, so no earlier miss is cached.
+		shard.generation++;
+	}
+	m_owner.store(&ba);
+}
+
+bool DentryCache::find(BufferAllocator& ba, KeyId parent, const char* name, size_t len,
+		Dentry& dentry, uint64_t& generation) {
+	if (m_owner.load() != &ba) {
+		generation = UINT64_MAX;
+		return false;
+	}
+
+	auto k = key(parent, name, len);
+	auto& s = shard(k);
+	std::scoped_lock lock(s.lock);
+	auto entry = find(s, k, name, len);
+	if (entry == s.entries.end()) {
+		generation = s.generation;
+		return false;
+	}
+
+	s.entries.splice(s.entries.begin(), s.entries, entry);
+	dentry = entry->dentry;
+	return true;
+}
+
+void DentryCache::insert(BufferAllocator& ba, KeyId parent, const char* name, size_t len,
+		Dentry dentry, uint64_t generation) {
+	if (m_owner.load() != &ba) return;
+
+	auto k = key(parent, name, len);
+	auto& s = shard(k);
+	std::scoped_lock lock(s.lock);
+	if (s.generation != generation) return;
+
+	auto entry = find(s, k, name, len);
+	if (entry != s.entries.end()) {
+		entry->dentry = dentry;
+		s.entries.splice(s.entries.begin(), s.entries, entry);
+		return;
+	}
+
+	s.entries.push_front(Entry { k, std::string(name, len), dentry });
+	s.index.emplace(k, s.entries.begin());
+	if (s.entries.size() > m_shard_capacity) {
+		erase(s, std::prev(s.entries.end()));
+	}
+}
+
+void DentryCache::invalidate(BufferAllocator& ba, KeyId parent, const char* name, size_t len) {
+	if (m_owner.load() != &ba) {
+		m_owner.store(nullptr);
+		return;
+	}
+
+	auto k = key(parent, name, len);
+	auto& s = shard(k);
+	std::scoped_lock lock(s.lock);
+	s.generation++;
+	auto entry = find(s, k, name, len);
+	if (entry != s.entries.end()) {
+		erase(s, entry);
+	}
+}
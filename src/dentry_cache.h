@@ -0,0 +1,85 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "buffer_allocator.h"
+#include "definitions.h"
+#include "file_system.h"
+
+/*
+ * Caches what names resolve to in the mounted tree, so walking a path the
+ * kernel has forgotten doesn't descend to each directory's bucket again.
+ * Entries are keyed by the parent and the name's hash (the key of the
+ * bucket it would be in, see dir_index.h) and hold the name, so collisions
+ * are told apart. A name that isn't there is cached too, as object 0.
+ *
+ * The cache is split into shards, each with its own lock and LRU list, so
+ * lookups on different names rarely contend and each shard holds a bounded
+ * number of entries. Like the key filter it is memory only, emptied whenever
+ * a tree is mounted.
+ *
+ * Writers invalidate a name after changing it in the tree. Readers fill the
+ * cache from the tree they searched, which may be older than a write that
+ * finished meanwhile, so each shard counts its invalidations and a result
+ * is only cached if none happened since the lookup that missed.
+ */
+struct Dentry {
+	// 0 if there is no such name.
+	KeyId object { 0 };
+	FSType type { Unknown };
+};
+
+class DentryCache {
+	private:
+		struct Entry {
+			KeyId key;
+			std::string name;
+			Dentry dentry;
+		};
+
+		struct Shard {
+			std::mutex lock;
+			// Most recently used first.
+			std::list<Entry> entries;
+			std::unordered_multimap<KeyId, std::list<Entry>::iterator> index;
+			uint64_t generation { 0 };
+		};
+
+		static const size_t SHARDS = 64;
+
+		// The image the cache describes, or null while it doesn't
+		// describe any, in which case nothing is cached.
+		std::atomic<BufferAllocator*> m_owner { nullptr };
+		std::array<Shard, SHARDS> m_shards;
+		size_t m_shard_capacity { 0 };
+
+		static KeyId key(KeyId parent, const char* name, size_t len);
+		Shard& shard(KeyId key);
+		// With the shard locked.
+		std::list<Entry>::iterator find(Shard& shard, KeyId key, const char* name, size_t len);
+		void erase(Shard& shard, std::list<Entry>::iterator entry);
+
+	public:
+		// Empty the cache and bound it at about `capacity` names of `ba`.
+		// Must not race with readers, i.e. only call while mounting.
+		void reset(BufferAllocator& ba, size_t capacity);
+
+		// True with what `name` in `parent` resolves to if that's cached.
+		// Otherwise `generation` is set for caching the answer with insert.
+		bool find(BufferAllocator& ba, KeyId parent, const char* name, size_t len,
+				Dentry& dentry, uint64_t& generation);
+		// Caches a result found in the tree, unless the name's shard was
+		// invalidated since find returned `generation`.
+		void insert(BufferAllocator& ba, KeyId parent, const char* name, size_t len,
+				Dentry dentry, uint64_t generation);
+
+		// Writers only, after the name has changed in the tree. Changes to
+		// any other image invalidate the whole cache.
+		void invalidate(BufferAllocator& ba, KeyId parent, const char* name, size_t len);
+};
@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <cstring>
+
+#include "dir_index.h"
+
+NameHash name_hash(const char* name, size_t len) {
+	// FNV-1a, folded down to the bits a key offset has.
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 0x100000001b3ull;
+	}
+	return (hash ^ (hash >> 24) ^ (hash >> 48)) & MAX_KEY_OFFSET;
+}
+
+// Orders entries by hash, then name.
+static int compare_entry(const BucketEntry* entry, NameHash hash, const char* name, size_t len) {
+	if (entry->hash != hash) return entry->hash < hash ? -1 : 1;
+	auto common = memcmp(entry->name, name, std::min<size_t>(entry->name_len, len));
+	if (common != 0) return common;
+	if (entry->name_len == len) return 0;
+	return entry->name_len < len ? -1 : 1;
+}
+
+BucketEntry* DirBucket::find(NameHash hash, const char* name, size_t len) {
+	for (size_t i = 0; i < used;) {
+		auto entry = (BucketEntry*)&data[i];
+		auto order = compare_entry(entry, hash, name, len);
+		if (order == 0) return entry;
+		if (order > 0) break;
+		i += entry->size();
+	}
+	return nullptr;
+}
+
+bool DirBucket::insert(NameHash hash, const char* name, size_t len, KeyId object, FSType type) {
+	auto size = sizeof(BucketEntry) + len;
+	if (len > MAX_NAME_LEN || used + size > MAX_BUCKET_DATA) return false;
+
+	size_t at = 0;
+	while (at < used) {
+		auto entry = (BucketEntry*)&data[at];
+		if (compare_entry(entry, hash, name, len) > 0) break;
+		at += entry->size();
+	}
+
+	memmove(&data[at + size], &data[at], used - at);
+	auto entry = (BucketEntry*)&data[at];
+	entry->hash = hash;
+	entry->object = object;
+	entry->type = type;
+	entry->name_len = len;
+	memcpy(entry->name, name, len);
+
+	used += size;
+	count++;
+	return true;
+}
+
+std::optional<NameHash> DirBucket::split(DirBucket& low) {
+	if (count == 0) return {};
+	auto last_hash = ((BucketEntry*)&data[0])->hash;
+	for (size_t i = 0; i < used;) {
+		auto entry = (BucketEntry*)&data[i];
+		last_hash = entry->hash;
+		i += entry->size();
+	}
+
+	// The hash of the entry at the middle byte, unless that leaves nothing
+	// above it, in which case the last hash below it.
+	std::optional<NameHash> point;
+	size_t moved = 0;
+	size_t moved_count = 0;
+	for (size_t i = 0; i < used;) {
+		auto entry = (BucketEntry*)&data[i];
+		if (entry->hash == last_hash) break;
+		if (point && entry->hash != *point && i >= used / 2) break;
+
+		point = NameHash(entry->hash);
+		i += entry->size();
+		moved = i;
+		moved_count++;
+	}
+	if (!point) return {};
+
+	memcpy(low.data, data, moved);
+	low.used = moved;
+	low.count = moved_count;
+
+	memmove(data, &data[moved], used - moved);
+	used -= moved;
+	count -= moved_count;
+	return point;
+}
+
+uint64_t dir_cookie(NameHash hash, size_t ordinal) {
+	return ((uint64_t)hash << 32 | ordinal) + 1;
+}
+
+NameHash cookie_hash(uint64_t cookie) {
+	return (cookie - 1) >> 32;
+}
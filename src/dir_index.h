@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "definitions.h"
+#include "file_system.h"
+
+/*
+ * Directories are indexed by name hash. Their entries live in bucket pages,
+ * each the value of a DirBucket record (see definitions.h) whose offset is
+ * the last hash it takes: a bucket holds the names hashing above the
+ * previous bucket's offset up to its own, and the last one ends at
+ * MAX_KEY_OFFSET. Finding a name is a search for the first bucket at or
+ * after its hash, and a full bucket is split in two around the middle of
+ * its hashes, so lookups and inserts are a tree descent and a page each.
+ *
+ * Names with the same hash sit next to each other in one bucket, ordered by
+ * name, so collisions only cost a comparison. A readdir cookie is the hash
+ * and the position among the names sharing it, which splits don't change.
+ */
+
+using NameHash = uint32_t;
+// Hashes fit the offset of a key.
+NameHash name_hash(const char* name, size_t len);
+
+const size_t MAX_NAME_LEN = 255;
+
+// Cookies are never 0, which stands for the start of the directory.
+uint64_t dir_cookie(NameHash hash, size_t ordinal);
+NameHash cookie_hash(uint64_t cookie);
+
+struct [[gnu::packed]] BucketEntry {
+	NameHash hash { 0 };
+	KeyId object { 0 };
+	FSType type { Unknown };
+	uint8_t name_len { 0 };
+	char name[];
+
+	size_t size() const { return sizeof(BucketEntry) + name_len; }
+};
+
+const size_t MAX_BUCKET_DATA = PAGE_SIZE - 2 * sizeof(size_t);
+struct [[gnu::packed]] DirBucket {
+	size_t count { 0 };
+	// Bytes of `data` in use, entries are sorted by hash then name.
+	size_t used { 0 };
+	char data[MAX_BUCKET_DATA];
+
+	BucketEntry* find(NameHash hash, const char* name, size_t len);
+	// Returns false if there's no room for it.
+	bool insert(NameHash hash, const char* name, size_t len, KeyId object, FSType type);
+	// Moves the entries hashing up to some point, roughly half of them, to
+	// the empty bucket `low` and returns that point. Returns nothing if all
+	// the entries have the same hash, which can't be split.
+	std::optional<NameHash> split(DirBucket& low);
+
+	// Calls `visit(entry, cookie)` on each entry in order until it returns
+	// false, returning false if it did.
+	template <typename F>
+	bool for_each(F visit) {
+		size_t ordinal = 0;
+		BucketEntry* previous = nullptr;
+		for (size_t i = 0; i < used;) {
+			auto entry = (BucketEntry*)&data[i];
+			ordinal = previous && previous->hash == entry->hash ? ordinal + 1 : 0;
+			if (!visit(entry, dir_cookie(entry->hash, ordinal))) return false;
+			previous = entry;
+			i += entry->size();
+		}
+		return true;
+	}
+};
@@ -0,0 +1,133 @@
+#include <atomic>
+#include <vector>
+
+#include "epoch.h"
+
+struct alignas(64) ReaderSlot {
+	std::atomic<bool> claimed { false };
+	// The epoch the reader entered in, or 0 when not reading.
+	std::atomic<uint64_t> epoch { 0 };
+};
+
+const size_t MAX_READERS = 128;
+static ReaderSlot reader_slots[MAX_READERS];
+
+// Readers that couldn't claim a slot. Nothing is reclaimed while any exist.
+static std::atomic<size_t> overflow_readers { 0 };
+
+static std::atomic<uint64_t> global_epoch { 1 };
+
+struct RetiredBlock {
+	BufferAllocator* owner { nullptr };
+	BlockID id { 0 };
+	uint64_t epoch { 0 };
+};
+
+// Only touched by writers, which are serialised by the writer lock.
+static std::vector<RetiredBlock> retired;
+
+static ReaderSlot* claim_slot() {
+	for (auto& slot : reader_slots) {
+		bool expected = false;
+		if (slot.claimed.compare_exchange_strong(expected, true)) {
+			return &slot;
+		}
+	}
+	return nullptr;
+}
+
+struct ThreadReader {
+	ReaderSlot* slot { nullptr };
+	bool has_slot { false };
+	size_t depth { 0 };
+
+	~ThreadReader() {
+		if (slot) slot->claimed.store(false);
+	}
+};
+
+static thread_local ThreadReader thread_reader;
+
+EpochGuard::EpochGuard() {
+	auto& reader = thread_reader;
+	if (reader.depth++ > 0) return;
+
+	if (!reader.has_slot) {
+		reader.slot = claim_slot();
+		reader.has_slot = true;
+	}
+
+	if (reader.slot) {
+		reader.slot->epoch.store(global_epoch.load());
+	} else {
+		overflow_readers++;
+	}
+}
+
+EpochGuard::~EpochGuard() {
+	auto& reader = thread_reader;
+	if (--reader.depth > 0) return;
+
+	if (reader.slot) {
+		reader.slot->epoch.store(0);
+	} else {
+		overflow_readers--;
+	}
+}
+
+void retire_pages(BufferAllocator& ba, FreedBlocks& freed) {
+	// Readers that entered before this point may still hold the old root.
+	auto epoch = global_epoch.fetch_add(1);
+	for (auto block_id : freed.blocks) {
+		retired.push_back(RetiredBlock {
+			.owner = &ba,
+			.id = block_id,
+			.epoch = epoch,
+		});
+	}
+
+	reclaim_pages(ba);
+}
+
+// Frees the blocks of `ba` retired before `before`.
+static void free_retired(BufferAllocator& ba, uint64_t before) {
+	ScopedFreedBlocks scope;
+	auto& reclaimable = *scope;
+	size_t kept = 0;
+	for (auto& block : retired) {
+		if (block.owner == &ba && block.epoch < before) {
+			reclaimable.insert(block.id);
+		} else {
+			retired[kept++] = block;
+		}
+	}
+	retired.resize(kept);
+
+	if (!reclaimable.blocks.empty()) {
+		free_pages(ba, reclaimable);
+	}
+}
+
+void reclaim_pages(BufferAllocator& ba) {
+	if (retired.empty() || overflow_readers.load() > 0) return;
+
+	uint64_t oldest_reader = UINT64_MAX;
+	for (auto& slot : reader_slots) {
+		auto epoch = slot.epoch.load();
+		if (epoch != 0 && epoch < oldest_reader) oldest_reader = epoch;
+	}
+
+	free_retired(ba, oldest_reader);
+}
+
+void drain_retired_pages(BufferAllocator& ba) {
+	free_retired(ba, UINT64_MAX);
+}
+
+void forget_retired_pages(BufferAllocator& ba) {
+	size_t kept = 0;
+	for (auto& block : retired) {
+		if (block.owner != &ba) retired[kept++] = block;
+	}
+	retired.resize(kept);
+}
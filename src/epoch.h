@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+
+#include "buffer_allocator.h"
+#include "page_allocator.h"
+#include "definitions.h"
+
+/*
+ * Epoch based reclamation.
+ *
+ * Readers walk a copy on write snapshot of the tree without taking any lock,
+ * so a block a writer stops using may still be in use by a reader that
+ * started before the new root was published. Writers retire such blocks
+ * instead of freeing them, and they are only returned to the page allocator
+ * once every reader from that epoch has finished.
+ */
+
+// Held by a reader for as long as it uses blocks reached from a root. Guards
+// nest, so a reader may call functions that take their own.
+class EpochGuard {
+	public:
+		EpochGuard();
+		~EpochGuard();
+
+		EpochGuard(const EpochGuard&) = delete;
+		EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+// Hand blocks freed by a commit over to be freed once no reader can see
+// them. Must be called after the new root is published, with the writer lock
+// held.
+void retire_pages(BufferAllocator& ba, FreedBlocks& freed);
+
+// Free every retired block no active reader can still reach.
+void reclaim_pages(BufferAllocator& ba);
+
+// Free everything retired for `ba`. Only valid once no readers are left.
+void drain_retired_pages(BufferAllocator& ba);
+
+// Forget blocks retired for whatever image `ba` previously had open.
+void forget_retired_pages(BufferAllocator& ba);
@@ -12,15 +12,32 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
+#include <inttypes.h>
+#include <sys/stat.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <string>
 
 #include <optional>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <deque>
+#include <span>
+#include <thread>
 
 #include "file_system.h"
 #include "page_allocator.h"
+#include "epoch.h"
+#include "snapshot.h"
+#include "key_filter.h"
+#include "dentry_cache.h"
 #include "BTree.h"
+#include "dir_index.h"
+#include "readahead.h"
+#include "intent_log.h"
 
 SuperBlock* get_super_block(BufferAllocator& ba) {
 	auto super_block_raw = ba.load(0);
@@ -34,9 +51,10 @@ std::pair<SuperBlock*, BufferPointer> get_super_block2(BufferAllocator& ba) {
 	return {(SuperBlock*)super_block_raw.data(), super_block_raw};
 }
 
+// The block of the object numbered `key`.
 template <typename T>
 std::pair<T*, BufferPointer> get_block_by_key(BufferAllocator& ba, KeyId key) {
-	auto block_id = lookup(ba, key);
+	auto block_id = lookup(ba, inode_key(key));
 	if (!block_id.has_value()) {
 		return {nullptr, BufferPointer()};
 	}
@@ -46,7 +64,87 @@ std::pair<T*, BufferPointer> get_block_by_key(BufferAllocator& ba, KeyId key) {
 	return {block, block_raw};
 }
 
-void create_file_system(BufferAllocator& ba, size_t total_pages) {
+// The decoded top of the current tree, republished whenever the root changes.
+FileTree::PinnedRoot pinned_root;
+
+// Keys of the mounted tree, so lookups of missing keys skip the descent.
+KeyFilter key_filter;
+
+// Names resolved in the mounted tree, so path walks skip the buckets.
+DentryCache dentry_cache;
+
+// The leaf each thread last reached in the mounted tree.
+thread_local FileTree::Finger finger;
+
+// Serialises everything that modifies the image. Readers don't take it, they
+// work from the published root under an EpochGuard.
+std::recursive_mutex writer_lock;
+
+// Pages overwritten in place are changed under their object's lock, held
+// exclusively, and read under it shared, so readers never see half a change.
+// Objects share locks, so nothing takes a second one while holding one.
+std::shared_mutex object_locks[64];
+
+static std::shared_mutex& object_lock(KeyId object) {
+	return object_locks[object % std::size(object_locks)];
+}
+
+// The writable clone the file system is mounted on, or empty for the live
+// tree in the super block.
+std::optional<size_t> mounted_clone;
+
+// Logs changes while mounted, and the last checkpoint it was started over
+// after (see intent_log.h).
+IntentLog intent_log;
+LogHeader log_header;
+
+// The root of the mounted tree, and the page it is stored in.
+std::pair<BlockID*, BufferPointer> get_tree_root(BufferAllocator& ba) {
+	if (mounted_clone.has_value()) {
+		auto [table, table_raw] = get_snapshot_table(ba);
+		return {&table->entries[mounted_clone.value()].root, table_raw};
+	}
+
+	auto [super_block, super_block_raw] = get_super_block2(ba);
+	return {&super_block->tree_root, super_block_raw};
+}
+
+// Refill the key filter from the tree at `root`, sized for the keys it holds.
+static void rebuild_key_filter(BufferAllocator& ba, BlockID root) {
+	std::vector<KeyId> keys;
+	FileTree::scan(ba, root, [&](KeyId key, BlockID) {
+		keys.push_back(key);
+	});
+	key_filter.reset(ba, keys.size());
+	for (auto key : keys) {
+		key_filter.add(ba, key);
+	}
+}
+
+// Rebuilds the key filter larger once the tree at `root` outgrew it. Called
+// with the writer lock held, before an update, so `root` holds every key.
+static void grow_key_filter(BufferAllocator& ba, BlockID root) {
+	if (!key_filter.overfull()) return;
+	key_filter.grow(ba, [&](const std::function<void(KeyId)>& add) {
+		FileTree::scan(ba, root, [&](KeyId key, BlockID) {
+			add(key);
+		});
+	});
+}
+
+// The intent log takes 1/128 of the image, within these bounds.
+const size_t MIN_LOG_PAGES = 16;
+const size_t MAX_LOG_PAGES = 2048;
+
+static uint64_t now();
+
+void create_file_system(BufferAllocator& ba, size_t total_pages, bool pack_nodes,
+		bool buffer_nodes, size_t inline_limit) {
+	intent_log.stop_checkpoints();
+	std::scoped_lock lock(writer_lock);
+	forget_retired_pages(ba);
+	intent_log.close();
+	mounted_clone.reset();
 	auto [sb, sb_raw] = get_super_block2(ba);
 
 	// Write super block
@@ -57,37 +155,200 @@ void create_file_system(BufferAllocator& ba, size_t total_pages) {
 			.next_free = 0,
 			.highest_unallocated = 1*PAGE_SIZE,
 		},
+		.pack_nodes = pack_nodes,
+		.buffer_nodes = buffer_nodes,
+		.block_size = PAGE_SIZE,
+		.inline_limit = std::min(inline_limit, MAX_FILE_DATA),
+		.format_version = FORMAT_VERSION,
 	};
 	sb_raw.set_dirty();
+	create_snapshot_tables(ba, total_pages);
+
+	// Records are checked against the header before they are read, so the
+	// region isn't cleared. Starting the sequence from the time keeps any
+	// records left there from an earlier image from looking current.
+	sb->log_pages = std::clamp(total_pages / 128, MIN_LOG_PAGES, MAX_LOG_PAGES);
+	sb->log_start = reserve_pages(ba, sb->log_pages, false);
+	write_log_header(ba.fd(), sb->log_start, LogHeader { .sequence = now() });
 
-	auto initial_root = new_empty_leaf(ba);
+	auto initial_root = FileTree::new_empty_leaf(ba);
 	sb->tree_root = initial_root.id();
+	key_filter.reset(ba, 0);
+	dentry_cache.reset(ba, total_pages);
+	pinned_root.publish(ba, sb->tree_root, 0);
+}
+
+size_t image_block_size(BufferAllocator& ba) {
+	// The super block's fields sit well within the smallest block.
+	auto [super_block, _] = get_super_block2(ba);
+	return super_block->block_size;
+}
+
+uint32_t image_format_version(BufferAllocator& ba) {
+	auto [super_block, _] = get_super_block2(ba);
+	return super_block->format_version;
+}
+
+static bool recover(BufferAllocator& ba, const LogHeader& header, BlockID mounted);
+static void drop_checkpoints(BufferAllocator& ba, std::optional<size_t> keep);
+
+// Tell the kernel, while mounted, to drop what it cached of changes it
+// didn't ask for (see KernelNotifier). invalidate_objects covers every
+// object numbered [first, last] in the mounted tree, and its entries.
+// invalidate_changes covers what differs between the trees at `from` and
+// `to`, going by their records.
+static void invalidate_inode(KeyId object, size_t off, size_t len);
+static void invalidate_entry(KeyId dir, const char* name, size_t len);
+static void invalidate_objects(BufferAllocator& ba, KeyId first, KeyId last);
+static void invalidate_changes(BufferAllocator& ba, BlockID from, BlockID to);
+
+bool open_file_system(BufferAllocator& ba, const char* clone) {
+	intent_log.stop_checkpoints();
+	std::scoped_lock lock(writer_lock);
+	forget_retired_pages(ba);
+	intent_log.close();
+
+	// Older images are laid out differently throughout, so aren't read.
+	if (image_format_version(ba) != FORMAT_VERSION) return false;
+	if (image_block_size(ba) != PAGE_SIZE) return false;
+
+	// What the kernel has of the tree mounted until now, if any, stops
+	// being current wherever the tree switched to differs from it.
+	auto pinned = pinned_root.current(ba);
+	BlockID mounted = pinned ? pinned->root : 0;
+
+	// The log is only active while mounted.
+	LogHeader header;
+	auto log_start = get_super_block(ba)->log_start;
+	if (read_log_header(ba.fd(), log_start, header) && header.active) {
+		return recover(ba, header, mounted);
+	}
+	// Left behind if closing stopped short of deleting them.
+	drop_checkpoints(ba, {});
+
+	std::optional<size_t> index;
+	if (clone) {
+		index = find_snapshot(ba, clone);
+		if (!index.has_value()) return false;
+
+		auto [table, _] = get_snapshot_table(ba);
+		if (!table->entries[index.value()].writable) return false;
+	}
+	mounted_clone = index;
+
+	auto [root, _] = get_tree_root(ba);
+	if (mounted != 0) invalidate_changes(ba, mounted, *root);
+	rebuild_key_filter(ba, *root);
+	dentry_cache.reset(ba, get_super_block(ba)->free_list.total_pages);
+	pinned_root.publish(ba, *root, 0);
+	return true;
+}
+
+static void stop_intent_log(BufferAllocator& ba);
+
+void close_file_system(BufferAllocator& ba) {
+	intent_log.stop_checkpoints();
+	std::scoped_lock lock(writer_lock);
+	drain_retired_pages(ba);
+	stop_intent_log(ba);
 }
 
 std::optional<BlockID> lookup(BufferAllocator& ba, KeyId key) {
-	SuperBlock* super_block = get_super_block(ba);
+	if (!key_filter.may_contain(ba, key)) {
+		return {};
+	}
 
-	auto result = search_btree(ba, super_block->tree_root, key);
+	EpochGuard guard;
+
+	// Search the published snapshot, so readers never wait on a writer.
+	auto pinned = pinned_root.current(ba);
+	if (pinned) {
+		return FileTree::search_pinned(ba, *pinned, key, &finger);
+	}
+
+	// Nothing has been published for this image yet.
+	auto [root, _] = get_tree_root(ba);
+	auto result = FileTree::search(ba, *root, key);
 	return result;
 }
 
+void scan_object(BufferAllocator& ba, KeyId object, const std::function<void(KeyId, BlockID)>& visit) {
+	scan_keys(ba, object_start(object), object_end(object), visit);
+}
+
+void scan_keys(BufferAllocator& ba, KeyId low, KeyId high, const std::function<void(KeyId, BlockID)>& visit) {
+	scan_keys_until(ba, low, high, [&](KeyId key, BlockID value) {
+		visit(key, value);
+		return true;
+	});
+}
+
+bool scan_keys_until(BufferAllocator& ba, KeyId low, KeyId high, const std::function<bool(KeyId, BlockID)>& visit) {
+	EpochGuard guard;
+
+	auto pinned = pinned_root.current(ba);
+	auto root = pinned ? pinned->root : *get_tree_root(ba).first;
+	return FileTree::scan_until(ba, root, low, high, visit);
+}
+
+static bool buffered(BufferAllocator& ba) {
+	auto [super_block, _] = get_super_block2(ba);
+	return super_block->buffer_nodes;
+}
+
+// Deleted snapshots are released this many blocks at a time by each commit.
+const size_t DROP_STEPS_PER_COMMIT = 16;
+
+// Publishes the new root, then frees whatever is no longer reachable once
+// readers of the old one are done. Returns the generation of the new root.
+static uint64_t commit_root(BufferAllocator& ba, FreedBlocks& replaced,
+		BlockID old_root, BlockID new_root, std::span<const BlockID> dropped_values) {
+	auto generation = pinned_root.publish(ba, new_root, old_root);
+	release_replaced(ba, replaced, old_root, new_root, dropped_values);
+	retire_pages(ba, replaced);
+	reclaim_dropped_snapshots(ba, DROP_STEPS_PER_COMMIT);
+	return generation;
+}
+
 std::optional<BlockID> remove(BufferAllocator& ba, KeyId key) {
-	auto [super_block, super_block_raw] = get_super_block2(ba);
+	std::scoped_lock lock(writer_lock);
+	auto [root, root_raw] = get_tree_root(ba);
+
+	auto old_root = *root;
+	ScopedFreedBlocks scope;
+	auto& to_free = *scope;
+
+	if (buffered(ba)) {
+		// Queue a delete at the root, unless there's nothing to delete.
+		auto deleted = FileTree::search(ba, old_root, key);
+		if (!deleted) return {};
+
+		*root = FileTree::apply_buffered(ba, to_free, old_root, FileTree::Message {
+					.key = key,
+					.is_delete = true,
+				});
+		root_raw.set_dirty();
+		auto dropped = holds_block(key) ? *deleted : 0;
+		commit_root(ba, to_free, old_root, *root, {&dropped, 1});
+		key_filter.remove(ba, key);
+		return deleted;
+	}
 
-	std::unordered_set<BlockID> to_free;
-	auto propagation = delete_btree(ba, to_free, super_block->tree_root, key);
+	auto propagation = FileTree::remove(ba, to_free, old_root, key);
 
 	if (propagation.did_modify) {
-		auto new_root_raw = propagation.new_child;
-		auto new_root = (BTNode*) new_root_raw.data();
-		if (!new_root->header.is_leaf && new_root->header.count == 1) {
-			to_free.insert(new_root_raw.id());
-			super_block->tree_root = new_root->pairs[0].value;
+		auto& new_root = propagation.new_node;
+		auto interior = std::get_if<FileTree::Interior>(&new_root);
+		if (interior && interior->header.count == 1) {
+			*root = interior->pairs[0].value;
 		} else {
-			super_block->tree_root = propagation.new_child.id();
+			*root = FileTree::write_node(ba, new_root).id();
 		}
-		free_pages(ba, to_free);
-		super_block_raw.set_dirty();
+		root_raw.set_dirty();
+		auto dropped = holds_block(key) ? propagation.deleted_value : 0;
+		commit_root(ba, to_free, old_root, *root, {&dropped, 1});
+		// Only once no new reader can find the key.
+		key_filter.remove(ba, key);
 		return propagation.deleted_value;
 	}
 
@@ -95,40 +356,75 @@ std::optional<BlockID> remove(BufferAllocator& ba, KeyId key) {
 }
 
 std::optional<BlockID> insert(BufferAllocator& ba, KeyId key, BlockID value) {
-	auto [super_block, super_block_raw] = get_super_block2(ba);
+	std::scoped_lock lock(writer_lock);
+	auto [root, root_raw] = get_tree_root(ba);
+
+	auto old_root = *root;
+	grow_key_filter(ba, old_root);
+	ScopedFreedBlocks scope;
+	auto& to_free = *scope;
+
+	if (buffered(ba)) {
+		auto replaced = FileTree::search(ba, old_root, key);
+		if (replaced == value) return replaced;
+
+		// Leaves aren't written until messages reach them, so there is
+		// nothing to leave the finger on.
+		finger.reset();
+		if (!replaced) key_filter.add(ba, key);
+		*root = FileTree::apply_buffered(ba, to_free, old_root, FileTree::Message {
+					.key = key,
+					.value = value,
+					.is_delete = false,
+				});
+		root_raw.set_dirty();
+		auto dropped = holds_block(key) ? replaced.value_or(0) : 0;
+		commit_root(ba, to_free, old_root, *root, {&dropped, 1});
+		return replaced;
+	}
 
-	auto old_root = super_block->tree_root;
-	std::unordered_set<BlockID> to_free;
-	auto propagation = insert_btree(ba, to_free, super_block->tree_root, KeyPair {
+	// Keys are often inserted and then looked up in sequence, so leave the
+	// finger on the leaf the key went into.
+	finger.reset();
+	auto propagation = FileTree::insert(ba, to_free, old_root, KeyPair {
 				.key = key,
 				.value = value,
-			});
+			}, &finger);
 
 	if (propagation.is_split) {
 		// Make a new root
-		auto new_root_raw = new_empty_node(ba);
-		auto new_root = (BTNode*)new_root_raw.data();
-		new_root->header.count = 2;
-		new_root->pairs[0] = KeyPair {
+		auto new_root = FileTree::Interior {
+			.header = BTNodeHeader {
+				.is_leaf = false,
+				.count = 2,
+			},
+		};
+		new_root.pairs[0] = FileTree::Child {
 			.key = propagation.key,
 			.value = propagation.left,
 		};
-		new_root->pairs[1] = KeyPair {
-			.key = MAX_KEY_ID,
+		new_root.pairs[1] = FileTree::Child {
+			.key = FileTree::MAX_KEY,
 			.value = propagation.right,
 		};
-		new_root_raw.set_dirty();
-		super_block->tree_root = new_root_raw.id();
+		auto new_root_raw = FileTree::write_node(ba, new_root);
+		*root = new_root_raw.id();
 
 	} else {
-		super_block->tree_root = propagation.update;
+		*root = propagation.update;
 	}
 
-	// Free all of the copied blocks (in the future we could store these in a snapshot).
+	root_raw.set_dirty();
+
+	// The copied blocks, and the value this replaced, are freed unless a
+	// snapshot still holds them.
 	to_free.insert(old_root);
-	free_pages(ba, to_free);
-	
-	super_block_raw.set_dirty();
+	// Readers must be able to find the key as soon as it's published.
+	if (propagation.did_insert) {
+		key_filter.add(ba, key);
+	}
+	auto dropped = propagation.did_replace && holds_block(key) ? propagation.replaced : 0;
+	finger.generation = commit_root(ba, to_free, old_root, *root, {&dropped, 1});
 
 	if (propagation.did_replace) {
 		return propagation.replaced;
@@ -136,65 +432,293 @@ std::optional<BlockID> insert(BufferAllocator& ba, KeyId key, BlockID value) {
 	return {};
 }
 
+bool delete_range(BufferAllocator& ba, KeyId low, KeyId high) {
+	std::scoped_lock lock(writer_lock);
+	make_drop_room(ba);
+	auto [root, root_raw] = get_tree_root(ba);
+
+	auto old_root = *root;
+	// While the names of deleted directories' entries can still be listed.
+	invalidate_objects(ba, key_object(low), key_object(high - 1));
+	ScopedFreedBlocks scope;
+	auto& to_free = *scope;
+	thread_local FileTree::RangeDeletion deletion;
+	deletion.detached.clear();
+	deletion.removed.clear();
+	*root = FileTree::delete_range(ba, to_free, old_root, low, high, deletion);
+	if (*root == old_root) return false;
+	root_raw.set_dirty();
+
+	// Detached subtrees are released over the following commits.
+	bool queued = queue_release(ba, deletion.detached);
+
+	thread_local std::vector<BlockID> dropped;
+	dropped.clear();
+	for (auto& record : deletion.removed) {
+		if (holds_block(record.key)) dropped.push_back(record.value);
+	}
+	commit_root(ba, to_free, old_root, *root, dropped);
+
+	if (!queued) {
+		for (auto detached : deletion.detached) {
+			release_tree(ba, detached);
+		}
+	}
+
+	// Keys of detached subtrees stay in the filter, which costs at most a
+	// descent for each until the next mount. In a buffered tree a removed
+	// record may already have been shadowed, so it keeps its keys too.
+	if (!buffered(ba)) {
+		for (auto& record : deletion.removed) {
+			key_filter.remove(ba, record.key);
+		}
+	}
+	return true;
+}
+
+/*
+ * Snapshots
+ *
+ * Names starting with CHECKPOINT_PREFIX are kept for checkpoints. The
+ * snapshot table isn't logged, so changes to it are checkpointed straight
+ * away while the log is running.
+ */
+
+const char CHECKPOINT_PREFIX[] = "@ckpt-";
+
+static bool is_checkpoint(const char* name) {
+	return strncmp(name, CHECKPOINT_PREFIX, strlen(CHECKPOINT_PREFIX)) == 0;
+}
+
+bool create_snapshot(BufferAllocator& ba, const char* name) {
+	std::scoped_lock lock(writer_lock);
+	auto [root, _] = get_tree_root(ba);
+	if (is_checkpoint(name) || !add_snapshot(ba, name, *root, false)) {
+		return false;
+	}
+	if (intent_log.is_open()) checkpoint(ba);
+	return true;
+}
+
+bool create_clone(BufferAllocator& ba, const char* snapshot, const char* clone) {
+	std::scoped_lock lock(writer_lock);
+	auto index = find_snapshot(ba, snapshot);
+	if (!index.has_value() || is_checkpoint(clone)) {
+		return false;
+	}
+
+	auto [table, _] = get_snapshot_table(ba);
+	auto root = table->entries[index.value()].root;
+	if (!add_snapshot(ba, clone, root, true)) {
+		return false;
+	}
+	if (intent_log.is_open()) checkpoint(ba);
+	return true;
+}
+
+bool delete_snapshot(BufferAllocator& ba, const char* name) {
+	std::scoped_lock lock(writer_lock);
+	auto index = find_snapshot(ba, name);
+	if (!index.has_value() || index == mounted_clone || is_checkpoint(name)) {
+		return false;
+	}
+
+	// Only queues the tree, its blocks are released alongside later writes.
+	// A checkpoint still holding the snapshot could be put back, so none
+	// are released before the next.
+	drop_snapshot(ba, index.value());
+	if (intent_log.is_open()) checkpoint(ba);
+	reclaim_dropped_snapshots(ba, DROP_STEPS_PER_COMMIT);
+	return true;
+}
+
+void list_snapshots(BufferAllocator& ba) {
+	auto [table, _] = get_snapshot_table(ba);
+	for (auto& entry : table->entries) {
+		if (!entry.in_use || is_checkpoint(entry.name)) continue;
+		printf("%s\t%ld, %.*s\n", entry.writable ? "C" : "S",
+				entry.root, (int)MAX_SNAPSHOT_NAME, entry.name);
+	}
+}
+
 /*
  * Directory stuff
  */
 
-void Directory::insert_file(char* name, FSType type, BlockID block) {
-	// TODO: this is totally unsafe
-	auto dir_ent = (DirEntry*)&data[size];
-	dir_ent->data = block;
-	dir_ent->name_len = strlen(name);
-	dir_ent->type = type;
-	memcpy(dir_ent->name, name, dir_ent->name_len);
-	size += sizeof(DirEntry) + dir_ent->name_len;
+static bool is_directory(FSType type) {
+	return type == IndexedDir;
 }
 
-std::optional<KeyId> Directory::lookup_file(char* name) {
-	auto name_len = strlen(name);
-	DirEntry* dir_ent = nullptr;
-	for (size_t i = 0; i < this->size; i+= sizeof(DirEntry) + dir_ent->name_len) {
-		dir_ent = (DirEntry*)&data[size];
-		if (strncmp(name, dir_ent->name, name_len) == 0) {
-			auto out = dir_ent->data;
-			return out;
-		}
+// Whether `block`, the record of `key` in the tree at `root`, can be modified
+// in place: nothing else references it, so it was allocated since the last
+// checkpoint, and the log redoes whatever a crash tears. Without the log it
+// may be the only durable copy, so it's always copied.
+static bool can_overwrite(BufferAllocator& ba, BlockID root, KeyId key, BlockID block) {
+	return intent_log.is_open() && owns_value(ba, root, key, block);
+}
+
+// The page of `key`'s record, `block`, ready to be modified: the block itself
+// if nothing else references it, otherwise a copy of its first `used` bytes
+// that replaces it in the tree.
+static BufferPointer writable_block(BufferAllocator& ba, KeyId key, BlockID block, size_t used) {
+	if (can_overwrite(ba, *get_tree_root(ba).first, key, block)) {
+		return ba.load(block);
 	}
-	return {};
+
+	auto copy_raw = allocate_page(ba);
+	memcpy(copy_raw.data(), ba.load(block).data(), used);
+	copy_raw.set_dirty();
+	insert(ba, key, copy_raw.id());
+	return copy_raw;
 }
 
-void Directory::list_contents() {
-	DirEntry* dir_ent = nullptr;
-	for (size_t i = 0; i < this->size; i+= sizeof(DirEntry) + dir_ent->name_len) {
-		dir_ent = (DirEntry*)&data[i];
-		switch (dir_ent->type) {
-			case Unknown:
-				printf("U\t");
-				break;
-			case SmallDir:
-				printf("D\t");
-				break;
-			case SmallFile:
-				printf("F\t");
-				break;
-		}
-		printf("%ld, %.*s\n", 
-				dir_ent->data, (int)dir_ent->name_len, dir_ent->name);
+// The bucket of directory `dir` that takes `hash`, as its key and block.
+static std::optional<std::pair<KeyId, BlockID>> find_bucket(BufferAllocator& ba, KeyId dir, NameHash hash) {
+	std::optional<std::pair<KeyId, BlockID>> found;
+	scan_keys_until(ba, bucket_key(dir, hash), bucket_key(dir, MAX_KEY_OFFSET) + 1,
+			[&](KeyId key, BlockID block) {
+		found = {key, block};
+		return false;
+	});
+	return found;
+}
+
+// find_entry without the cache.
+static std::optional<std::pair<KeyId, FSType>> search_entry(BufferAllocator& ba, KeyId dir, const char* name, size_t len) {
+	auto [directory, _] = get_block_by_key<Directory>(ba, dir);
+	if (!directory) {
+		return {};
+	}
+
+	if (directory->header.type != IndexedDir) {
+		return {};
+	}
+
+	auto hash = name_hash(name, len);
+	auto bucket_block = find_bucket(ba, dir, hash);
+	if (!bucket_block) {
+		return {};
 	}
+	auto bucket_raw = ba.load(bucket_block->second);
+	auto entry = ((DirBucket*)bucket_raw.data())->find(hash, name, len);
+	if (!entry) {
+		return {};
+	}
+	return std::pair {KeyId(entry->object), FSType(entry->type)};
 }
 
-void list_directory(BufferAllocator& ba, KeyId key) {
-	auto [dir, dir_raw] = get_block_by_key<Directory>(ba, key);
-	if (!dir) {
+std::optional<std::pair<KeyId, FSType>> find_entry(BufferAllocator& ba, KeyId dir, const char* name) {
+	// Larger numbers would alias other directories' keys, and aren't objects.
+	if (dir > MAX_OBJECT_ID) {
+		return {};
+	}
+	auto len = strlen(name);
+
+	Dentry dentry;
+	uint64_t generation;
+	if (!dentry_cache.find(ba, dir, name, len, dentry, generation)) {
+		EpochGuard guard;
+		std::shared_lock object(object_lock(dir));
+		auto found = search_entry(ba, dir, name, len);
+		if (found) dentry = { found->first, found->second };
+		dentry_cache.insert(ba, dir, name, len, dentry, generation);
+	}
+
+	if (dentry.object == 0) {
+		return {};
+	}
+	return std::pair {dentry.object, dentry.type};
+}
+
+void list_entries(BufferAllocator& ba, KeyId dir, uint64_t cookie, const EntryVisitor& visit) {
+	EpochGuard guard;
+	std::shared_lock object(object_lock(dir));
+	auto [directory, _] = get_block_by_key<Directory>(ba, dir);
+	if (!directory) {
 		return;
 	}
 
-	dir->list_contents();
+	if (directory->header.type != IndexedDir) {
+		return;
+	}
+
+	auto low = cookie == 0 ? bucket_key(dir, 0) : bucket_key(dir, cookie_hash(cookie));
+	scan_keys_until(ba, low, bucket_key(dir, MAX_KEY_OFFSET) + 1, [&](KeyId, BlockID block) {
+		auto bucket_raw = ba.load(block);
+		return ((DirBucket*)bucket_raw.data())->for_each([&](BucketEntry* entry, uint64_t entry_cookie) {
+			if (entry_cookie <= cookie) return true;
+			return visit(entry->name, entry->name_len, entry->object, entry->type, entry_cookie);
+		});
+	});
+}
+
+/*
+ * Adds `name` to directory `dir`. Fails if it's there already, if the name
+ * is too long, or if a bucket's worth of names collide with its hash.
+ * Called with the writer lock and `dir`'s object lock held.
+ */
+static bool add_entry(BufferAllocator& ba, KeyId dir, const char* name, KeyId object, FSType type) {
+	auto [directory, _] = get_block_by_key<Directory>(ba, dir);
+	if (!directory || !is_directory(directory->header.type)) {
+		return false;
+	}
+	auto len = strlen(name);
+	if (len == 0 || len > MAX_NAME_LEN || search_entry(ba, dir, name, len)) {
+		return false;
+	}
+
+	auto hash = name_hash(name, len);
+	while (true) {
+		auto found = find_bucket(ba, dir, hash);
+		if (!found) {
+			// The first entry, in a bucket taking every hash.
+			auto bucket_raw = allocate_page(ba);
+			((DirBucket*)bucket_raw.data())->insert(hash, name, len, object, type);
+			bucket_raw.set_dirty();
+			insert(ba, bucket_key(dir, MAX_KEY_OFFSET), bucket_raw.id());
+			break;
+		}
+
+		auto [key, block] = *found;
+		auto bucket_raw = writable_block(ba, key, block, PAGE_SIZE);
+		auto bucket = (DirBucket*)bucket_raw.data();
+		bucket_raw.set_dirty();
+		if (bucket->insert(hash, name, len, object, type)) {
+			break;
+		}
+
+		// Split off the lower half of the bucket and try again.
+		auto low_raw = allocate_page(ba);
+		auto point = bucket->split(*(DirBucket*)low_raw.data());
+		if (!point) {
+			free_page(ba, low_raw.id());
+			return false;
+		}
+		low_raw.set_dirty();
+		insert(ba, bucket_key(dir, *point), low_raw.id());
+	}
+
+	// Directories count their entries.
+	auto [current, current_raw] = get_block_by_key<Directory>(ba, dir);
+	auto counted_raw = writable_block(ba, inode_key(dir), current_raw.id(), sizeof(Directory));
+	auto counted = (Directory*)counted_raw.data();
+	counted->header.block = counted_raw.id();
+	counted->size++;
+	counted_raw.set_dirty();
+	dentry_cache.invalidate(ba, dir, name, len);
+	return true;
+}
+
+void list_directory(BufferAllocator& ba, KeyId key) {
+	list_entries(ba, key, 0, [](const char* name, size_t len, KeyId object, FSType type, uint64_t) {
+		printf("%s\t%ld, %.*s\n", is_directory(type) ? "D" : type == Unknown ? "U" : "F",
+				object, (int)len, name);
+		return true;
+	});
 }
 
 void inspect_block(BufferAllocator& ba, KeyId key) {
 	auto [parent, parent_raw] = get_block_by_key<FSHeader>(ba, key);
-	auto parent_block = lookup(ba, key);
 	if (!parent) {
 		printf("block does not exist\n");
 		return;
@@ -207,16 +731,104 @@ void inspect_block(BufferAllocator& ba, KeyId key) {
 			case Unknown:
 				printf("U\n");
 				break;
-			case SmallDir:
+			case IndexedDir:
 				printf("D\n");
 				break;
 			case SmallFile:
+			case LargeFile:
 				printf("F\n");
 				break;
 	}
 }
 
+/*
+ * Attributes
+ */
+
+// While set, what now() returns, so a change replayed from the log gets the
+// times it was first made at. See FixedTime.
+thread_local uint64_t fixed_time = 0;
+
+static uint64_t now() {
+	if (fixed_time != 0) return fixed_time;
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Fixes the time for as long as it's in scope, unless it already is.
+class FixedTime {
+	private:
+		uint64_t m_saved;
+
+	public:
+		explicit FixedTime(uint64_t time) : m_saved(fixed_time) {
+			if (fixed_time == 0) fixed_time = time;
+		}
+		~FixedTime() { fixed_time = m_saved; }
+};
+
+// Logs a change that has been made, under the writer lock, `fill` writing
+// its payload. If the log is full, a checkpoint covers the change instead.
+static void log_change(BufferAllocator& ba, LogRecord record, const std::function<void(char*)>& fill) {
+	if (!intent_log.is_open()) return;
+	record.time = now();
+	if (!intent_log.append(record, fill) && !checkpoint(ba)) {
+		intent_log.mark_failed();
+	}
+}
+
+static void log_change(BufferAllocator& ba, LogRecord record, const void* payload) {
+	log_change(ba, record, [&](char* out) { memcpy(out, payload, record.length); });
+}
+
+// Records every attribute of a new object. Called with the writer lock held.
+static void set_attributes(BufferAllocator& ba, KeyId object, const Attributes& attributes) {
+	insert(ba, attr_key(object, InodeAttr::Mode), uint64_t(attributes.nlink) << 32 | attributes.mode);
+	insert(ba, attr_key(object, InodeAttr::Size), attributes.size);
+	insert(ba, attr_key(object, InodeAttr::MTime), attributes.mtime);
+}
+
+// A new object's attributes, as created now.
+static Attributes new_attributes(FSType type, uint32_t mode) {
+	return Attributes {
+		.mode = (is_directory(type) ? S_IFDIR : S_IFREG) | (mode & 07777),
+		.nlink = is_directory(type) ? 2u : 1u,
+		.mtime = now(),
+	};
+}
+
+std::optional<Attributes> get_attributes(BufferAllocator& ba, KeyId object) {
+	if (object > MAX_OBJECT_ID) {
+		return {};
+	}
+
+	EpochGuard guard;
+	Attributes attributes;
+	bool recorded = false;
+	scan_keys(ba, attr_key(object, InodeAttr::Mode), attr_key(object, InodeAttr::MTime) + 1,
+			[&](KeyId key, uint64_t value) {
+		switch (InodeAttr(key_offset(key))) {
+			case InodeAttr::Mode:
+				attributes.mode = value & UINT32_MAX;
+				attributes.nlink = value >> 32;
+				recorded = true;
+				break;
+			case InodeAttr::Size:
+				attributes.size = value;
+				break;
+			case InodeAttr::MTime:
+				attributes.mtime = value;
+				break;
+		}
+	});
+	if (!recorded) {
+		return {};
+	}
+	return attributes;
+}
+
 void create_root_directory(BufferAllocator& ba) {
+	std::scoped_lock lock(writer_lock);
 	auto [super_block, super_block_raw] = get_super_block2(ba);
 
 	KeyId new_key = 1; // root is hardcoded to key 1
@@ -224,142 +836,645 @@ void create_root_directory(BufferAllocator& ba) {
 
 	auto new_dir_raw = allocate_page(ba);
 	auto new_dir = (Directory*)new_dir_raw.data();
-	*new_dir = Directory{
-		.header {
-			.key = new_key,
-			.block = new_dir_raw.id(),
-			.type = SmallDir,
-		},
+	new_dir->header = FSHeader {
+		.key = new_key,
+		.block = new_dir_raw.id(),
+		.type = IndexedDir,
 	};
 	
-	insert(ba, new_key, new_dir_raw.id());
+	insert(ba, inode_key(new_key), new_dir_raw.id());
+	set_attributes(ba, new_key, new_attributes(IndexedDir, 0755));
 
 	super_block_raw.set_dirty();
 	new_dir_raw.set_dirty();
 }
 
-std::optional<KeyId> add_directory(BufferAllocator& ba, KeyId parent_key, char* name) {
+// Creates an empty object of `type` named `name` in `parent_key`.
+static std::optional<KeyId> add_object(BufferAllocator& ba, KeyId parent_key, const char* name,
+		FSType type, uint32_t mode) {
+	std::scoped_lock lock(writer_lock);
+	FixedTime time(now());
 	auto [super_block, super_block_raw] = get_super_block2(ba);
 
-	auto [parent_old, parent_old_raw] = get_block_by_key<char*>(ba, parent_key);
-	if (!parent_old) {
+	auto [parent, _] = get_block_by_key<FSHeader>(ba, parent_key);
+	auto len = strlen(name);
+	if (!parent || !is_directory(parent->type) || len == 0 || len > MAX_NAME_LEN) {
+		return {};
+	}
+	if (find_entry(ba, parent_key, name)) {
 		return {};
 	}
-
-	auto parent_raw = allocate_page(ba);
-	memcpy(parent_raw.data(), parent_old_raw.data(), PAGE_SIZE);
-	auto parent = (Directory*)parent_raw.data();
-	parent->header.block = parent_raw.id();
-	// TODO: check parent type
 
 	auto new_key = super_block->next_key;
-	super_block->next_key++;
+	if (new_key > MAX_OBJECT_ID) {
+		return {};
+	}
 
-	auto new_dir_raw = allocate_page(ba);
-	auto new_dir = (Directory*)new_dir_raw.data();
-	*new_dir = Directory{
-		.header {
-			.key = new_key,
-			.block = new_dir_raw.id(),
-			.type = SmallDir,
-		},
+	// Both kinds start as just a header, their sizes 0.
+	auto new_raw = allocate_page(ba);
+	*(FSHeader*)new_raw.data() = FSHeader {
+		.key = new_key,
+		.block = new_raw.id(),
+		.type = type,
 	};
+	new_raw.set_dirty();
+	insert(ba, inode_key(new_key), new_raw.id());
+	auto attributes = new_attributes(type, mode);
+	set_attributes(ba, new_key, attributes);
+
+	std::unique_lock parent_lock(object_lock(parent_key));
+	bool added = add_entry(ba, parent_key, name, new_key, type);
+	parent_lock.unlock();
+	if (!added) {
+		delete_range(ba, object_start(new_key), object_end(new_key));
+		return {};
+	}
+	insert(ba, attr_key(parent_key, InodeAttr::MTime), attributes.mtime);
 
-	parent->insert_file(name, SmallDir, new_key);
-	insert(ba, parent_key, parent_raw.id());
-	insert(ba, new_key, new_dir_raw.id());
-	new_dir_raw.set_dirty();
-	parent_raw.set_dirty();
-
+	super_block->next_key++;
 	super_block_raw.set_dirty();
+	log_change(ba, LogRecord {
+		.length = uint32_t(len),
+		.op = is_directory(type) ? LogOp::AddDirectory : LogOp::AddFile,
+		.object = new_key,
+		.parent = parent_key,
+		.arg = mode,
+	}, name);
 	return new_key;
 }
 
-std::optional<KeyId> add_file(BufferAllocator& ba, KeyId parent_key, char* name) {
-	auto [super_block, super_block_raw] = get_super_block2(ba);
+std::optional<KeyId> add_directory(BufferAllocator& ba, KeyId parent_key, char* name, uint32_t mode) {
+	return add_object(ba, parent_key, name, IndexedDir, mode);
+}
 
-	auto [parent_old, parent_old_raw] = get_block_by_key<char*>(ba, parent_key);
-	if (!parent_old) {
-		return {};
+std::optional<KeyId> add_file(BufferAllocator& ba, KeyId parent_key, char* name, uint32_t mode) {
+	return add_object(ba, parent_key, name, SmallFile, mode);
+}
+
+// Holes are mapped to this.
+static const char zero_block[PAGE_SIZE] = {};
+
+size_t map_file(BufferAllocator& ba, KeyId key, size_t len, size_t pos, std::vector<FileSpan>& spans) {
+	spans.clear();
+	auto [file, file_raw] = get_block_by_key<File>(ba, key);
+	if (!file || pos >= file->size) {
+		return 0;
+	}
+	auto type = file->header.type;
+	if (type != SmallFile && type != LargeFile) {
+		return 0;
+	}
+	len = std::min(len, file->size - pos);
+
+	if (type == SmallFile) {
+		spans.push_back(FileSpan {
+			.frame = file_raw,
+			.data = file->data + pos,
+			.len = len,
+		});
+		return len;
 	}
 
-	auto parent_raw = allocate_page(ba);
-	memcpy(parent_raw.data(), parent_old_raw.data(), PAGE_SIZE);
-	auto parent = (Directory*)parent_raw.data();
-	parent->header.block = parent_raw.id();
-	// TODO: check parent type
+	// The part of block `index` in range, from `block` or zeros if it's 0.
+	auto add = [&](size_t index, BlockID block) {
+		auto start = std::max(pos, index * PAGE_SIZE);
+		auto end = std::min(pos + len, (index + 1) * PAGE_SIZE);
+		auto offset = start - index * PAGE_SIZE;
+		if (block == 0) {
+			spans.push_back(FileSpan { .data = zero_block + offset, .len = end - start });
+			return;
+		}
 
-	auto new_key = super_block->next_key;
-	super_block->next_key++;
+		auto frame = ba.find_loaded(block);
+		if (frame) {
+			auto data = frame.data() + offset;
+			spans.push_back(FileSpan { .frame = std::move(frame), .data = data, .len = end - start });
+			return;
+		}
 
-	auto new_file_raw = allocate_page(ba);
-	auto new_file = (File*)new_file_raw.data();
-	*new_file = File{
-		.header {
-			.key = new_key,
-			.block = new_file_raw.id(),
-			.type = SmallFile,
-		},
+		// Blocks written as one run read as one.
+		if (!spans.empty() && !spans.back().data
+				&& spans.back().image_offset + spans.back().len == block + offset) {
+			spans.back().len += end - start;
+			return;
+		}
+		spans.push_back(FileSpan { .image_offset = block + offset, .len = end - start });
 	};
 
-	parent->insert_file(name, SmallFile, new_key);
-	insert(ba, parent_key, parent_raw.id());
-	insert(ba, new_key, new_file_raw.id());
-	new_file_raw.set_dirty();
-	parent_raw.set_dirty();
+	auto first = pos / PAGE_SIZE;
+	auto last = (pos + len - 1) / PAGE_SIZE;
+	auto next = first;
+	scan_keys(ba, data_key(key, first), data_key(key, last) + 1, [&](KeyId data, BlockID block) {
+		auto index = key_offset(data);
+		for (; next < index; next++) add(next, 0);
+		add(index, block);
+		next = index + 1;
+	});
+	for (; next <= last; next++) add(next, 0);
+	return len;
+}
 
-	super_block_raw.set_dirty();
-	return new_key;
+size_t read_file(BufferAllocator& ba, KeyId key, char* out, size_t len, size_t pos) {
+	EpochGuard guard;
+	std::shared_lock object(object_lock(key));
+	thread_local std::vector<FileSpan> spans;
+	len = map_file(ba, key, len, pos, spans);
+
+	size_t done = 0;
+	for (auto& span : spans) {
+		if (span.data) {
+			memcpy(out + done, span.data, span.len);
+		} else {
+			// Anything past the end of the image reads as zeros.
+			auto got = std::max<ssize_t>(pread(ba.fd(), out + done, span.len, span.image_offset), 0);
+			memset(out + done + got, 0, span.len - got);
+		}
+		done += span.len;
+	}
+	spans.clear();
+	return len;
 }
 
 void read_file(BufferAllocator& ba, KeyId key) {
+	EpochGuard guard;
 	auto [file, _] = get_block_by_key<File>(ba, key);
 	if (!file) {
 		return;
 	}
-	file->read();
+
+	std::vector<char> contents(file->size);
+	auto size = read_file(ba, key, contents.data(), contents.size(), 0);
+	printf("%.*s\n", (int)size, contents.data());
 }
 
-void write_file(BufferAllocator& ba, KeyId key,
-		char* data, size_t len, size_t pos) {
+// Copies the next `len` bytes of `src` to `dst`, returning whether they were.
+static bool copy_buf(fuse_buf dst, fuse_bufvec& src, size_t len) {
+	dst.size = len;
+	fuse_bufvec dstv = FUSE_BUFVEC_INIT(len);
+	dstv.buf[0] = dst;
+	return fuse_buf_copy(&dstv, &src, fuse_buf_copy_flags(0)) == (ssize_t)len;
+}
 
-	auto [file_old, _] = get_block_by_key<File>(ba, key);
-	if (!file_old) {
-		return;
+static fuse_buf memory_buf(char* mem) {
+	fuse_buf buf {};
+	buf.mem = mem;
+	return buf;
+}
+
+/*
+ * Writes `len` bytes of `src` to the blocks of `object` they cover, under
+ * its object lock. A block can_overwrite allows is overwritten in place,
+ * anything else is copied, and the copies of one write are allocated as a
+ * single run where there's room, so files written sequentially are laid out
+ * sequentially. Only copied or new blocks touch the tree.
+ *
+ * `src` is read once, in order, so it can be a pipe spliced from the FUSE
+ * device. Whole blocks written in place or into the run that aren't loaded
+ * go straight to the image, a stretch at a time, the rest through a frame.
+ * Returns how many bytes were copied, short only if `src` or the image fails.
+ */
+static size_t write_blocks(BufferAllocator& ba, KeyId object, fuse_bufvec& src, size_t len, size_t pos) {
+	auto first = pos / PAGE_SIZE;
+	auto last = (pos + len - 1) / PAGE_SIZE;
+	auto count = last - first + 1;
+	auto root = *get_tree_root(ba).first;
+
+	thread_local std::vector<BlockID> existing;
+	thread_local std::vector<bool> in_place;
+	existing.assign(count, 0);
+	in_place.assign(count, false);
+	scan_keys(ba, data_key(object, first), data_key(object, last) + 1, [&](KeyId key, BlockID block) {
+		existing[key_offset(key) - first] = block;
+	});
+
+	size_t copies = 0;
+	for (size_t i = 0; i < count; i++) {
+		auto block = existing[i];
+		if (block != 0 && can_overwrite(ba, root, data_key(object, first + i), block)) {
+			in_place[i] = true;
+		} else {
+			copies++;
+		}
 	}
+	auto run = copies > 1 ? allocate_run(ba, copies) : 0;
+	auto run_end = run != 0 ? run + copies * PAGE_SIZE : 0;
+
+	size_t done = 0;
+	bool ok = true;
+
+	// Whole blocks following each other in the image, and the keys of the
+	// new ones, which are only inserted once they're written.
+	BlockID stretch = 0;
+	size_t stretch_len = 0;
+	thread_local std::vector<std::pair<KeyId, BlockID>> stretch_keys;
+	stretch_keys.clear();
+	auto write_stretch = [&]() {
+		if (stretch_len == 0) return;
+		bool direct = ba.write_unloaded(stretch, stretch_len, [&](int fd) {
+			fuse_buf image {};
+			image.flags = fuse_buf_flags(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY);
+			image.fd = fd;
+			image.pos = stretch;
+			ok = copy_buf(image, src, stretch_len);
+		});
+		for (size_t offset = 0; !direct && ok && offset < stretch_len; offset += PAGE_SIZE) {
+			auto page_raw = ba.load(stretch + offset);
+			ok = copy_buf(memory_buf(page_raw.data()), src, PAGE_SIZE);
+			page_raw.set_dirty();
+		}
+		// New blocks a failed copy cut short hold whatever was there before.
+		for (auto [key, block] : stretch_keys) {
+			if (ok) {
+				insert(ba, key, block);
+			} else {
+				free_page(ba, block);
+			}
+		}
+		if (ok) done += stretch_len;
+		stretch_keys.clear();
+		stretch_len = 0;
+	};
+
+	for (size_t i = 0; i < count && ok; i++) {
+		auto index = first + i;
+		auto start = std::max(pos, index * PAGE_SIZE);
+		auto end = std::min(pos + len, (index + 1) * PAGE_SIZE);
+		auto offset = start - index * PAGE_SIZE;
+
+		if (end - start == PAGE_SIZE && (in_place[i] || run != 0)) {
+			auto block = in_place[i] ? existing[i] : run;
+			if (!in_place[i]) {
+				run += PAGE_SIZE;
+				stretch_keys.emplace_back(data_key(object, index), block);
+			}
+			if (stretch_len > 0 && stretch + stretch_len != block) {
+				write_stretch();
+			}
+			if (stretch_len == 0) stretch = block;
+			stretch_len += PAGE_SIZE;
+			continue;
+		}
 
-	auto file_raw = allocate_page(ba);
-	memcpy(file_raw.data(), file_old, PAGE_SIZE);
+		write_stretch();
+		if (!ok) break;
+		BufferPointer page_raw;
+		if (in_place[i]) {
+			page_raw = ba.load(existing[i]);
+		} else {
+			page_raw = run != 0 ? ba.load(run) : allocate_page(ba);
+			if (run != 0) {
+				// Runs aren't zeroed, only whole blocks are written over them.
+				memset(page_raw.data(), 0, PAGE_SIZE);
+				run += PAGE_SIZE;
+			}
+			// New pages are zeroed, copies keep whatever the write doesn't cover.
+			if (existing[i] != 0) {
+				auto old_raw = ba.load(existing[i]);
+				memcpy(page_raw.data(), old_raw.data(), offset);
+				memcpy(page_raw.data() + offset + (end - start), old_raw.data() + offset + (end - start),
+						PAGE_SIZE - offset - (end - start));
+			}
+		}
+		ok = copy_buf(memory_buf(page_raw.data() + offset), src, end - start);
+		page_raw.set_dirty();
+		if (ok) done += end - start;
+
+		if (!in_place[i]) {
+			if (ok) {
+				insert(ba, data_key(object, index), page_raw.id());
+			} else {
+				free_page(ba, page_raw.id());
+			}
+		}
+	}
+	write_stretch();
+	// A write cut short leaves the end of the run unused.
+	for (; run != 0 && run < run_end; run += PAGE_SIZE) {
+		free_page(ba, run);
+	}
+	return done;
+}
+
+// Brings a file's attributes up to date after a write.
+static void record_write(BufferAllocator& ba, KeyId key, size_t old_size, size_t new_size) {
+	if (new_size != old_size) {
+		insert(ba, attr_key(key, InodeAttr::Size), new_size);
+	}
+	insert(ba, attr_key(key, InodeAttr::MTime), now());
+}
+
+size_t write_file(BufferAllocator& ba, KeyId key,
+		const char* data, size_t len, size_t pos) {
+	fuse_bufvec src = FUSE_BUFVEC_INIT(len);
+	src.buf[0].mem = (void*)data;
+	return write_file(ba, key, src, pos);
+}
+
+// write_file, without logging. Called with the writer lock held.
+static size_t write_contents(BufferAllocator& ba, KeyId key, fuse_bufvec& src, size_t pos) {
+	std::unique_lock object(object_lock(key));
+	auto [file_old, file_old_raw] = get_block_by_key<File>(ba, key);
+	if (!file_old || pos >= MAX_FILE_SIZE) {
+		return 0;
+	}
+	auto type = file_old->header.type;
+	auto size = file_old->size;
+	if (type != SmallFile && type != LargeFile) {
+		return 0;
+	}
+	auto len = std::min(fuse_buf_size(&src), MAX_FILE_SIZE - pos);
+	if (len == 0) {
+		return 0;
+	}
+
+	auto new_size = std::max(size, pos + len);
+	auto [super_block, _] = get_super_block2(ba);
+	bool stays_inline = type == SmallFile && new_size <= super_block->inline_limit;
+	auto root = *get_tree_root(ba).first;
+	bool owned = can_overwrite(ba, root, inode_key(key), file_old_raw.id());
+
+	if (!stays_inline) {
+		// Inline contents move out to blocks first.
+		if (type == SmallFile && size > 0) {
+			fuse_bufvec contents = FUSE_BUFVEC_INIT(size);
+			contents.buf[0].mem = file_old->data;
+			write_blocks(ba, key, contents, size, 0);
+		}
+		len = write_blocks(ba, key, src, len, pos);
+		if (len == 0) {
+			return 0;
+		}
+		new_size = std::max(size, pos + len);
+		if (type == LargeFile && new_size == size) {
+			record_write(ba, key, size, new_size);
+			return len;
+		}
+	}
+
+	// The inode only needs copying if it's shared.
+	auto file_raw = file_old_raw;
+	if (!owned) {
+		file_raw = allocate_page(ba);
+		// A large file's inode is only its header and size.
+		memcpy(file_raw.data(), file_old, stays_inline
+				? offsetof(File, data) + size
+				: offsetof(File, data));
+		((File*)file_raw.data())->header.block = file_raw.id();
+	}
 	auto file = (File*)file_raw.data();
 
-	file->write(data, len, pos);
+	if (stays_inline) {
+		// Anything between the old end and `pos` reads as zeros.
+		if (pos > size) {
+			memset(file->data + size, 0, pos - size);
+		}
+		if (!copy_buf(memory_buf(file->data + pos), src, len)) {
+			if (!owned) free_page(ba, file_raw.id());
+			return 0;
+		}
+	} else {
+		file->header.type = LargeFile;
+	}
+	file->size = new_size;
 	file_raw.set_dirty();
 
-	insert(ba, key, file_raw.id());
+	if (!owned) {
+		insert(ba, inode_key(key), file_raw.id());
+	}
+	record_write(ba, key, size, new_size);
+	return len;
 }
 
-void File::write(char* data, size_t len, size_t pos) {
-	// TODO: this is unsafe
-	
-	//make room for data
-	for (size_t i = MAX_FILE_DATA-1; i > pos; i--) {
-		this->data[i] = this->data[i-pos];
+size_t write_file(BufferAllocator& ba, KeyId key, fuse_bufvec& src, size_t pos) {
+	std::scoped_lock lock(writer_lock);
+	FixedTime time(now());
+	auto len = write_contents(ba, key, src, pos);
+
+	// `src` may be a pipe, read once by the write, so the record's data is
+	// read back from the file, straight into the log.
+	if (len > 0) {
+		log_change(ba, LogRecord {
+			.length = uint32_t(len),
+			.op = LogOp::Write,
+			.object = key,
+			.arg = pos,
+		}, [&](char* payload) { read_file(ba, key, payload, len, pos); });
 	}
+	return len;
+}
 
-	for (size_t i = pos; i < len && i < MAX_FILE_DATA; i++) {
-		this->data[i] = data[i-pos];
+/*
+ * Checkpoints
+ *
+ * A checkpoint makes the mounted tree durable as it stands, so what was
+ * logged before it can go. Changes aren't held back meanwhile: it takes an
+ * internal snapshot of the tree, so later changes copy its blocks rather
+ * than overwrite them, and none of them is freed while the snapshot lasts.
+ * The image can then always be put back to the last checkpoint, and each
+ * deletes the one before once its own header is durable.
+ */
+
+// Deletes every checkpoint's snapshot but the one at `keep`.
+static void drop_checkpoints(BufferAllocator& ba, std::optional<size_t> keep) {
+	auto [table, _] = get_snapshot_table(ba);
+
+	for (size_t i = 0; i < MAX_SNAPSHOTS; i++) {
+		auto& entry = table->entries[i];
+		if (entry.in_use && is_checkpoint(entry.name) && i != keep) {
+			drop_snapshot(ba, i);
+		}
 	}
-	this->size+= len;
-};
+}
 
-void File::append(char* data, size_t len) {
-	this->write(data, len, this->size);
-};
+bool checkpoint(BufferAllocator& ba) {
+	std::scoped_lock lock(writer_lock);
+	if (!intent_log.is_open()) return false;
+	auto [super_block, _] = get_super_block2(ba);
+	auto log_start = super_block->log_start;
+
+	intent_log.begin_checkpoint();
+	auto header = log_header;
+	header.sequence++;
+	header.next_lsn = intent_log.next_lsn();
+	header.active = true;
+	header.clone = mounted_clone.has_value() ? mounted_clone.value() + 1 : 0;
+
+	char name[MAX_SNAPSHOT_NAME];
+	snprintf(name, sizeof(name), "%s%" PRIu64, CHECKPOINT_PREFIX, header.sequence);
+	auto index = add_snapshot(ba, name, *get_tree_root(ba).first, false);
+	if (!index.has_value()) {
+		intent_log.abort_checkpoint();
+		return false;
+	}
+	header.super_block = *super_block;
+
+	// The header may only be written once what it points at is durable.
+	auto [table, table_raw] = get_snapshot_table(ba);
+	ba.flush_all();
+	bool written = write_log_table(ba.fd(), log_start, header, table)
+		&& fdatasync(ba.fd()) == 0
+		&& write_log_header(ba.fd(), log_start, header);
+	if (!written) {
+		drop_snapshot(ba, index.value());
+		intent_log.abort_checkpoint();
+		return false;
+	}
 
-void File::read() {
-	// This is unsafe
-	printf("%.*s\n", (int)this->size, this->data);
-};
+	log_header = header;
+	intent_log.end_checkpoint(header);
+	drop_checkpoints(ba, index);
+	reclaim_dropped_snapshots(ba, DROP_STEPS_PER_COMMIT);
+	return true;
+}
+
+bool start_intent_log(BufferAllocator& ba, std::chrono::milliseconds interval) {
+	{
+		std::scoped_lock lock(writer_lock);
+		if (!intent_log.is_open()) {
+			auto [super_block, _] = get_super_block2(ba);
+			LogHeader header;
+			if (!read_log_header(ba.fd(), super_block->log_start, header)) {
+				return false;
+			}
+
+			intent_log.open(ba.fd(), super_block->log_start, super_block->log_pages, header);
+			log_header = header;
+			// Marks the log active.
+			if (!checkpoint(ba)) {
+				intent_log.close();
+				return false;
+			}
+		}
+	}
+
+	// Checkpoints take the writer lock.
+	intent_log.start_checkpoints(interval, [&ba] { checkpoint(ba); });
+	return true;
+}
+
+// Leaves the image as the mounted tree stands, with the log inactive. The
+// checkpointer must have been stopped.
+static void stop_intent_log(BufferAllocator& ba) {
+	if (!intent_log.is_open()) return;
+
+	// Should the header not make it, recovery has everything synced.
+	intent_log.sync();
+	intent_log.close();
+	auto header = log_header;
+	header.active = false;
+	ba.flush_all();
+	if (fdatasync(ba.fd()) != 0 || !write_log_header(ba.fd(), get_super_block(ba)->log_start, header)) {
+		return;
+	}
+
+	// Nothing can be put back to them any more.
+	drop_checkpoints(ba, {});
+	ba.flush_all();
+	fdatasync(ba.fd());
+}
+
+bool sync_file_system(BufferAllocator& ba) {
+	if (intent_log.is_open()) {
+		return intent_log.sync();
+	}
+
+	// Without a log, only the whole image will do.
+	std::scoped_lock lock(writer_lock);
+	ba.flush_all();
+	return fdatasync(ba.fd()) == 0;
+}
+
+/*
+ * Recovery
+ */
+
+static bool replay(BufferAllocator& ba, const LogRecord& record, const char* payload) {
+	FixedTime time(record.time);
+	switch (record.op) {
+		case LogOp::Write:
+			invalidate_inode(record.object, record.arg, record.length);
+			return write_file(ba, record.object, payload, record.length, record.arg) == record.length;
+		case LogOp::AddDirectory:
+		case LogOp::AddFile: {
+			std::string name(payload, record.length);
+			auto type = record.op == LogOp::AddDirectory ? IndexedDir : SmallFile;
+			invalidate_entry(record.parent, payload, record.length);
+			invalidate_inode(record.parent, 0, 0);
+			// Objects are numbered in order, so one that isn't numbered
+			// as before isn't the same.
+			return add_object(ba, record.parent, name.c_str(), type, record.arg) == record.object;
+		}
+	}
+	return false;
+}
+
+/*
+ * Puts the image back to the checkpoint `header` describes and replays what
+ * was logged after it. Blocks written since may have been anywhere, so the
+ * share counts and free list are worked out again from the trees.
+ */
+static bool recover(BufferAllocator& ba, const LogHeader& header, BlockID mounted) {
+	auto [super_block, super_block_raw] = get_super_block2(ba);
+	auto [table, table_raw] = get_snapshot_table(ba);
+	auto log_start = super_block->log_start;
+	if (!read_log_table(ba.fd(), log_start, header, table)) {
+		return false;
+	}
+	// Before the mounted tree's blocks can be reused. Replaying then
+	// invalidates what each record changes.
+	if (mounted != 0) {
+		invalidate_changes(ba, mounted, header.clone != 0
+				? table->entries[header.clone - 1].root
+				: header.super_block.tree_root);
+	}
+	*super_block = header.super_block;
+	super_block_raw.set_dirty();
+
+	// Earlier checkpoints may have been released since. The one put back
+	// to stays until replaying has been checkpointed, so if that is cut
+	// short too this can start over.
+	char name[MAX_SNAPSHOT_NAME];
+	snprintf(name, sizeof(name), "%s%" PRIu64, CHECKPOINT_PREFIX, header.sequence);
+	for (auto& entry : table->entries) {
+		if (entry.in_use && is_checkpoint(entry.name) && strncmp(entry.name, name, MAX_SNAPSHOT_NAME) != 0) {
+			entry = SnapshotEntry {};
+			table->count--;
+		}
+	}
+	table_raw.set_dirty();
+
+	std::vector<bool> in_use;
+	recount_shares(ba, in_use);
+	auto reserve = [&](BlockID start, size_t pages) {
+		for (auto index = start / PAGE_SIZE; index < start / PAGE_SIZE + pages && index < in_use.size(); index++) {
+			in_use[index] = true;
+		}
+	};
+	reserve(0, 1);
+	reserve(super_block->share_table, super_block->share_table_pages);
+	reserve(super_block->snapshot_table, 1);
+	reserve(log_start, super_block->log_pages);
+	rebuild_free_list(ba, in_use);
+
+	if (header.clone != 0) {
+		mounted_clone = header.clone - 1;
+	} else {
+		mounted_clone.reset();
+	}
+	auto [root, _] = get_tree_root(ba);
+	rebuild_key_filter(ba, *root);
+	dentry_cache.reset(ba, super_block->free_list.total_pages);
+	pinned_root.publish(ba, *root, 0);
+
+	read_log(ba.fd(), log_start, super_block->log_pages, header,
+			[&](const LogRecord& record, const char* payload) {
+		return replay(ba, record, payload);
+	});
+
+	intent_log.open(ba.fd(), log_start, super_block->log_pages, header);
+	log_header = header;
+	return checkpoint(ba);
+}
 
 // Taken from the fuse low level example
 //
@@ -369,200 +1484,435 @@ void File::read() {
 
 BufferAllocator* global_ba;
 
+// Set with -o, see fuse_start.
+struct CowfsOptions {
+	// Lets the kernel cache writes and send them on in large batches.
+	int writeback { 0 };
+	// The writable clone to mount instead of the live tree.
+	char* clone { nullptr };
+};
+static CowfsOptions cowfs_options;
+
+// The most a single read or write request carries.
+const size_t MAX_IO_SIZE = 1 << 20;
+// How long the kernel may trust what it was told about names and
+// attributes. Everything changes through it, apart from what's invalidated.
+const double CACHE_TIMEOUT = 100.0;
+
+/*
+ * Tells the kernel to drop what it cached of things that changed other than
+ * as it asked. The kernel can be holding locks the request that made the
+ * change is waited on with, so notifications go out from their own thread.
+ */
+class KernelNotifier {
+	private:
+		struct Notice {
+			fuse_ino_t ino;
+			off_t off;
+			off_t len;
+			// Set for an entry, `ino` is then its directory.
+			std::string name;
+		};
+
+		std::mutex m_lock;
+		std::condition_variable m_wake;
+		std::deque<Notice> m_notices;
+		fuse_session* m_session { nullptr };
+		bool m_stopping { false };
+		std::thread m_thread;
+
+		void run() {
+			std::unique_lock lock(m_lock);
+			while (true) {
+				m_wake.wait(lock, [&] { return m_stopping || !m_notices.empty(); });
+				if (m_notices.empty()) return;
+				auto notice = std::move(m_notices.front());
+				m_notices.pop_front();
+				lock.unlock();
+				if (notice.name.empty()) {
+					fuse_lowlevel_notify_inval_inode(m_session, notice.ino, notice.off, notice.len);
+				} else {
+					fuse_lowlevel_notify_inval_entry(m_session, notice.ino, notice.name.data(), notice.name.size());
+				}
+				lock.lock();
+			}
+		}
+
+		void push(Notice notice) {
+			std::scoped_lock lock(m_lock);
+			if (!m_session) return;
+			m_notices.push_back(std::move(notice));
+			m_wake.notify_one();
+		}
+
+	public:
+		bool active() {
+			std::scoped_lock lock(m_lock);
+			return m_session != nullptr;
+		}
+
+		void start(fuse_session* session) {
+			m_session = session;
+			m_stopping = false;
+			m_thread = std::thread([this] { run(); });
+		}
+
+		// Sends whatever is queued first.
+		void stop() {
+			{
+				std::scoped_lock lock(m_lock);
+				m_stopping = true;
+				m_wake.notify_one();
+			}
+			if (m_thread.joinable()) m_thread.join();
+			m_session = nullptr;
+		}
+
+		// Attributes and the cached contents in [off, off + len), to the end
+		// if `len` is 0.
+		void inode(fuse_ino_t ino, off_t off, off_t len) {
+			push(Notice { ino, off, len, {} });
+		}
+
+		void entry(fuse_ino_t parent, const char* name, size_t len) {
+			push(Notice { parent, 0, 0, std::string(name, len) });
+		}
+};
+static KernelNotifier notifier;
+
+static void invalidate_inode(KeyId object, size_t off, size_t len) {
+	notifier.inode(object, off, len);
+}
+
+static void invalidate_entry(KeyId dir, const char* name, size_t len) {
+	notifier.entry(dir, name, len);
+}
+
+static void invalidate_objects(BufferAllocator& ba, KeyId first, KeyId last) {
+	if (!notifier.active()) return;
+	last = std::min({last, get_super_block(ba)->next_key - 1, MAX_OBJECT_ID});
+	for (auto object = first; object <= last; object++) {
+		auto attributes = get_attributes(ba, object);
+		if (!attributes) continue;
+		notifier.inode(object, 0, 0);
+		if (!S_ISDIR(attributes->mode)) continue;
+		list_entries(ba, object, 0, [&](const char* name, size_t len, KeyId, FSType, uint64_t) {
+			notifier.entry(object, name, len);
+			return true;
+		});
+	}
+}
+
+static void invalidate_changes(BufferAllocator& ba, BlockID from, BlockID to) {
+	if (!notifier.active()) return;
+	// An object's attributes are several records, mostly differing together.
+	KeyId last_inode = 0;
+	FileTree::diff(ba, from, to, [&](KeyId key) {
+		auto object = key_object(key);
+		switch (key_type(key)) {
+			case RecordType::Inode:
+				if (object != last_inode) notifier.inode(object, 0, 0);
+				last_inode = object;
+				break;
+			case RecordType::Data:
+				notifier.inode(object, key_offset(key) * PAGE_SIZE, PAGE_SIZE);
+				break;
+			case RecordType::DirBucket: {
+				// The names either version of the bucket has and the other
+				// doesn't, or has for another object.
+				std::optional<BlockID> ids[2] = {FileTree::search(ba, from, key), FileTree::search(ba, to, key)};
+				BufferPointer raws[2];
+				DirBucket* buckets[2] = {};
+				for (size_t i = 0; i < 2; i++) {
+					if (!ids[i]) continue;
+					raws[i] = ba.load(*ids[i]);
+					buckets[i] = (DirBucket*)raws[i].data();
+				}
+				for (size_t i = 0; i < 2; i++) {
+					if (!buckets[i]) continue;
+					auto other = buckets[1 - i];
+					buckets[i]->for_each([&](BucketEntry* entry, uint64_t) {
+						auto found = other ? other->find(entry->hash, entry->name, entry->name_len) : nullptr;
+						// Names in both are only looked at once.
+						if (found && (i == 1 || found->object == entry->object)) return true;
+						notifier.entry(object, entry->name, entry->name_len);
+						return true;
+					});
+				}
+				break;
+			}
+		}
+	});
+}
+
+/*
+ * Gets what a sequential reader will want next ready. Frames don't outlive
+ * their pins, so rather than loading blocks into the pool this walks the
+ * tree to them, which leaves the path in the page cache, and has the kernel
+ * read the blocks that aren't loaded, which reads then splice from.
+ */
+static void fetch_ahead(KeyId key, size_t len, size_t pos) {
+	EpochGuard guard;
+	std::shared_lock object(object_lock(key));
+	thread_local std::vector<FileSpan> spans;
+	map_file(*global_ba, key, len, pos, spans);
+	for (auto& span : spans) {
+		if (!span.data) {
+			posix_fadvise(global_ba->fd(), span.image_offset, span.len, POSIX_FADV_WILLNEED);
+		}
+	}
+	spans.clear();
+}
+static Readahead read_ahead(fetch_ahead);
+
 BufferAllocator& get_ba() {
 	if (global_ba) return *global_ba;
 	FILE* f = fopen("/home/drew/src/cow-fs/test.dat", "r+");
 	if (!f) return *global_ba;
 	global_ba = new BufferAllocator(f, 100);
+	if (!open_file_system(*global_ba, cowfs_options.clone)) {
+		if (image_format_version(*global_ba) != FORMAT_VERSION) {
+			fprintf(stderr, "cowfs: image has format version %u, this build reads %u, recreate it\n",
+					image_format_version(*global_ba), FORMAT_VERSION);
+		} else if (image_block_size(*global_ba) != PAGE_SIZE) {
+			fprintf(stderr, "cowfs: image has %zu byte blocks, this build uses %zu\n",
+					image_block_size(*global_ba), PAGE_SIZE);
+		} else if (cowfs_options.clone) {
+			fprintf(stderr, "cowfs: no clone named %s\n", cowfs_options.clone);
+		} else {
+			fprintf(stderr, "cowfs: couldn't open the image\n");
+		}
+		exit(1);
+	}
 	return *global_ba;
 
 }
+// How often changes are checkpointed, while there are any.
+const auto CHECKPOINT_INTERVAL = std::chrono::seconds(5);
+
 static void cowfs_init(void *userdata, struct fuse_conn_info *conn)
 {
 	get_ba();
+	// Images created before the log sync by writing everything out.
+	start_intent_log(*global_ba, CHECKPOINT_INTERVAL);
+
+	// Reads splice blocks that aren't loaded straight from the image.
+	if (conn->capable & FUSE_CAP_SPLICE_READ) {
+		conn->want |= FUSE_CAP_SPLICE_READ;
+	}
+	// Writes arrive in a pipe, so whole blocks can be spliced to the image.
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+	}
+
+	// Large requests, so sequential I/O reaches us in few of them. Reads are
+	// capped by the max_read mount option, see fuse_start.
+	conn->max_write = MAX_IO_SIZE;
+	conn->max_readahead = MAX_IO_SIZE;
+	if (cowfs_options.writeback) {
+		if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+			conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+		} else {
+			fprintf(stderr, "cowfs: the kernel has no writeback cache, writes go through\n");
+		}
+	}
 
 	/* Disable the receiving and processing of FUSE_INTERRUPT requests */
 	//conn->no_interrupt = 1;
 }
 
+static void cowfs_destroy(void *userdata)
+{
+	read_ahead.stop();
+	if (global_ba) close_file_system(*global_ba);
+}
+
+// What stat says about `object`.
+static void fill_stat(KeyId object, const Attributes& attributes, struct stat* st) {
+	memset(st, 0, sizeof(*st));
+	st->st_ino = object;
+	st->st_mode = attributes.mode;
+	st->st_nlink = attributes.nlink;
+	st->st_size = attributes.size;
+	st->st_blksize = PAGE_SIZE;
+	st->st_blocks = (attributes.size + 511) / 512;
+	st->st_mtim.tv_sec = attributes.mtime / 1000000000;
+	st->st_mtim.tv_nsec = attributes.mtime % 1000000000;
+	// Nothing changes a file without writing it.
+	st->st_ctim = st->st_mtim;
+	st->st_atim = st->st_mtim;
+}
+
 static void cowfs_getattr(fuse_req_t req, fuse_ino_t ino,
 			     struct fuse_file_info *fi)
 {
 	printf("cowfs_getattr\n");
-	auto [file, _] = get_block_by_key<FSHeader>(*global_ba, (KeyId)ino);
-	if (!file) {
+	auto attributes = get_attributes(*global_ba, (KeyId)ino);
+	if (!attributes) {
 		printf("block id %ld\n not found\n", ino);
-		fuse_reply_err(req, EISDIR);
+		fuse_reply_err(req, ENOENT);
 		return;
 	}
 
-	printf("loaded inode %ld\n", ino);
 	struct stat e;
-	memset(&e, 0, sizeof(e));
-	e.st_ino = ino;
-
-	// We don't properly store the file type in the FSHeader
-	switch (file->type) {
-		case Unknown:
-			printf("actually unknown\n");
-			// TODO: error 
-			break;
-		case SmallFile:
-			{
-				auto f = (File*)file;
-				e.st_mode = S_IFREG | 0444;
-				e.st_nlink = 1;
-				e.st_size = f->size;
-				printf("is_smallfile\n");
-				break;
-			}
-		case SmallDir:
-			e.st_mode = S_IFDIR | 0755;
-			e.st_nlink = 2;
-			printf("is_dir\n");
-			break;
-	}
-
-	fuse_reply_attr(req, &e, 1.0);
+	fill_stat(ino, *attributes, &e);
+	fuse_reply_attr(req, &e, CACHE_TIMEOUT);
 }
 
 static void cowfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
 	printf("looking up %s\n", name);
-	std::string path = name;
 
-	auto [dir, _] = get_block_by_key<Directory>(*global_ba, (KeyId)parent);
-	if (!dir) {
-		// TODO: error handling
+	auto found = find_entry(*global_ba, (KeyId)parent, name);
+	auto attributes = found ? get_attributes(*global_ba, found->first) : std::nullopt;
+	if (!attributes) {
+		fuse_reply_err(req, ENOENT);
 		return;
 	}
 
-	DirEntry* dir_ent = nullptr;
-	for (size_t i = 0; i < dir->size; i+= sizeof(DirEntry) + dir_ent->name_len) {
-		dir_ent = (DirEntry*)&dir->data[i];
-		std::string item_name(
-				reinterpret_cast<const char *>(dir_ent->name),
-				dir_ent->name_len);
-		
-		if (name == item_name) {
-			struct fuse_entry_param e;
-			memset(&e, 0, sizeof(e));
-			e.ino = dir_ent->data;
-			// TODO: timeouts could be higher
-			e.attr_timeout = 1.0;
-			e.entry_timeout = 1.0;
-			e.attr.st_ino = e.ino;
-
-			switch (dir_ent->type) {
-				case SmallDir:
-					printf("lookup is smalldir\n");
-					e.attr.st_mode = S_IFDIR | 0755;
-					e.attr.st_nlink = 2;
-					break;
-				case Unknown:
-					printf("unknown dir entry!!\n");
-					break;
-				case SmallFile:
-					printf("lookup is smallfile\n");
-					e.attr.st_mode = S_IFREG | 0444;
-					e.attr.st_nlink = 1;
-					// lookup file to get the length
-					{
-						auto [file, _] = get_block_by_key<File>(*global_ba, dir_ent->data);
-						if (!file) {
-							// TODO: throw error
-						}
-						e.attr.st_size = file->size;
-					}
-					break;
-			}
-
-			fuse_reply_entry(req, &e);
-			return;
-		}
-	}
-	fuse_reply_err(req, ENOENT);
-}
-
-struct dirbuf {
-	char *p;
-	size_t size;
-};
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	e.ino = found->first;
+	e.attr_timeout = CACHE_TIMEOUT;
+	e.entry_timeout = CACHE_TIMEOUT;
+	fill_stat(e.ino, *attributes, &e.attr);
 
-static void dirbuf_add(fuse_req_t req, struct dirbuf *b, DirEntry* dir)
-{
-	std::string name(reinterpret_cast<const char *>(dir->name), dir->name_len);
-	printf("===> name is %s\n", name.c_str());
-	struct stat stbuf;
-	size_t oldsize = b->size;
-	b->size += fuse_add_direntry(req, NULL, 0, name.c_str(), NULL, 0);
-	b->p = (char *) realloc(b->p, b->size);
-	memset(&stbuf, 0, sizeof(stbuf));
-	stbuf.st_ino = dir->data;
-	//stbuf.st_mode = S_IFREG;
-	printf("st_ino %lx\n", dir->data);
-		
-	fuse_add_direntry(req, b->p + oldsize, b->size - oldsize, name.c_str(), &stbuf,
-			  b->size);
-}
-
-
-static int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
-			     off_t off, size_t maxsize)
-{
-	printf ("bufsize %ld, offset %ld, maxsize %ld", bufsize, off, maxsize);
-	if (off < bufsize) {
-		puts("returning something");
-		return fuse_reply_buf(req, buf + off, std::min(bufsize - off, maxsize));
-	}
-	else {
-		puts("returning nothing");
-		return fuse_reply_buf(req, NULL, 0);
-	}
+	fuse_reply_entry(req, &e);
 }
 
-static void cowfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
-			     off_t off, struct fuse_file_info *fi)
+/*
+ * Replies to a readdir(plus) with the entries after the cookie `off`, as
+ * many as fit in the kernel's `size` bytes. Each entry carries its own
+ * cookie, so the next call picks up where this one stopped without
+ * listing what came before again.
+ */
+static void reply_entries(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, bool plus)
 {
-	printf("looking up dir %ld\n",ino);
-	printf("global_ba %p\n", global_ba);
-	auto [dir, _] = get_block_by_key<Directory>(*global_ba, (KeyId)ino);
-	if (!dir) {
+	auto attributes = get_attributes(*global_ba, (KeyId)ino);
+	if (!attributes || !S_ISDIR(attributes->mode)) {
 		fuse_reply_err(req, ENOTDIR);
 		return;
 	}
 
-	if (dir->header.type != FSType::SmallDir) {
-		fuse_reply_err(req, ENOTDIR);
-		return;
-	}
+	thread_local std::vector<char> buf;
+	buf.resize(size);
+	size_t used = 0;
+	list_entries(*global_ba, (KeyId)ino, off, [&](const char* entry_name, size_t len,
+				KeyId object, FSType type, uint64_t cookie) {
+		char name[MAX_NAME_LEN + 1];
+		memcpy(name, entry_name, len);
+		name[len] = '\0';
+
+		size_t entry_size;
+		if (plus) {
+			struct fuse_entry_param e;
+			memset(&e, 0, sizeof(e));
+			auto entry_attributes = get_attributes(*global_ba, object);
+			if (entry_attributes) {
+				e.ino = object;
+				e.attr_timeout = CACHE_TIMEOUT;
+				e.entry_timeout = CACHE_TIMEOUT;
+				fill_stat(object, *entry_attributes, &e.attr);
+			}
+			entry_size = fuse_add_direntry_plus(req, buf.data() + used, size - used, name, &e, cookie);
+		} else {
+			// Only the inode and the type bits are used.
+			struct stat st;
+			memset(&st, 0, sizeof(st));
+			st.st_ino = object;
+			st.st_mode = is_directory(type) ? S_IFDIR : S_IFREG;
+			entry_size = fuse_add_direntry(req, buf.data() + used, size - used, name, &st, cookie);
+		}
 
-	dir->list_contents();
+		// An entry that doesn't fit isn't added, it starts the next call.
+		if (entry_size > size - used) return false;
+		used += entry_size;
+		return true;
+	});
+	fuse_reply_buf(req, buf.data(), used);
+}
 
-	struct dirbuf b;
-	memset(&b, 0, sizeof(b));
+static void cowfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			     off_t off, struct fuse_file_info *fi)
+{
+	reply_entries(req, ino, size, off, false);
+}
 
-	DirEntry* dir_ent = nullptr;
-	for (size_t i = 0; i < dir->size; i+= sizeof(DirEntry) + dir_ent->name_len) {
-		dir_ent = (DirEntry*)&dir->data[i];
-		printf(" ===> %ld, %.*s\n", 
-				dir_ent->data, (int)dir_ent->name_len, dir_ent->name);
-		dirbuf_add(req, &b, dir_ent);
-	}
-	reply_buf_limited(req, b.p, b.size, off, size);
-	free(b.p);
+static void cowfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+			     off_t off, struct fuse_file_info *fi)
+{
+	reply_entries(req, ino, size, off, true);
 }
 
 static void cowfs_open(fuse_req_t req, fuse_ino_t ino,
 			  struct fuse_file_info *fi)
 {
 	printf("cowfs_open\n");
+	// The kernel sees every change to the contents, so what it has cached
+	// from earlier opens is still good.
+	fi->keep_cache = 1;
+	fi->fh = (uint64_t)new ReadStream;
 	fuse_reply_open(req, fi);
 }
 
+static void cowfs_release(fuse_req_t req, fuse_ino_t ino,
+			  struct fuse_file_info *fi)
+{
+	auto stream = (ReadStream*)fi->fh;
+	if (stream) {
+		read_ahead.forget(*stream);
+		delete stream;
+	}
+	fuse_reply_err(req, 0);
+}
+
+// Only the log needs writing, see intent_log.h. Everything goes out
+// together, so there's nothing to gain from syncing a single file.
+static void cowfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, sync_file_system(*global_ba) ? 0 : EIO);
+}
+
+/*
+ * Replies with the file's contents without copying them: loaded blocks are
+ * sent from their frames, which stay pinned until the reply is written, and
+ * the rest as ranges of the image, which libfuse splices when it can.
+ */
+static void reply_file(fuse_req_t req, KeyId ino, size_t size, off_t off)
+{
+	// Held until the reply is written, as it may read blocks overwritten in place.
+	std::shared_lock object(object_lock(ino));
+	thread_local std::vector<FileSpan> spans;
+	map_file(*global_ba, ino, size, off, spans);
+	if (spans.empty()) {
+		fuse_reply_buf(req, nullptr, 0);
+		return;
+	}
+
+	thread_local std::vector<char> bufv_raw;
+	bufv_raw.assign(sizeof(fuse_bufvec) + spans.size() * sizeof(fuse_buf), 0);
+	auto bufv = (fuse_bufvec*)bufv_raw.data();
+	bufv->count = spans.size();
+	for (size_t i = 0; i < spans.size(); i++) {
+		auto& buf = bufv->buf[i];
+		buf.size = spans[i].len;
+		if (spans[i].data) {
+			buf.mem = (void*)spans[i].data;
+		} else {
+			buf.flags = fuse_buf_flags(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+			buf.fd = global_ba->fd();
+			buf.pos = spans[i].image_offset;
+		}
+	}
+	fuse_reply_data(req, bufv, fuse_buf_copy_flags(0));
+	spans.clear();
+}
+
 static void cowfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 			  off_t off, struct fuse_file_info *fi)
 {
+	EpochGuard guard;
 	printf("cowfs_read %ld size %ld off %ld\n", ino, size, off);
 	auto [file, _] = get_block_by_key<FSHeader>(*global_ba, (KeyId)ino);
 	if (!file) {
@@ -578,7 +1928,7 @@ static void cowfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 	e.st_ino = ino;
 
 	switch (file->type) {
-		case SmallDir:
+		case IndexedDir:
 			e.st_mode = S_IFDIR | 0755;
 			e.st_nlink = 2;
 			printf("is_dir\n");
@@ -589,19 +1939,11 @@ static void cowfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 			fuse_reply_err(req, EISDIR);
 			break;
 		case SmallFile:
-			auto f = (File*)file;
-
-			e.st_mode = S_IFREG | 0444;
-			e.st_nlink = 1;
-			e.st_size = f->size;
-			printf("is_smallfile %ld\n", f->size);
-			for(int i = 0; i < f->size; i++) {
-				printf("%d,", f->data[i]);
+		case LargeFile:
+			if (fi && fi->fh) {
+				read_ahead.read(*(ReadStream*)fi->fh, (KeyId)ino, size, off);
 			}
-			puts("");
-			printf("====> %.*s\n", (int)f->size, f->data);
-			reply_buf_limited(req, f->data, f->size, off, size);
-
+			reply_file(req, (KeyId)ino, size, off);
 			break;
 	}
 
@@ -624,62 +1966,91 @@ static void cowfs_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
 	fuse_reply_err(req, ENOTSUP);
 }
 
+// Why adding `name` to `parent` failed.
+static int add_error(fuse_ino_t parent, const char* name) {
+	if (strlen(name) > MAX_NAME_LEN) return ENAMETOOLONG;
+	if (find_entry(*global_ba, (KeyId)parent, name)) return EEXIST;
+	return ENOSPC;
+}
+
 static void cowfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
 			mode_t mode) {
 
-	auto resp = add_directory(*global_ba, (KeyId)parent, (char*)name);
+	auto resp = add_directory(*global_ba, (KeyId)parent, (char*)name, mode);
 	if (!resp.has_value()) {
+		fuse_reply_err(req, add_error(parent, name));
+		return;
 	}
 	struct fuse_entry_param e;
 	memset(&e, 0, sizeof(e));
 	e.ino = resp.value();
-	e.attr_timeout = 100;
-	e.entry_timeout = 100;
+	e.attr_timeout = CACHE_TIMEOUT;
+	e.entry_timeout = CACHE_TIMEOUT;
 
-	e.attr.st_ino  = resp.value();
-	e.attr.st_size = 4096;
+	fill_stat(e.ino, get_attributes(*global_ba, e.ino).value_or(Attributes {}), &e.attr);
 	fuse_reply_entry(req, &e);
 }
 
 static void cowfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 			 mode_t mode, struct fuse_file_info *fi) {
-	auto resp = add_file(*global_ba, (KeyId)parent, (char*)name);
+	auto resp = add_file(*global_ba, (KeyId)parent, (char*)name, mode);
 	if (!resp.has_value()) {
-		//TODO: proper error handling
+		fuse_reply_err(req, add_error(parent, name));
+		return;
 	}
 	struct fuse_entry_param e;
 	memset(&e, 0, sizeof(e));
 	e.ino = resp.value();
-	e.attr_timeout = 100;
-	e.entry_timeout = 100;
+	e.attr_timeout = CACHE_TIMEOUT;
+	e.entry_timeout = CACHE_TIMEOUT;
 
-	e.attr.st_ino  = resp.value();
-	e.attr.st_size = 0;
+	fill_stat(e.ino, get_attributes(*global_ba, e.ino).value_or(Attributes {}), &e.attr);
 
-	fi->fh = e.ino;
+	fi->fh = (uint64_t)new ReadStream;
+	fi->keep_cache = 1;
 	fuse_reply_create(req, &e, fi);
 }
 
-static void cowfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
-			size_t size, off_t offset,
-			[[maybe_unused]] struct fuse_file_info *fi) {
-	write_file(*global_ba, (KeyId)ino, (char*)buf, size, offset);
-	fuse_reply_write(req, size);
+static void cowfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+			off_t offset, [[maybe_unused]] struct fuse_file_info *fi) {
+	auto size = fuse_buf_size(bufv);
+	auto written = write_file(*global_ba, (KeyId)ino, *bufv, offset);
+	// The kernel's cache already holds all of it.
+	if (written < size && cowfs_options.writeback) {
+		notifier.inode(ino, offset + written, 0);
+	}
+	if (written == 0 && size > 0) {
+		fuse_reply_err(req, (size_t)offset >= MAX_FILE_SIZE ? EFBIG : ENOENT);
+		return;
+	}
+	fuse_reply_write(req, written);
 }
 
 static const struct fuse_lowlevel_ops cowfs_oper = {
 	.init = cowfs_init,
+	.destroy = cowfs_destroy,
 	.lookup = cowfs_lookup,
 	.getattr = cowfs_getattr,
 	.mkdir = cowfs_mkdir,
 	.open = cowfs_open,
 	.read = cowfs_read,
-	.write = cowfs_write,
+	.release = cowfs_release,
+	.fsync = cowfs_fsync,
 	.readdir = cowfs_readdir,
+	.fsyncdir = cowfs_fsync,
 	.setxattr = cowfs_setxattr,
 	.getxattr = cowfs_getxattr,
 	.removexattr = cowfs_removexattr,
 	.create = cowfs_create,
+	.write_buf = cowfs_write_buf,
+	.readdirplus = cowfs_readdirplus,
+};
+
+static const struct fuse_opt cowfs_opts[] = {
+	{ "writeback", offsetof(CowfsOptions, writeback), 1 },
+	{ "no_writeback", offsetof(CowfsOptions, writeback), 0 },
+	{ "clone=%s", offsetof(CowfsOptions, clone), 0 },
+	FUSE_OPT_END
 };
 
 int fuse_start(int argc, char *argv[])
@@ -694,17 +2065,28 @@ int fuse_start(int argc, char *argv[])
 		return 1;
 	if (opts.show_help) {
 		printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+		printf("    -o writeback           cache writes in the kernel\n");
+		printf("    -o clone=NAME          mount a clone instead of the live tree\n");
 		fuse_cmdline_help();
 		fuse_lowlevel_help();
 		ret = 0;
 		goto err_out1;
 	} else if (opts.show_version) {
+		printf("cowfs block size %zu\n", PAGE_SIZE);
 		printf("FUSE library version %s\n", fuse_pkgversion());
 		fuse_lowlevel_version();
 		ret = 0;
 		goto err_out1;
 	}
 
+	if (fuse_opt_parse(&args, &cowfs_options, cowfs_opts, NULL) == -1) {
+		goto err_out1;
+	}
+	// Only the mount option caps reads, init can't.
+	if (fuse_opt_add_arg(&args, ("-omax_read=" + std::to_string(MAX_IO_SIZE)).c_str()) != 0) {
+		goto err_out1;
+	}
+
 	if(opts.mountpoint == NULL) {
 		printf("usage: %s [options] <mountpoint>\n", argv[0]);
 		printf("       %s --help\n", argv[0]);
@@ -724,6 +2106,7 @@ int fuse_start(int argc, char *argv[])
 	    goto err_out3;
 
 	fuse_daemonize(opts.foreground);
+	notifier.start(se);
 
 	/* Block until ctrl+c or fusermount -u */
 	if (opts.singlethread)
@@ -737,6 +2120,7 @@ int fuse_start(int argc, char *argv[])
 		config = NULL;
 	}
 
+	notifier.stop();
 	fuse_session_unmount(se);
 err_out3:
 	fuse_remove_signal_handlers(se);
@@ -1,59 +1,140 @@
 #pragma once
 
+#include <chrono>
+#include <functional>
 #include <vector>
 #include <optional>
 
 #include "buffer_allocator.h"
 #include "definitions.h"
 
-void create_file_system(BufferAllocator& ba, size_t total_pages);
+struct fuse_bufvec;
+
+// Files up to `inline_limit` bytes, at most MAX_FILE_DATA, are stored in
+// their inode.
+void create_file_system(BufferAllocator& ba, size_t total_pages, bool pack_nodes = false,
+		bool buffer_nodes = false, size_t inline_limit = SIZE_MAX);
+// Mounts the live tree, or the named writable clone. Fails if the image was
+// created with a different block size or format version. An image that
+// wasn't closed is first recovered from its intent log, and mounts what was
+// mounted then.
+bool open_file_system(BufferAllocator& ba, const char* clone = nullptr);
+size_t image_block_size(BufferAllocator& ba);
+// FORMAT_VERSION of the build that created the image.
+uint32_t image_format_version(BufferAllocator& ba);
+// Call once there are no readers left, e.g. at unmount.
+void close_file_system(BufferAllocator& ba);
+
+// Logs changes from now until closing (see intent_log.h), checkpointing
+// every `interval`. Fails if the log's header can't be read.
+bool start_intent_log(BufferAllocator& ba, std::chrono::milliseconds interval);
+// Makes every change so far durable, returning false if that failed.
+bool sync_file_system(BufferAllocator& ba);
+// Makes the mounted tree durable as it stands, so what was logged can go.
+bool checkpoint(BufferAllocator& ba);
 
 std::optional<BlockID> insert(BufferAllocator& ba, KeyId key, BlockID value);
 std::optional<BlockID> lookup(BufferAllocator& ba, KeyId key);
+// Calls `visit` on every record of `object` (see definitions.h), in key
+// order, so grouped by record type.
+void scan_object(BufferAllocator& ba, KeyId object, const std::function<void(KeyId, BlockID)>& visit);
+// Calls `visit` on every record with a key in [low, high), in key order.
+void scan_keys(BufferAllocator& ba, KeyId low, KeyId high, const std::function<void(KeyId, BlockID)>& visit);
+// Stops once `visit` returns false, returning false if it did.
+bool scan_keys_until(BufferAllocator& ba, KeyId low, KeyId high, const std::function<bool(KeyId, BlockID)>& visit);
 std::optional<BlockID> remove(BufferAllocator& ba, KeyId key);
+// Removes every key in [low, high). Returns false if the tree was left as is,
+// which it is whenever the range held no keys unless the tree is buffered.
+bool delete_range(BufferAllocator& ba, KeyId low, KeyId high);
+
+// Snapshots are read only copies of the mounted tree, clones are writable
+// copies of a snapshot that can be mounted in its place.
+bool create_snapshot(BufferAllocator& ba, const char* name);
+bool create_clone(BufferAllocator& ba, const char* snapshot, const char* clone);
+bool delete_snapshot(BufferAllocator& ba, const char* name);
+void list_snapshots(BufferAllocator& ba);
 
 void create_root_directory(BufferAllocator& ba);
-std::optional<KeyId> add_directory(BufferAllocator& ba, KeyId parent_key, char* name);
-std::optional<KeyId> add_file(BufferAllocator& ba, KeyId parent_key, char* name);
+// `mode` is the permission bits.
+std::optional<KeyId> add_directory(BufferAllocator& ba, KeyId parent_key, char* name, uint32_t mode = 0755);
+std::optional<KeyId> add_file(BufferAllocator& ba, KeyId parent_key, char* name, uint32_t mode = 0644);
 void inspect_block(BufferAllocator& ba, KeyId key);
 void list_directory(BufferAllocator& ba, KeyId key);
-void write_file(BufferAllocator& ba, KeyId key, char* data, size_t len, size_t pos);
+// Writes `len` bytes at `pos`, growing the file as needed. Returns the number
+// of bytes written, short only at MAX_FILE_SIZE, or 0 if there's no such file.
+size_t write_file(BufferAllocator& ba, KeyId key, const char* data, size_t len, size_t pos);
+// The same for the contents of `src`, which may be in a pipe or file (see
+// fuse_buf_copy) and is consumed. Short too if reading `src` fails.
+size_t write_file(BufferAllocator& ba, KeyId key, fuse_bufvec& src, size_t pos);
+// Copies up to `len` bytes from `pos` into `out`, returning how many there were.
+size_t read_file(BufferAllocator& ba, KeyId key, char* out, size_t len, size_t pos);
+// Prints the whole file.
 void read_file(BufferAllocator& ba, KeyId key);
-void append_file(char* data, size_t len, size_t pos);
-enum FSType { Unknown, SmallDir, SmallFile};
+
+/*
+ * A piece of a file's contents for replying without a copy: `len` bytes
+ * either in memory at `data`, which `frame` keeps loaded (or zeros for a
+ * hole), or at byte `image_offset` of the image, for blocks not loaded.
+ */
+struct FileSpan {
+	BufferPointer frame;
+	const char* data { nullptr };
+	size_t image_offset { 0 };
+	size_t len { 0 };
+};
+// Fills `spans` with up to `len` bytes of the file from `pos`, in order,
+// merging blocks that follow each other in the image. Returns how many
+// bytes there were. Hold an EpochGuard until the spans have been read.
+size_t map_file(BufferAllocator& ba, KeyId key, size_t len, size_t pos, std::vector<FileSpan>& spans);
+// 1 was the single page directories of images before FORMAT_VERSION 1.
+enum FSType { Unknown = 0, SmallFile = 2, LargeFile = 3, IndexedDir = 4 };
 struct [[gnu::packed]] FSHeader {
 	KeyId key { 0 };
 	BlockID block { 0 };
 	FSType type { Unknown };
 };
 
-struct [[gnu::packed]] DirEntry {
-	KeyId data { 0 };
-	FSType type { Unknown };
-	size_t name_len { 0 };
-	char name[];
-};
-
-const size_t MAX_DIR_DATA = PAGE_SIZE - sizeof(FSHeader) - sizeof(size_t);
+// A directory keeps its entries in buckets indexed by name hash (see
+// dir_index.h), and their count here.
 struct [[gnu::packed]] Directory {
 	FSHeader header;
 	size_t size { 0 };
-	char data[MAX_DIR_DATA];
-
-	void insert_file(char* name, FSType type, KeyId block);
-	void list_contents();
-	std::optional<KeyId> lookup_file(char* name);
 };
 
+// The object `name` in directory `dir` refers to, and its type.
+std::optional<std::pair<KeyId, FSType>> find_entry(BufferAllocator& ba, KeyId dir, const char* name);
+// Called with each entry's name, object, type and cookie, returns false to stop.
+using EntryVisitor = std::function<bool(const char*, size_t, KeyId, FSType, uint64_t)>;
+// Visits the entries of `dir` after the one `cookie` was given for, or all of
+// them from 0, in an order that entries being added doesn't change.
+void list_entries(BufferAllocator& ba, KeyId dir, uint64_t cookie, const EntryVisitor& visit);
+
+/*
+ * A SmallFile keeps its contents in `data`, so reading it takes one page. A
+ * LargeFile only keeps its size here, its contents are in one Data record
+ * per block (see definitions.h) and blocks without one read as zeros. Files
+ * start small and become large once they grow past the image's inline limit.
+ */
 const size_t MAX_FILE_DATA = PAGE_SIZE - sizeof(FSHeader) - sizeof(size_t);
 struct [[gnu::packed]] File {
 	FSHeader header;
 	size_t size { 0 };
 	char data[MAX_FILE_DATA];
+};
 
-	void write(char* data, size_t len, size_t pos);
-	void append(char* data, size_t len);
-	void read();
+// What stat reports about an object, see InodeAttr in definitions.h. Its
+// owner is reported as root, and its ctime and atime as its mtime.
+struct Attributes {
+	// Including the file type bits.
+	uint32_t mode { 0 };
+	uint32_t nlink { 0 };
+	uint64_t size { 0 };
+	uint64_t mtime { 0 };
 };
+// Read from the tree alone, empty if there's no such object.
+std::optional<Attributes> get_attributes(BufferAllocator& ba, KeyId object);
+
+// As far as Data keys reach.
+const size_t MAX_FILE_SIZE = (MAX_KEY_OFFSET + 1) * PAGE_SIZE;
 
 int fuse_start(int argc, char *argv[]);
@@ -0,0 +1,493 @@
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "fsck.h"
+#include "definitions.h"
+#include "snapshot.h"
+#include "BTree.h"
+
+// Only the first few problems are printed, the rest are just counted.
+const size_t MAX_REPORTED_ERRORS = 50;
+// Deeper trees are reported as an error rather than walked.
+const size_t MAX_DEPTH = 64;
+
+// A subtree still to be checked, along with the keys it may hold,
+// [low, high).
+struct CheckTask {
+	BlockID id { 0 };
+	size_t depth { 0 };
+	KeyId low { 0 };
+	KeyId high { FileTree::MAX_KEY };
+	// Roots are exempt from the fill checks.
+	bool is_root { false };
+};
+
+struct LevelStats {
+	size_t nodes { 0 };
+	size_t entries { 0 };
+	size_t capacity { 0 };
+};
+
+// Gathered per worker, and summed once the walk is done.
+struct CheckStats {
+	LevelStats levels[MAX_DEPTH];
+	size_t leaves { 0 };
+	size_t interiors { 0 };
+	size_t values { 0 };
+	size_t messages { 0 };
+	size_t underfull { 0 };
+	size_t min_leaf_depth { SIZE_MAX };
+	size_t max_leaf_depth { 0 };
+	// Neighbouring children, and those not in consecutive pages.
+	size_t sibling_pairs { 0 };
+	size_t scattered_pairs { 0 };
+};
+
+/*
+ * Each worker owns a deque of subtrees. It pushes and pops at the back, so
+ * it works depth first on its own part of the tree, and idle workers steal
+ * from the front of the others', where the largest subtrees are.
+ */
+class WorkQueues {
+	private:
+		struct Queue {
+			std::mutex lock;
+			std::deque<CheckTask> tasks;
+		};
+
+		size_t m_count { 0 };
+		std::unique_ptr<Queue[]> m_queues;
+		// Tasks pushed and not yet finished, the walk is over at 0.
+		std::atomic<size_t> m_pending { 0 };
+
+	public:
+		explicit WorkQueues(size_t count)
+			: m_count(count), m_queues(std::make_unique<Queue[]>(count)) {}
+
+		void push(size_t worker, CheckTask task) {
+			m_pending++;
+			std::scoped_lock lock(m_queues[worker].lock);
+			m_queues[worker].tasks.push_back(task);
+		}
+
+		std::optional<CheckTask> pop(size_t worker) {
+			{
+				auto& own = m_queues[worker];
+				std::scoped_lock lock(own.lock);
+				if (!own.tasks.empty()) {
+					auto task = own.tasks.back();
+					own.tasks.pop_back();
+					return task;
+				}
+			}
+			for (size_t i = 1; i < m_count; i++) {
+				auto& victim = m_queues[(worker + i) % m_count];
+				std::scoped_lock lock(victim.lock);
+				if (!victim.tasks.empty()) {
+					auto task = victim.tasks.front();
+					victim.tasks.pop_front();
+					return task;
+				}
+			}
+			return {};
+		}
+
+		void finish() { m_pending--; }
+		bool finished() const { return m_pending == 0; }
+};
+
+class ImageChecker {
+	private:
+		int m_fd { -1 };
+		SuperBlock m_super_block;
+		size_t m_pages { 0 };
+		size_t m_roots { 0 };
+
+		// References found to each page, by page index.
+		std::unique_ptr<std::atomic<uint32_t>[]> m_references;
+		std::atomic<size_t> m_errors { 0 };
+
+		WorkQueues m_queues;
+		std::vector<CheckStats> m_stats;
+
+		void error(const char* format, ...) __attribute__((format(printf, 2, 3)));
+		bool read_page(BlockID id, void* out);
+		bool valid_block(BlockID id);
+		// Counts a reference to `id`, returning true if it is the first.
+		bool reference(BlockID id);
+
+		void check_node(size_t worker, const CheckTask& task, uint8_t* page);
+		void check_free_list(std::vector<uint8_t>& is_free);
+		void check_pages(const std::vector<uint8_t>& is_free);
+		void report();
+
+	public:
+		ImageChecker(int fd, size_t threads) : m_fd(fd), m_queues(threads), m_stats(threads) {}
+
+		bool run();
+};
+
+void ImageChecker::error(const char* format, ...) {
+	if (m_errors++ >= MAX_REPORTED_ERRORS) return;
+
+	va_list args;
+	va_start(args, format);
+	printf("error: ");
+	vprintf(format, args);
+	printf("\n");
+	va_end(args);
+}
+
+bool ImageChecker::read_page(BlockID id, void* out) {
+	return pread(m_fd, out, PAGE_SIZE, id) == (ssize_t)PAGE_SIZE;
+}
+
+bool ImageChecker::valid_block(BlockID id) {
+	return id != 0 && id % PAGE_SIZE == 0 && id / PAGE_SIZE < m_pages;
+}
+
+bool ImageChecker::reference(BlockID id) {
+	return m_references[id / PAGE_SIZE].fetch_add(1, std::memory_order_relaxed) == 0;
+}
+
+void ImageChecker::check_node(size_t worker, const CheckTask& task, uint8_t* page) {
+	auto& stats = m_stats[worker];
+	auto id = task.id;
+	if (!read_page(id, page)) {
+		error("node %" PRIu64 ": can't be read", id);
+		return;
+	}
+	if (task.depth >= MAX_DEPTH) {
+		error("node %" PRIu64 ": deeper than %zu levels", id, MAX_DEPTH);
+		return;
+	}
+
+	auto node = (FileTree::Node*)page;
+	auto& header = node->header;
+	bool is_leaf = header.is_leaf;
+	if (header.format != NodeFormat::Plain && header.format != NodeFormat::Packed) {
+		error("node %" PRIu64 ": unknown format %u", id, (unsigned)header.format);
+		return;
+	}
+	auto capacity = is_leaf
+		? FileTree::max_capacity<FileTree::Record>
+		: FileTree::max_capacity<FileTree::Child>;
+	auto plain = is_leaf
+		? FileTree::plain_capacity<FileTree::Record>
+		: FileTree::plain_capacity<FileTree::Child>;
+	if (header.count > capacity) {
+		error("node %" PRIu64 ": %zu entries, at most %zu fit", id, header.count, capacity);
+		return;
+	}
+	if (!is_leaf && header.count == 0) {
+		error("node %" PRIu64 ": interior node without children", id);
+		return;
+	}
+
+	// What the tree fills nodes to, as in BTree::node_capacity.
+	auto fill = m_super_block.pack_nodes ? FileTree::MAX_PACKED : plain;
+	auto& level = stats.levels[task.depth];
+	level.nodes++;
+	level.entries += header.count;
+	level.capacity += fill;
+	if (!task.is_root && header.count < fill / 2) {
+		stats.underfull++;
+		// Buffered trees and range deletes may leave a node short of
+		// entries, but never an interior node with a single child.
+		if (!m_super_block.buffer_nodes && !is_leaf && header.count < 2) {
+			error("node %" PRIu64 ": interior node with a single child", id);
+		}
+	}
+
+	// Keys increase, and stay within what the parent routes here.
+	for (size_t i = 0; i < header.count; i++) {
+		auto key = node->key_at(i);
+		bool last = i + 1 == header.count;
+		if (i > 0 && key <= node->key_at(i-1)) {
+			error("node %" PRIu64 ": key %zu out of order", id, i);
+		}
+		if (is_leaf && (key < task.low || key >= task.high)) {
+			error("node %" PRIu64 ": key %" PRIu64 " outside [%" PRIu64 ", %" PRIu64 ")",
+					id, key, task.low, task.high);
+		}
+		if (!is_leaf && last && key != FileTree::MAX_KEY) {
+			error("node %" PRIu64 ": last key isn't the sentinel", id);
+		}
+		if (!is_leaf && !last && (key <= task.low || key > task.high)) {
+			error("node %" PRIu64 ": separator %" PRIu64 " outside (%" PRIu64 ", %" PRIu64 "]",
+					id, key, task.low, task.high);
+		}
+	}
+
+	for (size_t i = 0; i < node->message_count(); i++) {
+		auto message = node->message_at(i);
+		stats.messages++;
+		if (i > 0 && message.key <= node->message_at(i-1).key) {
+			error("node %" PRIu64 ": message %zu out of order", id, i);
+		}
+		if (message.is_delete || !holds_block(message.key)) continue;
+
+		if (!valid_block(message.value)) {
+			error("node %" PRIu64 ": message value %" PRIu64 " isn't a block", id, message.value);
+		} else if (reference(message.value)) {
+			stats.values++;
+		}
+	}
+
+	if (is_leaf) {
+		stats.leaves++;
+		stats.min_leaf_depth = std::min(stats.min_leaf_depth, task.depth);
+		stats.max_leaf_depth = std::max(stats.max_leaf_depth, task.depth);
+		for (size_t i = 0; i < header.count; i++) {
+			if (!holds_block(node->key_at(i))) continue;
+			auto value = node->value_at(i);
+			if (!valid_block(value)) {
+				error("node %" PRIu64 ": value %" PRIu64 " isn't a block", id, value);
+			} else if (reference(value)) {
+				stats.values++;
+			}
+		}
+		return;
+	}
+
+	stats.interiors++;
+	for (size_t i = 0; i < header.count; i++) {
+		auto child = node->child_at(i);
+		if (i > 0) {
+			stats.sibling_pairs++;
+			if (child != node->child_at(i-1) + PAGE_SIZE) stats.scattered_pairs++;
+		}
+		if (!valid_block(child)) {
+			error("node %" PRIu64 ": child %" PRIu64 " isn't a block", id, child);
+			continue;
+		}
+		// Shared subtrees are only walked once.
+		if (!reference(child)) continue;
+
+		m_queues.push(worker, CheckTask {
+			.id = child,
+			.depth = task.depth + 1,
+			.low = i > 0 ? node->key_at(i-1) : task.low,
+			.high = i + 1 < header.count ? node->key_at(i) : task.high,
+		});
+	}
+}
+
+void ImageChecker::check_free_list(std::vector<uint8_t>& is_free) {
+	for (auto id = m_super_block.free_list.next_free; id != 0;) {
+		if (!valid_block(id)) {
+			error("free list: %" PRIu64 " isn't a block", id);
+			return;
+		}
+		if (is_free[id / PAGE_SIZE]) {
+			error("free list: %" PRIu64 " is on it twice", id);
+			return;
+		}
+		is_free[id / PAGE_SIZE] = true;
+
+		FreeListPage page;
+		if (pread(m_fd, &page, sizeof(page), id) != (ssize_t)sizeof(page)) {
+			error("free list: %" PRIu64 " can't be read", id);
+			return;
+		}
+		id = page.next;
+	}
+}
+
+void ImageChecker::check_pages(const std::vector<uint8_t>& is_free) {
+	auto& sb = m_super_block;
+	std::vector<ShareCount> shares;
+	if (sb.share_table != 0) {
+		shares.resize(sb.share_table_pages * SHARES_PER_PAGE);
+		for (size_t i = 0; i < sb.share_table_pages; i++) {
+			if (!read_page(sb.share_table + i * PAGE_SIZE, &shares[i * SHARES_PER_PAGE])) {
+				error("share table page %zu can't be read", i);
+			}
+		}
+	}
+
+	auto is_reserved = [&](size_t index) {
+		auto id = index * PAGE_SIZE;
+		return index == 0
+			|| (id >= sb.share_table && id < sb.share_table + sb.share_table_pages * PAGE_SIZE)
+			|| id == sb.snapshot_table
+			|| (id >= sb.log_start && id < sb.log_start + sb.log_pages * PAGE_SIZE);
+	};
+
+	size_t reached = 0;
+	size_t free = 0;
+	size_t leaked = 0;
+	for (size_t index = 0; index < m_pages; index++) {
+		auto references = m_references[index].load();
+		if (is_reserved(index)) {
+			if (references > 0 || is_free[index]) {
+				error("page %zu: reserved, but also in use", index);
+			}
+			continue;
+		}
+
+		if (references > 0) {
+			reached++;
+			if (is_free[index]) {
+				error("page %zu: reachable, but on the free list", index);
+			}
+			// The table stores references beyond the first.
+			if (index < shares.size() && shares[index] + 1u != references) {
+				error("page %zu: %u references, share count %u", index, references, shares[index]);
+			}
+		} else if (is_free[index]) {
+			free++;
+		} else {
+			leaked++;
+		}
+	}
+
+	printf("pages: %zu below the watermark, %zu reachable, %zu free, %zu leaked\n",
+			m_pages, reached, free, leaked);
+	if (leaked > 0) {
+		error("%zu pages are neither reachable nor free", leaked);
+	}
+}
+
+void ImageChecker::report() {
+	CheckStats total;
+	for (auto& stats : m_stats) {
+		for (size_t i = 0; i < MAX_DEPTH; i++) {
+			total.levels[i].nodes += stats.levels[i].nodes;
+			total.levels[i].entries += stats.levels[i].entries;
+			total.levels[i].capacity += stats.levels[i].capacity;
+		}
+		total.leaves += stats.leaves;
+		total.interiors += stats.interiors;
+		total.values += stats.values;
+		total.messages += stats.messages;
+		total.underfull += stats.underfull;
+		total.min_leaf_depth = std::min(total.min_leaf_depth, stats.min_leaf_depth);
+		total.max_leaf_depth = std::max(total.max_leaf_depth, stats.max_leaf_depth);
+		total.sibling_pairs += stats.sibling_pairs;
+		total.scattered_pairs += stats.scattered_pairs;
+	}
+
+	printf("tree: height %zu, %zu interior nodes, %zu leaves, %zu values, %zu buffered messages\n",
+			total.leaves > 0 ? total.max_leaf_depth + 1 : 0,
+			total.interiors, total.leaves, total.values, total.messages);
+	for (size_t i = 0; i < MAX_DEPTH && total.levels[i].nodes > 0; i++) {
+		auto& level = total.levels[i];
+		printf("  level %zu: %zu nodes, %.1f%% full\n", i, level.nodes,
+				100.0 * level.entries / std::max<size_t>(level.capacity, 1));
+	}
+	printf("underfull nodes: %zu\n", total.underfull);
+	printf("fragmentation: %.1f%% of neighbouring nodes aren't in consecutive pages\n",
+			100.0 * total.scattered_pairs / std::max<size_t>(total.sibling_pairs, 1));
+
+	// Subtrees shared between roots are only walked from the first one
+	// to reach them, so depths only line up with a single root.
+	if (total.leaves > 0 && total.min_leaf_depth != total.max_leaf_depth && m_roots == 1) {
+		error("leaves at depths %zu to %zu", total.min_leaf_depth, total.max_leaf_depth);
+	}
+}
+
+bool ImageChecker::run() {
+	if (pread(m_fd, &m_super_block, sizeof(m_super_block), 0) != (ssize_t)sizeof(m_super_block)) {
+		printf("error: can't read the super block\n");
+		return false;
+	}
+	auto& sb = m_super_block;
+	if (sb.format_version != FORMAT_VERSION) {
+		printf("error: image has format version %u, this build reads %u\n",
+				sb.format_version, FORMAT_VERSION);
+		return false;
+	}
+	if (sb.block_size != PAGE_SIZE) {
+		printf("error: image has %zu byte blocks, this build uses %zu\n", sb.block_size, PAGE_SIZE);
+		return false;
+	}
+	printf("block size: %zu bytes\n", sb.block_size);
+	m_pages = sb.free_list.highest_unallocated / PAGE_SIZE;
+	if (sb.free_list.highest_unallocated % PAGE_SIZE != 0
+			|| m_pages > sb.free_list.total_pages + 1) {
+		printf("error: watermark %" PRIu64 " doesn't fit the image\n", sb.free_list.highest_unallocated);
+		return false;
+	}
+	m_references = std::make_unique<std::atomic<uint32_t>[]>(m_pages);
+
+	// Every tree root, and the subtrees deleted snapshots still hold.
+	std::vector<DropEntry> roots = {
+		DropEntry {
+			.block = sb.tree_root,
+			.is_node = true,
+		},
+	};
+	auto table = std::make_unique<SnapshotTable>();
+	if (!read_page(sb.snapshot_table, table.get())) {
+		printf("error: can't read the snapshot table\n");
+		return false;
+	}
+	for (auto& entry : table->entries) {
+		if (entry.in_use) {
+			roots.push_back(DropEntry {
+				.block = entry.root,
+				.is_node = true,
+			});
+		}
+	}
+	for (size_t i = 0; i < std::min(table->drop_count, MAX_DROP_ENTRIES); i++) {
+		roots.push_back(table->drops[i]);
+	}
+
+	m_roots = roots.size();
+	for (size_t i = 0; i < roots.size(); i++) {
+		auto root = roots[i];
+		if (!valid_block(root.block)) {
+			error("root %" PRIu64 " isn't a block", root.block);
+		} else if (reference(root.block) && root.is_node) {
+			m_queues.push(i % m_stats.size(), CheckTask {
+				.id = root.block,
+				.is_root = true,
+			});
+		}
+	}
+
+	std::vector<std::thread> workers;
+	for (size_t worker = 0; worker < m_stats.size(); worker++) {
+		workers.emplace_back([this, worker] {
+			alignas(PAGE_SIZE) uint8_t page[PAGE_SIZE];
+			while (!m_queues.finished()) {
+				auto task = m_queues.pop(worker);
+				if (!task) {
+					std::this_thread::yield();
+					continue;
+				}
+				check_node(worker, *task, page);
+				m_queues.finish();
+			}
+		});
+	}
+	for (auto& worker : workers) {
+		worker.join();
+	}
+
+	std::vector<uint8_t> is_free(m_pages);
+	check_free_list(is_free);
+	check_pages(is_free);
+	report();
+
+	printf("%zu errors\n", m_errors.load());
+	return m_errors == 0;
+}
+
+bool check_image(FILE* file, size_t threads) {
+	ImageChecker checker(fileno(file), std::max<size_t>(threads, 1));
+	return checker.run();
+}
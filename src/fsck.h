@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+
+/*
+ * Offline consistency checker. Walks every tree in the image (the live tree,
+ * snapshots and clones, and subtrees still queued for release) with
+ * `threads` workers sharing subtrees through work stealing, then accounts
+ * for every page below the allocation watermark.
+ *
+ * Reports key order, fill and depth violations, blocks that are both
+ * reachable and on the free list, share counts that disagree with the
+ * references found, and leaked pages, followed by tree statistics. Pages
+ * are read straight from `file`, which must not be mounted meanwhile.
+ * Returns true if no errors were found.
+ */
+bool check_image(FILE* file, size_t threads);
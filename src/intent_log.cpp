@@ -0,0 +1,228 @@
+#include <cstring>
+
+#include <unistd.h>
+
+#include "intent_log.h"
+
+// FNV-1a, over the record after its checksum and then the payload.
+static uint32_t record_checksum(const LogRecord& record, const void* payload) {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	auto add = [&](const void* data, size_t len) {
+		auto bytes = (const uint8_t*)data;
+		for (size_t i = 0; i < len; i++) {
+			hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+		}
+	};
+	add((const char*)&record + sizeof(record.checksum), sizeof(record) - sizeof(record.checksum));
+	add(payload, record.length);
+	return uint32_t(hash ^ (hash >> 32));
+}
+
+static bool write_all(int fd, const void* data, size_t len, size_t offset) {
+	auto bytes = (const char*)data;
+	while (len > 0) {
+		auto written = pwrite(fd, bytes, len, offset);
+		if (written <= 0) return false;
+		bytes += written;
+		len -= written;
+		offset += written;
+	}
+	return true;
+}
+
+bool read_log_header(int fd, BlockID start, LogHeader& header) {
+	return pread(fd, &header, sizeof(header), start) == (ssize_t)sizeof(header)
+		&& header.magic == LOG_MAGIC;
+}
+
+bool write_log_header(int fd, BlockID start, const LogHeader& header) {
+	return write_all(fd, &header, sizeof(header), start) && fdatasync(fd) == 0;
+}
+
+// Checkpoints alternate between the copies.
+static BlockID log_table(BlockID start, const LogHeader& header) {
+	return start + (1 + header.sequence % 2) * PAGE_SIZE;
+}
+
+bool read_log_table(int fd, BlockID start, const LogHeader& header, void* table) {
+	return pread(fd, table, PAGE_SIZE, log_table(start, header)) == (ssize_t)PAGE_SIZE;
+}
+
+bool write_log_table(int fd, BlockID start, const LogHeader& header, const void* table) {
+	return write_all(fd, table, PAGE_SIZE, log_table(start, header));
+}
+
+void read_log(int fd, BlockID start, size_t pages, const LogHeader& header,
+		const std::function<bool(const LogRecord&, const char*)>& replay) {
+	auto offset = start + LOG_HEADER_PAGES * PAGE_SIZE;
+	auto end = start + pages * PAGE_SIZE;
+	auto lsn = header.next_lsn;
+	std::vector<char> payload;
+	while (offset + sizeof(LogRecord) <= end) {
+		LogRecord record;
+		if (pread(fd, &record, sizeof(record), offset) != (ssize_t)sizeof(record)) return;
+		if (record.sequence != header.sequence || record.lsn != lsn
+				|| offset + sizeof(record) + record.length > end) {
+			return;
+		}
+		payload.resize(record.length);
+		if (pread(fd, payload.data(), record.length, offset + sizeof(record)) != (ssize_t)record.length
+				|| record_checksum(record, payload.data()) != record.checksum) {
+			return;
+		}
+		if (!replay(record, payload.data())) return;
+
+		offset += sizeof(record) + record.length;
+		lsn++;
+	}
+}
+
+void IntentLog::open(int fd, BlockID start, size_t pages, const LogHeader& header) {
+	std::scoped_lock lock(m_lock);
+	m_fd = fd;
+	m_records = start + LOG_HEADER_PAGES * PAGE_SIZE;
+	m_capacity = (pages - LOG_HEADER_PAGES) * PAGE_SIZE;
+	m_sequence = header.sequence;
+	m_pending.clear();
+	m_written = 0;
+	m_next_lsn = header.next_lsn;
+	m_durable_lsn = header.next_lsn;
+	m_busy = false;
+	m_failed = false;
+}
+
+void IntentLog::close() {
+	stop_checkpoints();
+	std::scoped_lock lock(m_lock);
+	m_fd = -1;
+}
+
+void IntentLog::stop_checkpoints() {
+	{
+		std::scoped_lock lock(m_lock);
+		m_stopping = true;
+		m_changed.notify_all();
+	}
+	if (m_checkpointer.joinable()) m_checkpointer.join();
+
+	std::scoped_lock lock(m_lock);
+	m_stopping = false;
+}
+
+void IntentLog::start_checkpoints(std::chrono::milliseconds interval, std::function<void()> checkpoint) {
+	if (m_checkpointer.joinable()) return;
+	m_checkpointer = std::thread([this, interval, checkpoint] {
+		std::unique_lock lock(m_lock);
+		while (!m_stopping) {
+			m_changed.wait_for(lock, interval, [&] {
+				return m_stopping || m_written + m_pending.size() > m_capacity / 2;
+			});
+			if (m_stopping) return;
+			// Nothing logged, so nothing changed since the last one.
+			if (m_pending.empty() && m_written == 0) continue;
+
+			lock.unlock();
+			checkpoint();
+			lock.lock();
+		}
+	});
+}
+
+bool IntentLog::append(LogRecord record, const void* payload) {
+	return append(record, [&](char* out) { memcpy(out, payload, record.length); });
+}
+
+bool IntentLog::append(LogRecord record, const std::function<void(char* payload)>& fill) {
+	std::scoped_lock lock(m_lock);
+	if (m_written + m_pending.size() + sizeof(record) + record.length > m_capacity) {
+		return false;
+	}
+
+	record.sequence = m_sequence;
+	record.lsn = m_next_lsn++;
+	auto at = m_pending.size();
+	m_pending.resize(at + sizeof(record) + record.length);
+	auto payload = m_pending.data() + at + sizeof(record);
+	fill(payload);
+	record.checksum = record_checksum(record, payload);
+	memcpy(m_pending.data() + at, &record, sizeof(record));
+	if (m_written + m_pending.size() > m_capacity / 2) {
+		m_changed.notify_all();
+	}
+	return true;
+}
+
+// Waits for the running sync or checkpoint, if any. True if the caller
+// should check again whether it still has anything to do.
+bool IntentLog::busy_wait(std::unique_lock<std::mutex>& lock) {
+	if (!m_busy) return false;
+	m_changed.wait(lock, [&] { return !m_busy; });
+	return true;
+}
+
+bool IntentLog::sync() {
+	std::unique_lock lock(m_lock);
+	auto target = m_next_lsn;
+	while (m_durable_lsn < target) {
+		if (m_failed) return false;
+		if (busy_wait(lock)) continue;
+
+		// Whatever has been appended by now goes out with this flush,
+		// including the records of syncs that queued behind the last one.
+		m_busy = true;
+		auto batch_end = m_next_lsn;
+		auto offset = m_written;
+		thread_local std::vector<char> batch;
+		batch.clear();
+		batch.swap(m_pending);
+		m_written += batch.size();
+		lock.unlock();
+
+		bool ok = write_all(m_fd, batch.data(), batch.size(), m_records + offset)
+			&& fdatasync(m_fd) == 0;
+
+		lock.lock();
+		m_busy = false;
+		if (ok) {
+			m_durable_lsn = batch_end;
+		} else {
+			m_failed = true;
+		}
+		m_changed.notify_all();
+	}
+	return !m_failed;
+}
+
+void IntentLog::begin_checkpoint() {
+	std::unique_lock lock(m_lock);
+	busy_wait(lock);
+	m_busy = true;
+}
+
+void IntentLog::end_checkpoint(const LogHeader& header) {
+	std::scoped_lock lock(m_lock);
+	m_sequence = header.sequence;
+	m_pending.clear();
+	m_written = 0;
+	m_next_lsn = header.next_lsn;
+	m_durable_lsn = header.next_lsn;
+	m_busy = false;
+	m_failed = false;
+	m_changed.notify_all();
+}
+
+void IntentLog::abort_checkpoint() {
+	std::scoped_lock lock(m_lock);
+	m_busy = false;
+	m_changed.notify_all();
+}
+
+void IntentLog::mark_failed() {
+	std::scoped_lock lock(m_lock);
+	m_failed = true;
+}
+
+uint64_t IntentLog::next_lsn() {
+	std::scoped_lock lock(m_lock);
+	return m_next_lsn;
+}
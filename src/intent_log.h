@@ -0,0 +1,158 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "definitions.h"
+
+/*
+ * The intent log. While mounted, each change is also described by a record
+ * appended here, so making changes durable only takes writing their
+ * records and one device flush, rather than every tree path they touched.
+ * Syncs that arrive while another is writing wait and then go out together
+ * (group commit).
+ *
+ * The image itself is made durable by checkpoints, taken in the background.
+ * A checkpoint keeps the tree it wrote out intact until the next one is
+ * durable (see checkpoint in file_system.cpp). The log then starts over.
+ * After a crash the image is put back to its last checkpoint and the
+ * records written since are replayed on top.
+ *
+ * The log is a region reserved at creation. Its first page is a LogHeader
+ * describing the last checkpoint, which fits in a sector so it is written
+ * whole or not at all. Two pages of snapshot table copies follow, used by
+ * checkpoints in turn so the last one's survives until the next header is
+ * written, then the records. A record is only replayed if its checksum
+ * holds and it follows the checkpoint and the record before, so a torn
+ * write or records from before the checkpoint end the log.
+ */
+enum class LogOp : uint8_t {
+	Write = 1,
+	AddDirectory = 2,
+	AddFile = 3,
+};
+
+struct [[gnu::packed]] LogRecord {
+	// Of the rest of the record and its payload.
+	uint32_t checksum { 0 };
+	// Bytes of payload following the record: written data, or a name.
+	uint32_t length { 0 };
+	// The checkpoint the record follows, and its place after it.
+	uint64_t sequence { 0 };
+	uint64_t lsn { 0 };
+	LogOp op { LogOp::Write };
+	// The file written, or the object added.
+	KeyId object { 0 };
+	// The directory an object was added to.
+	KeyId parent { 0 };
+	// Where the data was written, or the added object's mode.
+	uint64_t arg { 0 };
+	// What now() returned for the change, in nanoseconds.
+	uint64_t time { 0 };
+};
+
+const uint64_t LOG_MAGIC = 0x676f6c2d776f63ull;
+
+struct [[gnu::packed]] LogHeader {
+	uint64_t magic { LOG_MAGIC };
+	// Counts checkpoints from a value picked at creation, so records from
+	// an earlier file system in the same region never look current.
+	uint64_t sequence { 0 };
+	// The first record after the checkpoint.
+	uint64_t next_lsn { 0 };
+	// Set while mounted. If it is found set, the image needs recovering.
+	bool active { false };
+	// The writable clone that was mounted plus one, or 0 for the live tree.
+	uint64_t clone { 0 };
+	SuperBlock super_block;
+};
+
+static_assert(sizeof(LogHeader) <= 512, "log headers are written a sector at a time");
+
+// The log's pages: the header and two snapshot table copies, then records.
+const size_t LOG_HEADER_PAGES = 3;
+
+class IntentLog {
+	private:
+		int m_fd { -1 };
+		BlockID m_records { 0 };
+		size_t m_capacity { 0 };
+		uint64_t m_sequence { 0 };
+
+		std::mutex m_lock;
+		// Signalled when a sync or checkpoint finishes, and to wake the
+		// checkpointer.
+		std::condition_variable m_changed;
+		// Appended and not yet written, they go at m_written.
+		std::vector<char> m_pending;
+		size_t m_written { 0 };
+		uint64_t m_next_lsn { 0 };
+		// Every record before this is durable.
+		uint64_t m_durable_lsn { 0 };
+		// A sync or checkpoint is writing, others wait for it.
+		bool m_busy { false };
+		// A write failed, so nothing after it can be made durable.
+		bool m_failed { false };
+
+		bool m_stopping { false };
+		std::thread m_checkpointer;
+
+		bool busy_wait(std::unique_lock<std::mutex>& lock);
+
+	public:
+		// Starts appending after the checkpoint `header` describes, the
+		// region being `pages` pages at `start` of the image `fd`.
+		void open(int fd, BlockID start, size_t pages, const LogHeader& header);
+		// Stops the checkpointer first, if there is one.
+		void close();
+		// Waits for a running checkpoint, so don't hold what it takes.
+		void stop_checkpoints();
+		bool is_open() { return m_fd >= 0; }
+
+		// Runs `checkpoint` every `interval` and whenever the log is half
+		// full, if anything was logged since the last one. Once per open.
+		void start_checkpoints(std::chrono::milliseconds interval, std::function<void()> checkpoint);
+
+		// Appends a record for a change the caller (holding the writer
+		// lock) has made. False if there's no room before a checkpoint.
+		bool append(LogRecord record, const void* payload);
+		// The same, with `fill` writing the payload straight into the
+		// log's buffer.
+		bool append(LogRecord record, const std::function<void(char* payload)>& fill);
+		// Makes every record appended so far durable. False if writing
+		// the log failed.
+		bool sync();
+
+		// Bracket a checkpoint, which must hold the writer lock so nothing
+		// is appended meanwhile. Ending one drops every record appended,
+		// as the checkpoint covers them, and starts the records over
+		// after `header`, which must be durable.
+		void begin_checkpoint();
+		void end_checkpoint(const LogHeader& header);
+		// For a checkpoint that failed, which leaves the log as it was.
+		void abort_checkpoint();
+		// A change could neither be logged nor checkpointed, so syncs fail
+		// until a checkpoint succeeds.
+		void mark_failed();
+		// The first record after the next checkpoint.
+		uint64_t next_lsn();
+};
+
+// Whether the region at `start` holds a log header.
+bool read_log_header(int fd, BlockID start, LogHeader& header);
+bool write_log_header(int fd, BlockID start, const LogHeader& header);
+// The snapshot table as of the checkpoint `header` describes, a page. It's
+// written first, and only durable along with the header.
+bool read_log_table(int fd, BlockID start, const LogHeader& header, void* table);
+bool write_log_table(int fd, BlockID start, const LogHeader& header, const void* table);
+
+// Calls `replay` with each record logged after the checkpoint `header`
+// describes, in order, until the log ends or `replay` returns false.
+void read_log(int fd, BlockID start, size_t pages, const LogHeader& header,
+		const std::function<bool(const LogRecord&, const char*)>& replay);
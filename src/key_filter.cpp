@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <bit>
+
+#include "key_filter.h"
+
+// Counters per key and counters probed per key. This gives roughly a 2%
+// false positive rate at capacity.
+const size_t COUNTERS_PER_KEY = 8;
+const size_t PROBES = 4;
+// Bounds the filter at 16MiB however large the image is.
+const size_t MAX_COUNTERS = 1 << 24;
+
+const uint8_t SATURATED = UINT8_MAX;
+
+// splitmix64, consecutive keys land far apart.
+static uint64_t mix(uint64_t x) {
+	x += 0x9e3779b97f4a7c15ull;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+template <typename F>
+void KeyFilter::probe(const Counters& table, KeyId key, F f) {
+	auto hash = mix(key);
+	uint64_t h1 = hash & UINT32_MAX;
+	// Odd, so the probes of a key are distinct.
+	uint64_t h2 = (hash >> 32) | 1;
+	for (size_t i = 0; i < PROBES; i++) {
+		f(table.counters[(h1 + i * h2) & table.mask]);
+	}
+}
+
+void KeyFilter::add_to(Counters& table, KeyId key) {
+	// Only the writer changes counters, so this needn't be atomic.
+	probe(table, key, [](std::atomic<uint8_t>& counter) {
+		auto count = counter.load(std::memory_order_relaxed);
+		if (count != SATURATED) counter.store(count + 1, std::memory_order_relaxed);
+	});
+}
+
+// A new empty table for `keys` keys, and as many again.
+KeyFilter::Counters* KeyFilter::make_counters(size_t keys) {
+	auto size = std::bit_ceil(std::clamp(2 * keys * COUNTERS_PER_KEY, size_t(64), MAX_COUNTERS));
+	auto table = std::make_unique<Counters>();
+	table->counters = std::make_unique<std::atomic<uint8_t>[]>(size);
+	table->mask = size - 1;
+	for (size_t i = 0; i < size; i++) {
+		table->counters[i].store(0, std::memory_order_relaxed);
+	}
+	m_capacity = size / COUNTERS_PER_KEY;
+	m_tables.push_back(std::move(table));
+	return m_tables.back().get();
+}
+
+void KeyFilter::reset(BufferAllocator& ba, size_t keys) {
+	m_owner.store(nullptr);
+	m_current.store(nullptr);
+	m_tables.clear();
+	m_current.store(make_counters(keys));
+	m_keys = 0;
+	m_owner.store(&ba);
+}
+
+void KeyFilter::add(BufferAllocator& ba, KeyId key) {
+	if (m_owner.load() != &ba) {
+		m_owner.store(nullptr);
+		return;
+	}
+
+	add_to(*m_current.load(), key);
+	m_keys++;
+}
+
+void KeyFilter::remove(BufferAllocator& ba, KeyId key) {
+	if (m_owner.load() != &ba) {
+		m_owner.store(nullptr);
+		return;
+	}
+
+	probe(*m_current.load(), key, [](std::atomic<uint8_t>& counter) {
+		auto count = counter.load(std::memory_order_relaxed);
+		if (count != SATURATED && count != 0) counter.store(count - 1, std::memory_order_relaxed);
+	});
+	if (m_keys > 0) m_keys--;
+}
+
+bool KeyFilter::overfull() const {
+	return m_keys > m_capacity && m_capacity * COUNTERS_PER_KEY < MAX_COUNTERS;
+}
+
+void KeyFilter::grow(BufferAllocator& ba, const std::function<void(const std::function<void(KeyId)>&)>& walk) {
+	if (m_owner.load() != &ba) return;
+
+	auto table = make_counters(m_keys);
+	m_keys = 0;
+	walk([&](KeyId key) {
+		add_to(*table, key);
+		m_keys++;
+	});
+	// Filled before it is published, readers still on the old table keep
+	// it until the next reset.
+	m_current.store(table);
+}
+
+bool KeyFilter::may_contain(BufferAllocator& ba, KeyId key) const {
+	if (m_owner.load() != &ba) return true;
+
+	bool present = true;
+	probe(*m_current.load(), key, [&](std::atomic<uint8_t>& counter) {
+		if (counter.load(std::memory_order_relaxed) == 0) present = false;
+	});
+	return present;
+}
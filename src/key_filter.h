@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "buffer_allocator.h"
+#include "definitions.h"
+
+/*
+ * A counting bloom filter over the keys of the mounted tree, so lookups of
+ * keys that don't exist can usually be answered without a descent. It is
+ * kept in memory only, rebuilt whenever a tree is mounted and updated by
+ * every insert and remove after that.
+ *
+ * Counters saturate, a saturated counter is never decremented again. Keys
+ * are added before the root holding them is published and removed after the
+ * root without them is, so readers never see a false negative.
+ *
+ * The filter is sized for the keys the tree held when it was built. Once
+ * more are added it is rebuilt larger from the tree, and readers carry on
+ * with the smaller one until the larger one is published.
+ */
+class KeyFilter {
+	private:
+		struct Counters {
+			std::unique_ptr<std::atomic<uint8_t>[]> counters;
+			size_t mask { 0 };
+		};
+
+		// The image the filter describes, or null while it doesn't
+		// describe any, in which case every key may be present.
+		std::atomic<BufferAllocator*> m_owner { nullptr };
+		std::atomic<Counters*> m_current { nullptr };
+		// Every table since the last reset, the current one last. Readers
+		// may still be probing the others.
+		std::vector<std::unique_ptr<Counters>> m_tables;
+		// Writers only.
+		size_t m_keys { 0 };
+		size_t m_capacity { 0 };
+
+		Counters* make_counters(size_t keys);
+
+		template <typename F>
+		static void probe(const Counters& table, KeyId key, F f);
+		static void add_to(Counters& table, KeyId key);
+
+	public:
+		// Empty the filter and size it for `keys` keys of `ba`, and as many
+		// again. Must not race with readers, i.e. only call while mounting.
+		void reset(BufferAllocator& ba, size_t keys);
+
+		// Writers only, under the writer lock. Updates for any other image
+		// invalidate the filter.
+		void add(BufferAllocator& ba, KeyId key);
+		void remove(BufferAllocator& ba, KeyId key);
+
+		// Whether more keys were added than the filter was sized for.
+		bool overfull() const;
+		// Replaces the filter with one sized for twice the keys it holds,
+		// filled with the keys `walk` passes to its argument. Writers only.
+		void grow(BufferAllocator& ba, const std::function<void(const std::function<void(KeyId)>&)>& walk);
+
+		// False only if `key` is certainly not in the tree.
+		bool may_contain(BufferAllocator& ba, KeyId key) const;
+};
@@ -3,15 +3,24 @@
 #include "buffer_allocator.h"
 
 #include "file_system.h"
+#include "fsck.h"
+#include "snapshot.h"
+#include "BTree.h"
 
 #include <cstring>
 #include <cstdlib>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <vector>
 #include <algorithm>
 #include <random>
 #include <unordered_set>
+#include <map>
+#include <set>
 #include <chrono>
+#include <thread>
 
 void test_insert(int k, int v) {
 		FILE* f = fopen("test.dat", "r+");
@@ -131,10 +140,383 @@ void test_delete_random(int amount, int to_delete) {
 
 
 
+// Random inserts, replacements and removes against a buffered tree, which
+// flushes messages down as buffers fill, checked against a map of the keys.
+bool test_buffered(int amount) {
+	FILE* f = fopen("buffered_test.dat", "w+");
+	if (!f) return false;
+	BufferAllocator ba (f, 100);
+	create_file_system(ba, 100000, false, true);
+
+	// Keys from 1 are attributes of no object, so the values aren't blocks.
+	auto rng = std::default_random_engine(std::chrono::steady_clock::now().time_since_epoch().count());
+	std::vector<KeyId> keys;
+	for (int i = 1; i <= amount; i++) {
+		keys.push_back(i);
+	}
+	std::map<KeyId, BlockID> expected;
+	std::shuffle(keys.begin(), keys.end(), rng);
+	for (auto key : keys) {
+		insert(ba, key, key);
+		expected[key] = key;
+	}
+	std::shuffle(keys.begin(), keys.end(), rng);
+	for (int i = 0; i < amount / 2; i++) {
+		remove(ba, keys[i]);
+		expected.erase(keys[i]);
+	}
+	for (int i = amount / 4; i < amount * 3 / 4; i++) {
+		insert(ba, keys[i], keys[i] * 2);
+		expected[keys[i]] = keys[i] * 2;
+	}
+
+	int success = 0;
+	for (int i = 1; i <= amount; i++) {
+		auto res = lookup(ba, i);
+		auto it = expected.find(i);
+		if (it == expected.end() ? !res.has_value() : res == it->second) {
+			success++;
+		}
+	}
+	printf("successful lookups %d of %d\n", success, amount);
+
+	std::vector<std::pair<const KeyId, BlockID>> scanned;
+	scan_keys(ba, 1, amount + 1, [&](KeyId key, BlockID value) {
+		scanned.emplace_back(key, value);
+	});
+	bool scan_ok = std::equal(scanned.begin(), scanned.end(), expected.begin(), expected.end());
+	if (!scan_ok) printf("scan differs\n");
+
+	close_file_system(ba);
+	ba.flush_all();
+	bool clean = check_image(f, 1);
+	fclose(f);
+	return success == amount && scan_ok && clean;
+}
+
+// A tree of another record layout and node size than the file system's,
+// through random inserts, removes and range deletes checked against a map,
+// and diffed with how it was earlier on. Its blocks are left behind in the
+// scratch image.
+bool test_small_tree(bool buffer) {
+	FILE* f = fopen("small_tree_test.dat", "w+");
+	if (!f) return false;
+	BufferAllocator ba (f, 100);
+	create_file_system(ba, 100000);
+
+	FreedBlocks freed;
+	BlockID root = SmallTree::new_empty_leaf(ba).id();
+	auto insert = [&](uint32_t key, uint64_t value) {
+		if (buffer) {
+			root = SmallTree::apply_buffered(ba, freed, root, SmallTree::Message { .key = key, .value = value });
+			return;
+		}
+		auto propagation = SmallTree::insert(ba, freed, root, SmallTree::Record { .key = key, .value = value });
+		if (!propagation.is_split) {
+			root = propagation.update;
+			return;
+		}
+		auto new_root = SmallTree::Interior { .header = BTNodeHeader { .is_leaf = false, .count = 2 } };
+		new_root.pairs[0] = SmallTree::Child { .key = propagation.key, .value = propagation.left };
+		new_root.pairs[1] = SmallTree::Child { .key = SmallTree::MAX_KEY, .value = propagation.right };
+		root = SmallTree::write_node(ba, new_root).id();
+	};
+	auto remove = [&](uint32_t key) {
+		if (buffer) {
+			root = SmallTree::apply_buffered(ba, freed, root, SmallTree::Message { .key = key, .is_delete = true });
+			return;
+		}
+		auto propagation = SmallTree::remove(ba, freed, root, key);
+		auto interior = std::get_if<SmallTree::Interior>(&propagation.new_node);
+		root = interior && interior->header.count == 1
+				? interior->pairs[0].value
+				: SmallTree::write_node(ba, propagation.new_node).id();
+	};
+
+	// Keys reach up to just below the reserved largest one.
+	const uint32_t top = SmallTree::MAX_KEY - 1;
+	auto rng = std::default_random_engine(std::chrono::steady_clock::now().time_since_epoch().count());
+	auto random_key = [&]() { return rng() % 4 == 0 ? top - rng() % 1000 : uint32_t(rng() % 3000); };
+	std::map<uint32_t, uint64_t> expected;
+	// Blocks are never reused here, so the tree as it was stays readable.
+	BlockID earlier_root = 0;
+	std::map<uint32_t, uint64_t> earlier;
+	for (int i = 0; i < 3000; i++) {
+		if (i == 2000) {
+			earlier_root = root;
+			earlier = expected;
+		}
+		auto key = random_key();
+		if (i % 3 == 2 && expected.count(key)) {
+			remove(key);
+			expected.erase(key);
+		} else {
+			insert(key, uint64_t(key) << 20 | i);
+			expected[key] = uint64_t(key) << 20 | i;
+		}
+		if (i % 500 == 499) {
+			auto low = random_key(), high = random_key();
+			if (high < low) std::swap(low, high);
+			SmallTree::RangeDeletion deletion;
+			root = SmallTree::delete_range(ba, freed, root, low, high, deletion);
+			expected.erase(expected.lower_bound(low), expected.lower_bound(high));
+		}
+	}
+
+	int misses = 0;
+	for (uint32_t key = 0; key < 3000; key++) {
+		auto it = expected.find(key);
+		if (SmallTree::search(ba, root, key) != (it == expected.end() ? std::nullopt : std::optional(it->second))) misses++;
+	}
+	for (auto [key, value] : expected) {
+		if (SmallTree::search(ba, root, key) != value) misses++;
+	}
+	std::vector<std::pair<const uint32_t, uint64_t>> scanned;
+	SmallTree::scan(ba, root, [&](uint32_t key, uint64_t value) { scanned.emplace_back(key, value); });
+	bool scan_ok = std::equal(scanned.begin(), scanned.end(), expected.begin(), expected.end());
+
+	std::set<uint32_t> changed, diffed;
+	for (auto& [from, to] : {std::pair(&earlier, &expected), std::pair(&expected, &earlier)}) {
+		for (auto [key, value] : *from) {
+			auto it = to->find(key);
+			if (it == to->end() || it->second != value) changed.insert(key);
+		}
+	}
+	bool diff_ok = true;
+	SmallTree::diff(ba, earlier_root, root, [&](uint32_t key) {
+		diff_ok = diff_ok && diffed.insert(key).second;
+	});
+	diff_ok = diff_ok && diffed == changed;
+	printf("%zu keys, %d lookups wrong%s%s\n", expected.size(), misses, scan_ok ? "" : ", scan differs",
+			diff_ok ? "" : ", diff differs");
+	fclose(f);
+	return misses == 0 && scan_ok && diff_ok;
+}
+
+// Deleting one file's blocks with delete_range leaves the other file as it
+// was. Subtrees the range covers whole are queued and given back a few
+// blocks per commit.
+bool test_delete_range(bool buffer) {
+	FILE* f = fopen("range_test.dat", "w+");
+	if (!f) return false;
+	bool ok = true;
+	auto expect = [&](bool passed, const char* what) {
+		if (!passed) printf("failed: %s\n", what);
+		ok = ok && passed;
+	};
+
+	BufferAllocator ba (f, 100);
+	create_file_system(ba, 100000, false, buffer);
+	create_root_directory(ba);
+	auto deleted = add_file(ba, 1, (char*)"deleted");
+	auto kept = add_file(ba, 1, (char*)"kept");
+	std::vector<char> data(2000 * PAGE_SIZE, 'd');
+	std::vector<char> read(data.size());
+	write_file(ba, *deleted, data.data(), data.size(), 0);
+	write_file(ba, *kept, data.data(), data.size(), 0);
+
+	expect(delete_range(ba, data_key(*deleted, 0), data_key(*deleted, MAX_KEY_OFFSET)), "delete range");
+	int left = 0;
+	scan_keys(ba, data_key(*deleted, 0), data_key(*deleted, MAX_KEY_OFFSET), [&](KeyId, BlockID) {
+		left++;
+	});
+	expect(left == 0, "no blocks left in the range");
+	expect(!delete_range(ba, data_key(*deleted, 0), data_key(*deleted, MAX_KEY_OFFSET)) || buffer,
+			"nothing to delete the second time");
+	expect(sharing_active(ba), "subtrees queued for release");
+
+	int commits = 0;
+	while (sharing_active(ba) && commits < 1000) {
+		write_file(ba, *deleted, "x", 1, 0);
+		commits++;
+	}
+	printf("released the range over %d commits\n", commits);
+	expect(commits > 1 && !sharing_active(ba), "range released incrementally");
+	expect(read_file(ba, *kept, read.data(), read.size(), 0) == read.size() && read == data,
+			"other file intact");
+
+	close_file_system(ba);
+	ba.flush_all();
+	expect(check_image(f, 1), "fsck");
+	fclose(f);
+	return ok;
+}
+
+// A clone of a snapshot reads the files as they were when it was taken, and
+// deleting the snapshots gives their blocks back a few per commit.
+bool test_snapshots() {
+	FILE* f = fopen("snapshot_test.dat", "w+");
+	if (!f) return false;
+	bool ok = true;
+	auto expect = [&](bool passed, const char* what) {
+		if (!passed) printf("failed: %s\n", what);
+		ok = ok && passed;
+	};
+
+	BufferAllocator ba (f, 100);
+	create_file_system(ba, 10000);
+	create_root_directory(ba);
+	auto file = add_file(ba, 1, (char*)"file");
+	std::vector<char> before(256 * PAGE_SIZE, 'a');
+	std::vector<char> after(before.size(), 'b');
+	std::vector<char> read(before.size());
+	write_file(ba, *file, before.data(), before.size(), 0);
+
+	expect(create_snapshot(ba, "old"), "create snapshot");
+	expect(sharing_active(ba), "blocks shared with the snapshot");
+	write_file(ba, *file, after.data(), after.size(), 0);
+	auto added = add_file(ba, 1, (char*)"added");
+
+	expect(create_clone(ba, "old", "old-clone"), "create clone");
+	expect(!open_file_system(ba, "old"), "snapshots can't be mounted");
+	expect(open_file_system(ba, "old-clone"), "mount clone");
+	expect(read_file(ba, *file, read.data(), read.size(), 0) == read.size() && read == before,
+			"old contents in the clone");
+	expect(!find_entry(ba, 1, "added"), "no later files in the clone");
+
+	expect(open_file_system(ba), "mount live tree");
+	expect(read_file(ba, *file, read.data(), read.size(), 0) == read.size() && read == after,
+			"new contents in the live tree");
+	expect(find_entry(ba, 1, "added").has_value(), "later files in the live tree");
+
+	expect(delete_snapshot(ba, "old-clone"), "delete clone");
+	expect(delete_snapshot(ba, "old"), "delete snapshot");
+	int commits = 0;
+	while (sharing_active(ba) && commits < 1000) {
+		write_file(ba, *added, "x", 1, 0);
+		commits++;
+	}
+	printf("released deleted snapshots over %d commits\n", commits);
+	expect(commits > 1 && !sharing_active(ba), "snapshots released incrementally");
+
+	close_file_system(ba);
+	ba.flush_all();
+	expect(check_image(f, 1), "fsck");
+	fclose(f);
+	return ok;
+}
+
+// A large sequential write lands in consecutive blocks.
+bool test_sequential_layout() {
+	FILE* f = fopen("layout_test.dat", "w+");
+	if (!f) return false;
+	BufferAllocator ba (f, 100);
+	create_file_system(ba, 10000);
+	create_root_directory(ba);
+	auto file = add_file(ba, 1, (char*)"file");
+
+	// Partial blocks at either end.
+	std::vector<char> data(300 * PAGE_SIZE + 200);
+	for (size_t i = 0; i < data.size(); i++) data[i] = i % 251;
+	write_file(ba, *file, data.data(), data.size(), 100);
+
+	BlockID previous = 0;
+	int blocks = 0, consecutive = 0;
+	scan_keys(ba, data_key(*file, 0), data_key(*file, MAX_KEY_OFFSET), [&](KeyId, BlockID block) {
+		if (previous != 0 && block == previous + PAGE_SIZE) consecutive++;
+		previous = block;
+		blocks++;
+	});
+	printf("%d blocks, %d following the one before\n", blocks, consecutive);
+
+	std::vector<char> read(data.size() + 100);
+	bool contents = read_file(ba, *file, read.data(), read.size(), 0) == read.size()
+			&& std::all_of(read.begin(), read.begin() + 100, [](char c) { return c == 0; })
+			&& std::equal(data.begin(), data.end(), read.begin() + 100);
+	if (!contents) printf("contents differ\n");
+
+	close_file_system(ba);
+	fclose(f);
+	return contents && blocks == 301 && consecutive == blocks - 1;
+}
+
+// What a process synced before it was killed is replayed from the intent log
+// when the image is next opened.
+bool test_crash_recovery() {
+	FILE* f = fopen("recovery_test.dat", "w+");
+	if (!f) return false;
+	bool ok = true;
+	auto expect = [&](bool passed, const char* what) {
+		if (!passed) printf("failed: %s\n", what);
+		ok = ok && passed;
+	};
+
+	{
+		BufferAllocator ba (f, 100);
+		create_file_system(ba, 10000);
+		create_root_directory(ba);
+		close_file_system(ba);
+		ba.flush_all();
+	}
+
+	// Whole blocks and a partial one, then a write over the middle.
+	std::vector<char> data(3 * PAGE_SIZE + 100);
+	for (size_t i = 0; i < data.size(); i++) data[i] = i % 251;
+	std::fill(data.begin() + PAGE_SIZE - 10, data.begin() + PAGE_SIZE + 10, 'x');
+
+	int synced[2];
+	if (pipe(synced) != 0) return false;
+	fflush(nullptr);
+	auto child = fork();
+	if (child == 0) {
+		// Mounts, changes and syncs, then waits to be killed with nothing closed.
+		BufferAllocator ba (f, 100);
+		if (!open_file_system(ba) || !start_intent_log(ba, std::chrono::hours(1))) _exit(1);
+		auto dir = add_directory(ba, 1, (char*)"dir");
+		auto file = dir ? add_file(ba, *dir, (char*)"file") : std::nullopt;
+		if (!file) _exit(1);
+		write_file(ba, *file, data.data(), PAGE_SIZE - 10, 0);
+		write_file(ba, *file, data.data() + PAGE_SIZE + 10, data.size() - PAGE_SIZE - 10, PAGE_SIZE + 10);
+		write_file(ba, *file, data.data() + PAGE_SIZE - 10, 20, PAGE_SIZE - 10);
+		if (!sync_file_system(ba)) _exit(1);
+		char done = 1;
+		if (write(synced[1], &done, 1) != 1) _exit(1);
+		while (true) pause();
+	}
+
+	close(synced[1]);
+	char done = 0;
+	expect(child > 0 && read(synced[0], &done, 1) == 1, "changes synced");
+	close(synced[0]);
+	if (child > 0) {
+		kill(child, SIGKILL);
+		waitpid(child, nullptr, 0);
+	}
+
+	BufferAllocator ba (f, 100);
+	expect(open_file_system(ba), "recover");
+	auto dir = find_entry(ba, 1, "dir");
+	expect(dir && dir->second == IndexedDir, "directory replayed");
+	auto file = dir ? find_entry(ba, dir->first, "file") : std::nullopt;
+	expect(file && file->second == SmallFile, "file replayed");
+	if (file) {
+		std::vector<char> read(data.size() + 100);
+		expect(read_file(ba, file->first, read.data(), read.size(), 0) == data.size()
+				&& std::equal(data.begin(), data.end(), read.begin()), "writes replayed");
+	}
+
+	close_file_system(ba);
+	ba.flush_all();
+	expect(check_image(f, 1), "fsck");
+	fclose(f);
+	return ok;
+}
+
 int main(int argc, char** argv) {
 	if (argc < 2) return 0;
 
-	return fuse_start(argc, argv);
+	// cow fsck [image] [threads], the image must not be mounted.
+	if (strcmp(argv[1], "fsck") == 0) {
+		FILE* f = fopen(argc > 2 ? argv[2] : "test.dat", "r");
+		if (f == nullptr) {
+			perror("fsck");
+			return 1;
+		}
+		size_t threads = argc > 3 ? atoi(argv[3]) : std::thread::hardware_concurrency();
+		bool clean = check_image(f, threads);
+		fclose(f);
+		return clean ? 0 : 1;
+	}
 
 	if(strcmp(argv[1], "init") == 0){
 		FILE* f = fopen("test.dat", "r+");
@@ -224,7 +606,47 @@ int main(int argc, char** argv) {
 		BufferAllocator ba (f, 20);
 		int key = std::atoi(argv[2]);
 		inspect_block(ba, key);
-	} else if (strcmp(argv[1], "fuse") == 0) {
+		// Snapshot stuff, mount a clone with -o clone=NAME
+	} else if (strcmp(argv[1], "snapshot") == 0 && argc > 2) {
+		FILE* f = fopen("test.dat", "r+");
+		if (!f) return -1;
+		BufferAllocator ba (f, 20);
+		if (!open_file_system(ba)) return -1;
+		bool created = create_snapshot(ba, argv[2]);
+		close_file_system(ba);
+		if (!created) {
+			printf("couldn't create snapshot\n");
+			return 1;
+		}
+	} else if (strcmp(argv[1], "clone") == 0 && argc > 3) {
+		FILE* f = fopen("test.dat", "r+");
+		if (!f) return -1;
+		BufferAllocator ba (f, 20);
+		if (!open_file_system(ba)) return -1;
+		bool created = create_clone(ba, argv[2], argv[3]);
+		close_file_system(ba);
+		if (!created) {
+			printf("couldn't create clone\n");
+			return 1;
+		}
+	} else if (strcmp(argv[1], "delete_snapshot") == 0 && argc > 2) {
+		FILE* f = fopen("test.dat", "r+");
+		if (!f) return -1;
+		BufferAllocator ba (f, 20);
+		if (!open_file_system(ba)) return -1;
+		bool deleted = delete_snapshot(ba, argv[2]);
+		close_file_system(ba);
+		if (!deleted) {
+			printf("couldn't delete snapshot\n");
+			return 1;
+		}
+	} else if (strcmp(argv[1], "snapshots") == 0) {
+		FILE* f = fopen("test.dat", "r+");
+		if (!f) return -1;
+		BufferAllocator ba (f, 20);
+		if (!open_file_system(ba)) return -1;
+		list_snapshots(ba);
+		close_file_system(ba);
 
 		// Test stuff
 	} else if(strcmp(argv[1], "test_seq") == 0) {
@@ -240,5 +662,22 @@ int main(int argc, char** argv) {
 		int amount = std::atoi(argv[2]);
 		int del = std::atoi(argv[3]);
 		test_delete_random(amount, del);
+	} else if(strcmp(argv[1], "test_buffered") == 0) {
+		int amount = std::atoi(argv[2]);
+		return test_buffered(amount) ? 0 : 1;
+	} else if(strcmp(argv[1], "test_small_tree") == 0) {
+		return test_small_tree(false) && test_small_tree(true) ? 0 : 1;
+	} else if(strcmp(argv[1], "test_delete_range") == 0) {
+		return test_delete_range(false) && test_delete_range(true) ? 0 : 1;
+	} else if(strcmp(argv[1], "test_snapshots") == 0) {
+		return test_snapshots() ? 0 : 1;
+	} else if(strcmp(argv[1], "test_layout") == 0) {
+		return test_sequential_layout() ? 0 : 1;
+	} else if(strcmp(argv[1], "test_recovery") == 0) {
+		return test_crash_recovery() ? 0 : 1;
+	} else {
+		// Anything else is a mount, see fuse_start for the options.
+		return fuse_start(argc, argv);
 	}
+	return 0;
 }
@@ -1,8 +1,31 @@
+#include <algorithm>
 #include <cstring>
+#include <memory>
 
 #include "page_allocator.h"
 
 
+void FreedBlocks::sort_unique() {
+	std::sort(blocks.begin(), blocks.end());
+	blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+}
+
+// The lists of the calling thread's scopes, the innermost last.
+static thread_local std::vector<std::unique_ptr<FreedBlocks>> scoped_lists;
+static thread_local size_t scoped_depth = 0;
+
+ScopedFreedBlocks::ScopedFreedBlocks() {
+	if (scoped_depth == scoped_lists.size()) {
+		scoped_lists.push_back(std::make_unique<FreedBlocks>());
+	}
+	m_blocks = scoped_lists[scoped_depth++].get();
+	m_blocks->clear();
+}
+
+ScopedFreedBlocks::~ScopedFreedBlocks() {
+	scoped_depth--;
+}
+
 void initiate_page_allocator(BufferAllocator& ba, int total_pages) {
 	// TODO: do we actually need this function?
 }
@@ -41,6 +64,35 @@ BufferPointer allocate_page(BufferAllocator& ba) {
 	return free_block;
 }
 
+BlockID reserve_pages(BufferAllocator& ba, size_t count, bool zero) {
+	auto super_block_raw = ba.load(0);
+	SuperBlock* super_block = (SuperBlock*)super_block_raw.data();
+	auto& free_list = super_block->free_list;
+
+	auto first = free_list.highest_unallocated;
+	free_list.highest_unallocated += count * PAGE_SIZE;
+	super_block_raw.set_dirty();
+
+	for (size_t i = 0; zero && i < count; i++) {
+		auto page = ba.load(first + i * PAGE_SIZE);
+		memset(page.data(), 0, PAGE_SIZE);
+		page.set_dirty();
+	}
+	return first;
+}
+
+BlockID allocate_run(BufferAllocator& ba, size_t count) {
+	auto super_block_raw = ba.load(0);
+	SuperBlock* super_block = (SuperBlock*)super_block_raw.data();
+	auto& free_list = super_block->free_list;
+
+	// Freed pages are scattered, so runs always come from the watermark.
+	if (free_list.highest_unallocated + count * PAGE_SIZE > free_list.total_pages * PAGE_SIZE) {
+		return 0;
+	}
+	return reserve_pages(ba, count, false);
+}
+
 void free_page(BufferAllocator& ba, BlockID block_id) {
 	auto super_block_raw = ba.load(0);
 	SuperBlock* super_block = (SuperBlock*)super_block_raw.data();
@@ -56,12 +108,15 @@ void free_page(BufferAllocator& ba, BlockID block_id) {
 	super_block_raw.set_dirty();
 }
 
-void free_pages(BufferAllocator& ba, std::unordered_set<BlockID>& to_free) {
+void free_pages(BufferAllocator& ba, FreedBlocks& to_free) {
 	auto super_block_raw = ba.load(0);
 	SuperBlock* super_block = (SuperBlock*)super_block_raw.data();
 	auto& free_list = super_block->free_list;
 
-	for (auto block_id : to_free) {
+	// Pushed from the top down, so pages are handed out in image order.
+	to_free.sort_unique();
+	for (auto it = to_free.blocks.rbegin(); it != to_free.blocks.rend(); it++) {
+		auto block_id = *it;
 		// Freed block is the new head of the list.
 		auto freeing_raw = ba.load(block_id);
 		auto freeing = (FreeListPage*)freeing_raw.data();
@@ -72,3 +127,22 @@ void free_pages(BufferAllocator& ba, std::unordered_set<BlockID>& to_free) {
 
 	super_block_raw.set_dirty();
 }
+
+void rebuild_free_list(BufferAllocator& ba, const std::vector<bool>& in_use) {
+	auto super_block_raw = ba.load(0);
+	SuperBlock* super_block = (SuperBlock*)super_block_raw.data();
+	auto& free_list = super_block->free_list;
+
+	// Pushed from the top down, so pages are handed out in image order.
+	free_list.next_free = 0;
+	for (auto index = free_list.highest_unallocated / PAGE_SIZE; index-- > 1;) {
+		if (index < in_use.size() && in_use[index]) continue;
+
+		auto page_raw = ba.load(index * PAGE_SIZE);
+		((FreeListPage*)page_raw.data())->next = free_list.next_free;
+		free_list.next_free = index * PAGE_SIZE;
+		page_raw.set_dirty();
+	}
+
+	super_block_raw.set_dirty();
+}
@@ -1,13 +1,54 @@
 #pragma once
 
-#include <unordered_set>
+#include <vector>
 
 #include "buffer_allocator.h"
 #include "definitions.h"
 
 
+/*
+ * The blocks released by a single tree operation. A block can be added more
+ * than once, the list is sorted and deduplicated once before freeing.
+ */
+struct FreedBlocks {
+	std::vector<BlockID> blocks;
+
+	void insert(BlockID id) { blocks.push_back(id); }
+	void clear() { blocks.clear(); }
+	void sort_unique();
+};
+
+/*
+ * An empty list for the scope, borrowed from the calling thread. Lists keep
+ * their capacity when given back, so a steady state insert or delete never
+ * touches the heap, and a scope nested in another gets a list of its own.
+ */
+class ScopedFreedBlocks {
+	public:
+		ScopedFreedBlocks();
+		~ScopedFreedBlocks();
+		ScopedFreedBlocks(const ScopedFreedBlocks&) = delete;
+		ScopedFreedBlocks& operator=(const ScopedFreedBlocks&) = delete;
+
+		FreedBlocks& operator*() { return *m_blocks; }
+
+	private:
+		FreedBlocks* m_blocks;
+};
+
 void initiate_page_allocator(BufferAllocator& ba, int total_pages);
 
 BufferPointer allocate_page(BufferAllocator& ba);
+// Zeroes `count` contiguous pages above the watermark, returning the first.
+// Unless `zero` is false, for a region that is written before it is read.
+BlockID reserve_pages(BufferAllocator& ba, size_t count, bool zero = true);
+// Reserves `count` contiguous pages above the watermark for a sequential
+// write, returning the first, or 0 if the image has no room left there.
+// They aren't zeroed, so whole blocks can be written without loading them.
+BlockID allocate_run(BufferAllocator& ba, size_t count);
 void free_page(BufferAllocator& ba, BlockID);
-void free_pages(BufferAllocator& ba, std::unordered_set<BlockID>&);
+// Sorts and deduplicates the list first.
+void free_pages(BufferAllocator& ba, FreedBlocks&);
+// Replaces the free list with every page below the watermark not `in_use`,
+// indexed by page.
+void rebuild_free_list(BufferAllocator& ba, const std::vector<bool>& in_use);
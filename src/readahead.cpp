@@ -0,0 +1,87 @@
+#include <algorithm>
+
+#include "readahead.h"
+
+// A stream's window starts at and never shrinks below this.
+const size_t MIN_WINDOW = 32 * PAGE_SIZE;
+const size_t MAX_WINDOW = 1 << 23;
+// Sequential readers past this many queued fetches go without, the worker
+// is behind anyway.
+const size_t MAX_JOBS = 64;
+
+Readahead::Readahead(Fetch fetch) : m_fetch(std::move(fetch)) {}
+
+Readahead::~Readahead() {
+	stop();
+}
+
+void Readahead::run() {
+	std::unique_lock lock(m_lock);
+	while (true) {
+		m_changed.wait(lock, [&] { return m_stopping || !m_jobs.empty(); });
+		if (m_jobs.empty()) return;
+
+		auto job = m_jobs.front();
+		m_jobs.pop_front();
+		lock.unlock();
+		m_fetch(job.key, job.len, job.pos);
+		lock.lock();
+		job.stream->pending--;
+		m_changed.notify_all();
+	}
+}
+
+void Readahead::read(ReadStream& stream, KeyId key, size_t len, size_t pos) {
+	std::scoped_lock lock(m_lock);
+	auto end = pos + len;
+	if (pos != stream.next) {
+		stream.window = std::max(stream.window / 2, MIN_WINDOW);
+		stream.next = end;
+		stream.ahead = end;
+		return;
+	}
+
+	stream.window = stream.window == 0 ? MIN_WINDOW : std::min(stream.window * 2, MAX_WINDOW);
+	stream.next = end;
+	stream.ahead = std::max(stream.ahead, end);
+	if (stream.ahead - end > stream.window / 2 || m_jobs.size() >= MAX_JOBS) {
+		return;
+	}
+
+	m_jobs.push_back(Job {
+		.stream = &stream,
+		.key = key,
+		.len = end + stream.window - stream.ahead,
+		.pos = stream.ahead,
+	});
+	stream.ahead = end + stream.window;
+	stream.pending++;
+	if (!m_worker.joinable()) {
+		m_worker = std::thread([this] { run(); });
+	}
+	m_changed.notify_all();
+}
+
+void Readahead::forget(ReadStream& stream) {
+	std::unique_lock lock(m_lock);
+	std::erase_if(m_jobs, [&](const Job& job) {
+		if (job.stream != &stream) return false;
+		stream.pending--;
+		return true;
+	});
+	m_changed.wait(lock, [&] { return stream.pending == 0; });
+}
+
+void Readahead::stop() {
+	std::unique_lock lock(m_lock);
+	m_stopping = true;
+	m_changed.notify_all();
+	// A read meanwhile may start another worker, which stops too.
+	while (m_worker.joinable()) {
+		auto worker = std::move(m_worker);
+		lock.unlock();
+		worker.join();
+		lock.lock();
+	}
+	m_stopping = false;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "definitions.h"
+
+/*
+ * Reads ahead of files that are read sequentially. Each open file has a
+ * ReadStream noting where its last read ended. A read starting there is
+ * sequential and doubles the stream's window, up to a limit, anything else
+ * halves it and fetches nothing. Sequential readers are kept a window ahead
+ * of: once one is within half a window of what has been fetched, the next
+ * stretch is queued for a worker thread, so it's fetched while the reader
+ * is busy with what it has.
+ *
+ * What fetching means is up to the owner, it only has to be safe to do
+ * concurrently with reads.
+ */
+struct ReadStream {
+	// Where a sequential read would start.
+	size_t next { 0 };
+	size_t window { 0 };
+	// Everything before this has been fetched or is queued.
+	size_t ahead { 0 };
+	// Fetches queued or running for the stream.
+	size_t pending { 0 };
+};
+
+class Readahead {
+	public:
+		// Fetches `len` bytes of the file `key` from `pos`.
+		using Fetch = std::function<void(KeyId key, size_t len, size_t pos)>;
+
+	private:
+		struct Job {
+			ReadStream* stream;
+			KeyId key;
+			size_t len;
+			size_t pos;
+		};
+
+		Fetch m_fetch;
+		// Guards the streams as well as the queue.
+		std::mutex m_lock;
+		// Signalled when a job is queued, finishes, or the worker should stop.
+		std::condition_variable m_changed;
+		std::deque<Job> m_jobs;
+		std::thread m_worker;
+		bool m_stopping { false };
+
+		void run();
+
+	public:
+		explicit Readahead(Fetch fetch);
+		~Readahead();
+
+		// Notes that `len` bytes from `pos` of the file `key` were read
+		// through `stream`, queueing what should be fetched next.
+		void read(ReadStream& stream, KeyId key, size_t len, size_t pos);
+		// Drops the stream's queued fetches and waits for a running one,
+		// after which the stream can be freed.
+		void forget(ReadStream& stream);
+		// Finishes every queued fetch and stops the worker. The next read
+		// starts it again.
+		void stop();
+};
@@ -0,0 +1,407 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+#include "snapshot.h"
+#include "epoch.h"
+#include "BTree.h"
+
+void create_snapshot_tables(BufferAllocator& ba, size_t total_pages) {
+	auto share_pages = (total_pages + SHARES_PER_PAGE - 1) / SHARES_PER_PAGE;
+	auto share_table = reserve_pages(ba, share_pages);
+	auto snapshot_table = reserve_pages(ba, 1);
+
+	auto super_block_raw = ba.load(0);
+	auto super_block = (SuperBlock*)super_block_raw.data();
+	super_block->share_table = share_table;
+	super_block->share_table_pages = share_pages;
+	super_block->snapshot_table = snapshot_table;
+	super_block_raw.set_dirty();
+}
+
+std::pair<SnapshotTable*, BufferPointer> get_snapshot_table(BufferAllocator& ba) {
+	auto super_block_raw = ba.load(0);
+	auto table_id = ((SuperBlock*)super_block_raw.data())->snapshot_table;
+	auto table_raw = ba.load(table_id);
+	return {(SnapshotTable*)table_raw.data(), table_raw};
+}
+
+bool sharing_active(BufferAllocator& ba) {
+	auto [table, _] = get_snapshot_table(ba);
+	return table->count > 0 || table->drop_count > 0;
+}
+
+/*
+ * Share counts
+ */
+
+// Calls `f(block, is_node)` for every block `node` refers to: its children
+// or values, and the values of buffered insert messages. Values that
+// aren't blocks (see holds_block) are skipped.
+template <typename F>
+static void for_each_reference(FileTree::Node* node, F f) {
+	for (size_t i = 0; i < node->header.count; i++) {
+		if (!node->header.is_leaf) {
+			f(node->child_at(i), true);
+		} else if (holds_block(node->key_at(i))) {
+			f(node->value_at(i), false);
+		}
+	}
+	for (size_t i = 0; i < node->message_count(); i++) {
+		auto message = node->message_at(i);
+		if (!message.is_delete && holds_block(message.key)) f(message.value, false);
+	}
+}
+
+// Whether the tree keeps message buffers, in which case a value may still be
+// referenced by a node after it was logically replaced.
+static bool buffered(BufferAllocator& ba) {
+	auto super_block_raw = ba.load(0);
+	return ((SuperBlock*)super_block_raw.data())->buffer_nodes;
+}
+
+// The references to `id` beyond the first. Blocks past the end of the table
+// (or on images without one) are never shared.
+static std::pair<ShareCount*, BufferPointer> get_share_count(BufferAllocator& ba, BlockID id) {
+	auto super_block_raw = ba.load(0);
+	auto super_block = (SuperBlock*)super_block_raw.data();
+
+	auto index = id / PAGE_SIZE;
+	auto table_page = index / SHARES_PER_PAGE;
+	if (super_block->share_table == 0 || table_page >= super_block->share_table_pages) {
+		return {nullptr, BufferPointer()};
+	}
+
+	auto page_raw = ba.load(super_block->share_table + table_page * PAGE_SIZE);
+	return {(ShareCount*)page_raw.data() + index % SHARES_PER_PAGE, page_raw};
+}
+
+bool owns_value(BufferAllocator& ba, BlockID root, KeyId key, BlockID value) {
+	if (!sharing_active(ba)) return true;
+
+	thread_local std::vector<BlockID> path;
+	FileTree::find_path(ba, root, key, path);
+	path.push_back(value);
+	for (auto id : path) {
+		auto [count, _] = get_share_count(ba, id);
+		if (count && *count > 0) return false;
+	}
+	return true;
+}
+
+static void share_block(BufferAllocator& ba, BlockID id) {
+	auto [count, count_raw] = get_share_count(ba, id);
+	if (!count) return;
+
+	(*count)++;
+	count_raw.set_dirty();
+}
+
+// Drops a reference to `id`, returning true if it was the last one.
+static bool unshare_block(BufferAllocator& ba, BlockID id) {
+	auto [count, count_raw] = get_share_count(ba, id);
+	if (!count || *count == 0) return true;
+
+	(*count)--;
+	count_raw.set_dirty();
+	return false;
+}
+
+// Drops the reference `entry`. If it was the last one the block is freed,
+// and the nodes it held are handed to `push` to be dropped in turn. Values
+// are dropped straight away, so `push` sees at most a node's children.
+template <typename Push>
+static void release_one(BufferAllocator& ba, DropEntry entry, FreedBlocks& freed, Push push) {
+	if (!unshare_block(ba, entry.block)) return;
+
+	freed.insert(entry.block);
+	if (!entry.is_node) return;
+
+	auto node_raw = ba.load(entry.block);
+	auto node = (FileTree::Node*)node_raw.data();
+	for_each_reference(node, [&](BlockID block, bool is_node) {
+		if (!is_node) {
+			if (unshare_block(ba, block)) freed.insert(block);
+			return;
+		}
+		push(DropEntry {
+			.block = block,
+			.is_node = true,
+		});
+	});
+}
+
+void release_replaced(BufferAllocator& ba, FreedBlocks& freed,
+		BlockID old_root, BlockID new_root, std::span<const BlockID> dropped_values) {
+	// Buffered nodes can still hold a value the operation replaced, so
+	// those trees are always accounted by what is reachable.
+	if (!sharing_active(ba) && !buffered(ba)) {
+		// Every block has a single owner, so whatever the operation
+		// replaced is garbage.
+		for (auto value : dropped_values) {
+			if (value != 0) freed.insert(value);
+		}
+		return;
+	}
+
+	// Every block a new node points to was either written by this
+	// operation, or carried over from one of the nodes it replaced.
+	thread_local std::vector<BlockID> carried;
+	carried.clear();
+	for (auto id : freed.blocks) {
+		auto node_raw = ba.load(id);
+		auto node = (FileTree::Node*)node_raw.data();
+		for_each_reference(node, [&](BlockID block, bool) {
+			carried.push_back(block);
+		});
+	}
+	std::sort(carried.begin(), carried.end());
+	auto is_carried = [&](BlockID id) {
+		return std::binary_search(carried.begin(), carried.end(), id);
+	};
+
+	// The new nodes take a reference to each old block they point to.
+	thread_local std::vector<BlockID> written;
+	written.clear();
+	if (is_carried(new_root)) {
+		share_block(ba, new_root);
+	} else {
+		written.push_back(new_root);
+	}
+	while (!written.empty()) {
+		auto id = written.back();
+		written.pop_back();
+
+		auto node_raw = ba.load(id);
+		auto node = (FileTree::Node*)node_raw.data();
+		for_each_reference(node, [&](BlockID block, bool is_node) {
+			if (is_carried(block)) {
+				share_block(ba, block);
+			} else if (is_node) {
+				written.push_back(block);
+			}
+		});
+	}
+
+	// Then this tree gives up the old root. Only what no other tree
+	// still reaches is freed, which includes the dropped values.
+	freed.clear();
+	thread_local std::vector<DropEntry> releasing;
+	releasing.clear();
+	releasing.push_back(DropEntry {
+		.block = old_root,
+		.is_node = true,
+	});
+	while (!releasing.empty()) {
+		auto entry = releasing.back();
+		releasing.pop_back();
+		release_one(ba, entry, freed, [&](DropEntry child) {
+			releasing.push_back(child);
+		});
+	}
+}
+
+/*
+ * Snapshot table
+ */
+
+std::optional<size_t> find_snapshot(BufferAllocator& ba, const char* name) {
+	auto [table, _] = get_snapshot_table(ba);
+
+	for (size_t i = 0; i < MAX_SNAPSHOTS; i++) {
+		auto& entry = table->entries[i];
+		if (entry.in_use && strncmp(entry.name, name, MAX_SNAPSHOT_NAME) == 0) {
+			return i;
+		}
+	}
+	return {};
+}
+
+std::optional<size_t> add_snapshot(BufferAllocator& ba, const char* name, BlockID root, bool writable) {
+	auto [table, table_raw] = get_snapshot_table(ba);
+	if (strlen(name) >= MAX_SNAPSHOT_NAME || find_snapshot(ba, name)) {
+		return {};
+	}
+
+	for (size_t i = 0; i < MAX_SNAPSHOTS; i++) {
+		auto& entry = table->entries[i];
+		if (entry.in_use) continue;
+
+		entry = SnapshotEntry {
+			.root = root,
+			.in_use = true,
+			.writable = writable,
+		};
+		strncpy(entry.name, name, MAX_SNAPSHOT_NAME);
+		table->count++;
+		table_raw.set_dirty();
+
+		share_block(ba, root);
+		return i;
+	}
+	return {};
+}
+
+// Releasing a tree depth first never queues more than a node's worth of
+// references per level, this leaves room for that below any queued roots.
+const size_t DROP_HEADROOM = 16 * FileTree::max_capacity<FileTree::Child>;
+
+void drop_snapshot(BufferAllocator& ba, size_t index) {
+	auto [table, table_raw] = get_snapshot_table(ba);
+
+	if (table->drop_count + DROP_HEADROOM >= MAX_DROP_ENTRIES) {
+		reclaim_dropped_snapshots(ba, 0);
+	}
+
+	auto& entry = table->entries[index];
+	table->drops[table->drop_count++] = DropEntry {
+		.block = entry.root,
+		.is_node = true,
+	};
+	entry = SnapshotEntry {};
+	table->count--;
+	table_raw.set_dirty();
+}
+
+void make_drop_room(BufferAllocator& ba) {
+	auto [table, _] = get_snapshot_table(ba);
+	if (table && table->drop_count + DROP_HEADROOM >= MAX_DROP_ENTRIES) {
+		reclaim_dropped_snapshots(ba, 0);
+	}
+}
+
+bool queue_release(BufferAllocator& ba, std::span<const BlockID> roots) {
+	auto [table, table_raw] = get_snapshot_table(ba);
+	if (roots.empty()) return true;
+	assert(table->drop_count + DROP_HEADROOM < MAX_DROP_ENTRIES);
+
+	// The old tree still references the roots until the commit releases
+	// it, the gathering nodes take a reference of their own.
+	for (auto root : roots) {
+		share_block(ba, root);
+	}
+
+	// Release doesn't care about keys or heights, so any interior node
+	// will do to gather them.
+	thread_local std::vector<BlockID> level;
+	thread_local std::vector<BlockID> gathered;
+	level.assign(roots.begin(), roots.end());
+	const auto capacity = FileTree::plain_capacity<FileTree::Child>;
+	while (level.size() > 1) {
+		gathered.clear();
+		for (size_t start = 0; start < level.size(); start += capacity) {
+			auto node = FileTree::Interior {
+				.header = BTNodeHeader {
+					.is_leaf = false,
+					.count = std::min(capacity, level.size() - start),
+				},
+			};
+			for (size_t i = 0; i < node.header.count; i++) {
+				node.pairs[i] = FileTree::Child {
+					.key = FileTree::MAX_KEY,
+					.value = level[start + i],
+				};
+			}
+			gathered.push_back(FileTree::write_node(ba, node).id());
+		}
+		level.swap(gathered);
+	}
+
+	table->drops[table->drop_count++] = DropEntry {
+		.block = level[0],
+		.is_node = true,
+	};
+	table_raw.set_dirty();
+	return true;
+}
+
+void release_tree(BufferAllocator& ba, BlockID root) {
+	ScopedFreedBlocks scope;
+	auto& freed = *scope;
+	thread_local std::vector<DropEntry> releasing;
+	releasing.clear();
+	releasing.push_back(DropEntry {
+		.block = root,
+		.is_node = true,
+	});
+	while (!releasing.empty()) {
+		auto entry = releasing.back();
+		releasing.pop_back();
+		release_one(ba, entry, freed, [&](DropEntry child) {
+			releasing.push_back(child);
+		});
+	}
+	retire_pages(ba, freed);
+}
+
+// Blocks freed before handing them over, keeping the duplicate check short.
+const size_t DROP_BATCH = 64;
+
+void reclaim_dropped_snapshots(BufferAllocator& ba, size_t budget) {
+	auto [table, table_raw] = get_snapshot_table(ba);
+	if (table->drop_count == 0) return;
+
+	size_t done = 0;
+	while (table->drop_count > 0 && (budget == 0 || done < budget)) {
+		ScopedFreedBlocks scope;
+		auto& freed = *scope;
+		for (size_t i = 0; i < DROP_BATCH && table->drop_count > 0
+				&& (budget == 0 || done < budget); i++, done++) {
+			auto entry = table->drops[--table->drop_count];
+			release_one(ba, entry, freed, [&](DropEntry child) {
+				assert(table->drop_count < MAX_DROP_ENTRIES);
+				table->drops[table->drop_count++] = child;
+			});
+		}
+		table_raw.set_dirty();
+		retire_pages(ba, freed);
+	}
+}
+
+void recount_shares(BufferAllocator& ba, std::vector<bool>& reached) {
+	auto super_block_raw = ba.load(0);
+	auto super_block = (SuperBlock*)super_block_raw.data();
+	auto [table, table_raw] = get_snapshot_table(ba);
+	auto pages = super_block->free_list.highest_unallocated / PAGE_SIZE;
+
+	// References to each page, as fsck counts them: once per root and per
+	// node, with shared subtrees only walked the first time.
+	std::vector<uint32_t> references(pages);
+	std::vector<BlockID> walking;
+	auto reference = [&](BlockID id, bool is_node) {
+		auto index = id / PAGE_SIZE;
+		if (index >= pages) return;
+		if (references[index]++ == 0 && is_node) walking.push_back(id);
+	};
+	reference(super_block->tree_root, true);
+	if (table) {
+		for (auto& entry : table->entries) {
+			if (entry.in_use) reference(entry.root, true);
+		}
+		table->drop_count = 0;
+		table_raw.set_dirty();
+	}
+	while (!walking.empty()) {
+		auto id = walking.back();
+		walking.pop_back();
+
+		auto node_raw = ba.load(id);
+		for_each_reference((FileTree::Node*)node_raw.data(), reference);
+	}
+
+	for (size_t i = 0; i < super_block->share_table_pages; i++) {
+		auto page_raw = ba.load(super_block->share_table + i * PAGE_SIZE);
+		auto counts = (ShareCount*)page_raw.data();
+		for (size_t j = 0; j < SHARES_PER_PAGE; j++) {
+			auto index = i * SHARES_PER_PAGE + j;
+			counts[j] = index < pages && references[index] > 1 ? references[index] - 1 : 0;
+		}
+		page_raw.set_dirty();
+	}
+
+	reached.assign(pages, false);
+	for (size_t i = 0; i < pages; i++) {
+		reached[i] = references[i] > 0;
+	}
+}
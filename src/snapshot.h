@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "buffer_allocator.h"
+#include "page_allocator.h"
+#include "definitions.h"
+
+/*
+ * Snapshots and clones.
+ *
+ * A snapshot is just another reference to a tree root, so taking one is
+ * O(1) and the trees share every block until one side copies it on write.
+ * Block lifetime is tracked with a share count per page, held in a table
+ * reserved when the file system is created. The table stores references
+ * beyond the first, so it is all zeroes while nothing is shared and commits
+ * only consult it while a snapshot exists.
+ *
+ * Values in the tree are the blocks of files and directories, and are
+ * counted the same way as nodes.
+ */
+
+// Share counts are stored per page, PAGE_SIZE / 2 pages per table page.
+using ShareCount = uint16_t;
+const size_t SHARES_PER_PAGE = PAGE_SIZE / sizeof(ShareCount);
+
+const size_t MAX_SNAPSHOTS = 32;
+const size_t MAX_SNAPSHOT_NAME = 32;
+
+struct [[gnu::packed]] SnapshotEntry {
+	BlockID root { 0 };
+	char name[MAX_SNAPSHOT_NAME];
+	bool in_use { false };
+	// Clones can be mounted and modified, snapshots are read only.
+	bool writable { false };
+	// Keeps the roots 8 byte aligned.
+	uint8_t unused[6];
+};
+
+// A reference still to be released by a deleted snapshot.
+struct [[gnu::packed]] DropEntry {
+	BlockID block { 0 };
+	bool is_node { false };
+};
+
+const size_t MAX_DROP_ENTRIES = (PAGE_SIZE - 2 * sizeof(size_t)
+		- MAX_SNAPSHOTS * sizeof(SnapshotEntry)) / sizeof(DropEntry);
+
+struct [[gnu::packed]] SnapshotTable {
+	size_t count { 0 };
+	SnapshotEntry entries[MAX_SNAPSHOTS];
+	// Deleted snapshots are released depth first, a few blocks per commit.
+	size_t drop_count { 0 };
+	DropEntry drops[MAX_DROP_ENTRIES];
+};
+
+// Reserve the share and snapshot tables, called when creating the image.
+void create_snapshot_tables(BufferAllocator& ba, size_t total_pages);
+
+// Null on images created before snapshots existed.
+std::pair<SnapshotTable*, BufferPointer> get_snapshot_table(BufferAllocator& ba);
+
+// Whether any block may currently be referenced more than once.
+bool sharing_active(BufferAllocator& ba);
+
+// Whether `value`, the record of `key` in the tree at `root`, is referenced
+// by that tree alone, so it can be modified in place. Shares are counted
+// lazily, so every node on the way to the record must be unshared too.
+bool owns_value(BufferAllocator& ba, BlockID root, KeyId key, BlockID value);
+
+/*
+ * Work out which blocks a commit really frees. `freed` holds the nodes the
+ * tree operation replaced, and is rewritten to the blocks no tree references
+ * any more. `dropped_values` are the values the operation replaced or
+ * removed, 0 entries are ignored.
+ */
+void release_replaced(BufferAllocator& ba, FreedBlocks& freed,
+		BlockID old_root, BlockID new_root, std::span<const BlockID> dropped_values);
+
+/*
+ * Subtrees detached by a range delete are released like deleted snapshots,
+ * a few blocks per commit. They are queued before the operation commits,
+ * gathered under nodes written for the purpose so they take a single drop
+ * entry. Queuing returns false on images without a snapshot table, which
+ * release each tree with release_tree once the commit is published instead.
+ */
+// Call before the operation starts, this may release queued blocks.
+void make_drop_room(BufferAllocator& ba);
+bool queue_release(BufferAllocator& ba, std::span<const BlockID> roots);
+void release_tree(BufferAllocator& ba, BlockID root);
+
+std::optional<size_t> find_snapshot(BufferAllocator& ba, const char* name);
+// Records a new reference to `root`.
+std::optional<size_t> add_snapshot(BufferAllocator& ba, const char* name, BlockID root, bool writable);
+// Removes the entry and queues its tree to be released.
+void drop_snapshot(BufferAllocator& ba, size_t index);
+
+// Release up to `budget` blocks of deleted snapshots, or all of them if 0.
+// The caller must hold the writer lock.
+void reclaim_dropped_snapshots(BufferAllocator& ba, size_t budget);
+
+/*
+ * Recounts every share from what the trees of the super block and snapshot
+ * table reference, for an image whose counts can't be trusted, such as one
+ * put back to a checkpoint (see intent_log.h). Deleted snapshots still
+ * queued are forgotten, their blocks left unreachable. Sets `reached` for
+ * every page below the watermark that a tree references.
+ */
+void recount_shares(BufferAllocator& ba, std::vector<bool>& reached);